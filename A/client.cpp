@@ -17,6 +17,13 @@
 #include <sys/time.h>
 
 #include "../include/UAP_header.h"
+#include "../include/reliability.h"
+#include "../include/rate_control.h"
+#include "../include/admission.h"
+#include "../include/hello_opts.h"
+#include "../include/latency_histogram.h"
+#include "../include/thread_safe_queue.h"
+#include "../include/checkpoint.h"
 
 using namespace std;
 
@@ -28,48 +35,49 @@ const string SENTINEL_QUIT = "---QUIT---";
 
 enum ClientState { HELLO_WAIT, READY, READY_TIMER, CLOSING, CLOSED };
 
-template<typename T>
-class ThreadSafeQueue {
-private:
-    std::queue<T> queue;
-    mutable mutex mtx;
-    condition_variable cv;
-public:
-    void push(T item) {
-        lock_guard<mutex> lock(mtx);
-        queue.push(item);
-        cv.notify_one();
-    }
-    bool try_pop(T& item) {
-        lock_guard<mutex> lock(mtx);
-        if (queue.empty()) {
-            return false;
-        }
-        item = queue.front();
-        queue.pop();
-        return true;
-    }
-};
-
 // Global Shared Resources
 ThreadSafeQueue<string> stdin_queue;
 ThreadSafeQueue<vector<char>> network_queue;
 atomic<bool> running(true);
 uint64_t client_logical_clock = 0;
+RetransmitBuffer retransmit_buffer; // DATA sent but not yet acknowledged by the server
+Pacer pacer(0, true);               // adaptive pacing unless --rate is given
+LatencyHistogram rtt_histogram;     // DATA -> ALIVE round trips
 
 // Function Prototypes
-void stdin_reader_thread();
+void stdin_reader_thread(uint64_t resume_offset);
 void network_receiver_thread(int sockfd);
 void send_uap_message(int sockfd, const struct sockaddr* addr, uint32_t session_id, uint32_t& seq_num, uint8_t command, const string& payload = "");
+void resend_uap_message(int sockfd, const struct sockaddr* addr, int32_t seq_num);
 uint64_t get_current_microseconds();
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        cerr << "Usage: " << argv[0] << " <hostname> <portnum>" << endl;
+    if (argc < 3 || argc % 2 != 1) {
+        cerr << "Usage: " << argv[0] << " <hostname> <portnum> [--rate <bytes/s, 0 = unpaced>] [--ack-every N] [--ack-delay ms] [--transfer-id id]" << endl;
         return 1;
     }
     string hostname = argv[1];
     int port = atoi(argv[2]);
+    HelloOptions hello_options; // delayed acks, if asked for
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--rate") {
+            double rate = atof(argv[i + 1]);
+            pacer = Pacer(rate, false);
+        } else if (string(argv[i]) == "--ack-every") {
+            hello_options.set_u16(HELLO_OPT_ACK_EVERY, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--ack-delay") {
+            hello_options.set_u16(HELLO_OPT_ACK_DELAY_MS, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--transfer-id") {
+            if (!valid_transfer_id(argv[i + 1])) {
+                cerr << "Transfer ids are up to " << TRANSFER_ID_MAX << " letters, digits, '.', '-' or '_'" << endl;
+                return 1;
+            }
+            hello_options.set(HELLO_OPT_TRANSFER_ID, argv[i + 1]);
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
 
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) { perror("ERROR opening socket"); return 1; }
@@ -96,19 +104,26 @@ int main(int argc, char* argv[]) {
 
     double total_latency = 0.0;
     int packet_count = 0;
+    bool shutdown_pending = false; // EOF seen, waiting for unacked DATA to drain
+    string stdin_line;
+    bool has_stdin_line = false;
+    bool resumable = false;     // the server keeps checkpoints of this transfer
+    uint64_t input_offset = 0;  // input bytes sent, counting those sent by earlier sessions
 
-    auto initiate_shutdown = [&]() {
-        send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_GOODBYE);
+    // A transfer that ends because the whole input was sent tells the server so
+    auto initiate_shutdown = [&](bool complete) {
+        send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_GOODBYE,
+                         complete && resumable ? encode_offset(input_offset) : "");
         state = CLOSING;
         timer_start = chrono::steady_clock::now();
         timer_active = true;
     };
     
-    thread stdin_thread(stdin_reader_thread);
+    thread stdin_thread; // started once the HELLO reply says where to start reading
     thread network_thread(network_receiver_thread, sockfd);
 
     cout << "Starting session 0x" << hex << session_id << dec << endl;
-    send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_HELLO);
+    send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_HELLO, hello_options.encode());
     timer_start = chrono::steady_clock::now();
     timer_active = true;
     state = HELLO_WAIT;
@@ -116,7 +131,9 @@ int main(int argc, char* argv[]) {
     while (running && state != CLOSED) {
         // Check for Network Packets
         vector<char> packet_data;
+        bool network_idle = true;
         if (network_queue.try_pop(packet_data)) {
+            network_idle = false;
             if (packet_data.size() < sizeof(UAP_header)) continue;
             
             UAP_header* header = (UAP_header*)packet_data.data();
@@ -140,10 +157,70 @@ int main(int argc, char* argv[]) {
                 continue;
             }
 
+            const char* payload = packet_data.data() + sizeof(UAP_header);
+            size_t payload_len = packet_data.size() - sizeof(UAP_header);
+            if (header->command == UAP_COMMAND_ALIVE) {
+                int32_t ack;
+                if (decode_ack(payload, payload_len, ack)) {
+                    int64_t rtt_us;
+                    if (retransmit_buffer.rtt_sample(ack, rtt_us)) {
+                        // Don't count the time the server held a delayed ALIVE back
+                        rtt_us = max<int64_t>(1, rtt_us - decode_ack_delay(payload, payload_len));
+                        rtt_histogram.record(rtt_us);
+                        retransmit_buffer.on_rtt_sample(rtt_us);
+                        pacer.on_rtt_sample(rtt_us);
+                    }
+                    retransmit_buffer.ack_through(ack);
+                }
+            } else if (header->command == UAP_COMMAND_NACK) {
+                vector<SeqRange> ranges;
+                if (decode_nack(payload, payload_len, ranges) && !ranges.empty()) {
+                    // Everything before the first gap has been delivered
+                    retransmit_buffer.ack_through(ranges.front().first - 1);
+                    pacer.on_loss();
+                    for (auto const& [first, last] : ranges) {
+                        cout << "NACK [" << first << "-" << last << "], resending." << endl;
+                        for (int32_t seq = first; seq <= last; seq++) {
+                            resend_uap_message(sockfd, (struct sockaddr*)&serv_addr, seq);
+                        }
+                    }
+                }
+                if (state == READY_TIMER) {
+                    timer_start = chrono::steady_clock::now(); // server is alive, keep waiting for ALIVE
+                }
+            } else if (header->command == UAP_COMMAND_BUSY) {
+                if (state == HELLO_WAIT) {
+                    cout << "Server busy, session refused. Closing." << endl;
+                    state = CLOSED;
+                    continue;
+                }
+                // Backpressure: the server dropped a packet, slow down and resend
+                // the one it is waiting for (that one is always admitted)
+                pacer.on_loss();
+                uint8_t reason;
+                int32_t ack;
+                if (decode_busy(payload, payload_len, reason, ack)) {
+                    retransmit_buffer.ack_through(ack);
+                    resend_uap_message(sockfd, (struct sockaddr*)&serv_addr, ack + 1);
+                }
+            }
+
             switch (state) {
                 case HELLO_WAIT:
                     if (header->command == UAP_COMMAND_HELLO) {
                         cout << "Received HELLO from server. Session established." << endl;
+                        HelloOptions accepted;
+                        uint16_t ack_every, ack_delay_ms;
+                        if (accepted.decode(packet_data.data() + sizeof(UAP_header), packet_data.size() - sizeof(UAP_header))
+                            && accepted.get_u16(HELLO_OPT_ACK_EVERY, ack_every) && accepted.get_u16(HELLO_OPT_ACK_DELAY_MS, ack_delay_ms)) {
+                            cout << "Delayed acks: one ALIVE per " << ack_every << " packets or " << ack_delay_ms << " ms." << endl;
+                        }
+                        string transfer_id;
+                        if (accepted.get(HELLO_OPT_TRANSFER_ID, transfer_id) && accepted.get_u64(HELLO_OPT_RESUME_OFFSET, input_offset)) {
+                            resumable = true;
+                            cout << "Transfer " << transfer_id << ", resuming at byte " << input_offset << "." << endl;
+                        }
+                        stdin_thread = thread(stdin_reader_thread, input_offset);
                         state = READY;
                         timer_active = false;
                     }
@@ -163,21 +240,44 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        // Check for Stdin Lines
-        string stdin_line;
-        if (state == READY || state == READY_TIMER) {
-            if (stdin_queue.try_pop(stdin_line)) {
+        // Check for Stdin Lines (a popped line waits here until the pacer lets it go)
+        if ((state == READY || state == READY_TIMER) && !shutdown_pending && !retransmit_buffer.full()) {
+            if (has_stdin_line || stdin_queue.try_pop(stdin_line)) {
+                has_stdin_line = true;
                 if (stdin_line == SENTINEL_EOF || stdin_line == SENTINEL_QUIT) {
-                    initiate_shutdown();
+                    shutdown_pending = true;
+                    has_stdin_line = false;
                 } else {
-                    send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_DATA, stdin_line);
-                    state = READY_TIMER;
-                    timer_start = chrono::steady_clock::now();
-                    timer_active = true;
+                    size_t packet_len = sizeof(UAP_header) + stdin_line.length();
+                    int64_t wait_ns = pacer.delay_ns(packet_len);
+                    if (wait_ns == 0) {
+                        send_uap_message(sockfd, (struct sockaddr*)&serv_addr, session_id, sequence_number, UAP_COMMAND_DATA, stdin_line);
+                        pacer.on_sent(packet_len);
+                        input_offset += stdin_line.length() + 1;
+                        has_stdin_line = false;
+                        state = READY_TIMER;
+                        timer_start = chrono::steady_clock::now();
+                        timer_active = true;
+                    } else if (network_idle) {
+                        // Short sleep; network packets keep queueing in the receiver thread
+                        sleep_until_ns(monotonic_ns() + min<int64_t>(wait_ns, 1000000));
+                    }
                 }
             }
         }
         
+        // Say GOODBYE only once everything sent has been acknowledged
+        if (shutdown_pending && retransmit_buffer.empty() && (state == READY || state == READY_TIMER)) {
+            shutdown_pending = false;
+            initiate_shutdown(true);
+        }
+
+        // Tail loss probe: nothing acknowledged for a while, resend the newest packet
+        if ((state == READY || state == READY_TIMER) && retransmit_buffer.probe_due()) {
+            resend_uap_message(sockfd, (struct sockaddr*)&serv_addr, retransmit_buffer.newest());
+            retransmit_buffer.probe_sent();
+        }
+
         // Check Timers
         if (timer_active) {
             auto now = chrono::steady_clock::now();
@@ -189,7 +289,7 @@ int main(int argc, char* argv[]) {
                     state = CLOSED;
                 } else { // Timeout in HELLO_WAIT or READY_TIMER
                     cout << "[ERROR] Server response timed out. Sending GOODBYE." << endl;
-                    initiate_shutdown();
+                    initiate_shutdown(false);
                 }
             }
         }
@@ -205,14 +305,30 @@ int main(int argc, char* argv[]) {
         double avg_latency = total_latency / packet_count;
         cout << "Average one-way latency: " << fixed << setprecision(2) << avg_latency << " ms" << endl;
     }
+    if (pacer.is_adaptive()) {
+        cout << "Final send rate: " << fixed << setprecision(0) << pacer.get_rate() << " B/s (smoothed RTT " << pacer.get_srtt_us() << " us)" << endl;
+    }
+    if (rtt_histogram.count() > 0) {
+        rtt_histogram.print(cout, "Round trip (us)");
+    }
     
     cout << "Client shut down." << endl;
     exit(0);
 }
 
-void stdin_reader_thread() {
+// Reads stdin line by line from `resume_offset` on: a file is seeked, anything
+// else is read over.
+void stdin_reader_thread(uint64_t resume_offset) {
+    uint64_t skip = resume_offset;
+    if (skip > 0 && fseeko(stdin, skip, SEEK_SET) == 0) {
+        skip = 0;
+    }
     string line;
     while (running && getline(cin, line)) {
+        if (skip > 0) {
+            skip = line.length() + 1 <= skip ? skip - line.length() - 1 : 0;
+            continue;
+        }
         client_logical_clock++; 
         if (line == "q" && isatty(STDIN_FILENO)) {
             stdin_queue.push(SENTINEL_QUIT);
@@ -259,9 +375,23 @@ void send_uap_message(int sockfd, const struct sockaddr* addr, uint32_t session_
     memcpy(buffer.data(), &header, sizeof(UAP_header));
     memcpy(buffer.data() + sizeof(UAP_header), payload.c_str(), payload.length());
 
+    // Stored first so the RTT clock starts before the server can possibly answer
+    if (command == UAP_COMMAND_DATA) {
+        retransmit_buffer.store(seq_num - 1, buffer.data(), buffer.size());
+    }
+
     sendto(sockfd, buffer.data(), buffer.size(), 0, addr, sizeof(struct sockaddr_in));
 }
 
+void resend_uap_message(int sockfd, const struct sockaddr* addr, int32_t seq_num) {
+    RetransmitBuffer::Entry* entry = retransmit_buffer.take_for_resend(seq_num, get_current_microseconds());
+    if (entry == nullptr) {
+        return;
+    }
+    sendto(sockfd, entry->packet.data(), entry->packet.size(), 0, addr, sizeof(struct sockaddr_in));
+    pacer.on_sent(entry->packet.size());
+}
+
 uint64_t get_current_microseconds() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
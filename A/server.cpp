@@ -12,39 +12,118 @@
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <errno.h>
 
 #include "../include/UAP_header.h"
+#include "../include/reliability.h"
+#include "../include/admission.h"
+#include "../include/seq_window.h"
+#include "../include/udp_offload.h"
+#include "../include/hello_opts.h"
+#include "../include/low_latency.h"
+#include "../include/trace_file.h"
+#include "../include/compact_header.h"
+#include "../include/af_xdp.h"
+#include "../include/drr_scheduler.h"
+#include "../include/shm_ring.h"
+#include "../include/checkpoint.h"
 
 using namespace std;
 
 // Constants
-const int BUFFER_SIZE = 2048;
 const int SESSION_TIMEOUT_SECONDS = 10;
+const int SCHEDULER_BATCH = 64;     // datagrams handled per loop pass before reading the socket again
 
 struct Session {
-    struct sockaddr_in client_addr;
-    uint32_t expected_seq_num;
-    time_t last_message_time;
-    double total_latency;
-    int packet_count;
+    struct sockaddr_in client_addr = {};
+    uint32_t expected_seq_num = 0;
+    time_t last_message_time = 0;
+    double total_latency = 0;
+    int packet_count = 0;
+    ReorderBuffer<string> reorder; // DATA received ahead of a gap
+    size_t held_bytes = 0;         // datagram bytes charged for `reorder`
+    size_t queued_bytes = 0;       // datagram bytes charged while waiting in the scheduler
+    SequenceWindow window;         // which recent sequence numbers were received
+    AckScheduler acks;             // when the next cumulative ALIVE is due
+    uint8_t version = UAP_VERSION; // header version negotiated in the HELLO
+    CompactBase client_base;       // v2: the client's deltas are against its HELLO
+    CompactBase server_base;       // v2: ours against our HELLO reply
+    string hello_packet;           // our HELLO reply as sent, for a client that missed it
+    uint16_t priority = SESSION_PRIORITY_DEFAULT; // scheduling weight negotiated in the HELLO
+    string transfer_id;            // resumable transfer, if the client named one
+    uint64_t committed = 0;        // input bytes of the transfer delivered in order
+    uint64_t checkpointed = 0;     // what the checkpoint on disk says
+    uint64_t checkpoint_time = 0;  // when it was written (us)
+};
+
+struct QueuedDatagram {
+    string data;
+    struct sockaddr_in from;
+    bool session_charged;   // counted in its session's queued_bytes, not just globally
 };
 
 // Global server state
 map<uint32_t, Session> sessions;
 uint64_t server_logical_clock = 0;
 uint32_t server_sequence_number = 0;
+AdmissionControl admission;
+int window_width = SEQ_WINDOW_DEFAULT;
+LowLatencyOptions low_latency;
+TraceWriter capture;                // --capture: raw incoming datagrams for uap_replay
+XdpIngress xdp;                     // --xdp: AF_XDP receive path, replies through its TX ring
+DrrScheduler<uint32_t, QueuedDatagram> scheduler; // received datagrams, served fairly across sessions
+ShmRingWriter shm_ring;             // --shm: in-order payloads for local consumer processes
+CheckpointStore checkpoints;        // --checkpoint-dir: committed offsets of resumable transfers
 
 // Function Prototypes
 void print_hex(uint32_t val);
-void send_uap_message(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t command, const string& payload = "");
+void send_uap_message(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t command, const string& payload = "", Session* session = nullptr);
+void send_datagram(int sockfd, const struct sockaddr_in& addr, const char* buffer, size_t len);
 uint64_t get_current_microseconds();
 void close_session(int sockfd, uint32_t session_id, bool notify_client);
+void acknowledge(int sockfd, uint32_t session_id, Session& session);
+void deliver_held(uint32_t session_id, Session& session);
+void deliver(uint32_t session_id, Session& session, uint32_t seq, const string& payload);
+void save_checkpoint(Session& session);
+void send_busy(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t reason, uint32_t ack);
+void handle_datagram(int sockfd, const char* buffer, int n, const struct sockaddr_in& cli_addr);
+void enqueue_datagram(int sockfd, const char* buffer, size_t n, const struct sockaddr_in& cli_addr);
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <portnum>" << endl;
+    AdmissionLimits limits;
+    string xdp_interface;
+    if (argc < 2 || argc % 2 != 0) {
+        cerr << "Usage: " << argv[0] << " <portnum> [--window 64..1024] [--capture file] [--xdp ifname] [--shm name] [--checkpoint-dir dir] [--max-sessions N] [--max-session-bytes N] [--max-buffered-bytes N]"
+             << " [--cpu a,b] [--busy-poll us] [--spin us] [--lock-memory 0|1]" << endl;
         return 1;
     }
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--window") {
+            window_width = atoi(argv[i + 1]);
+        } else if (string(argv[i]) == "--xdp") {
+            xdp_interface = argv[i + 1]; // opened once the port is bound
+        } else if (string(argv[i]) == "--capture") {
+            if (!capture.open(argv[i + 1])) {
+                perror("ERROR opening capture file");
+                return 1;
+            }
+        } else if (string(argv[i]) == "--checkpoint-dir") {
+            if (!checkpoints.open(argv[i + 1])) {
+                perror("ERROR opening checkpoint directory");
+                return 1;
+            }
+        } else if (string(argv[i]) == "--shm") {
+            if (!shm_ring.open(argv[i + 1])) {
+                perror("ERROR creating shared memory ring");
+                return 1;
+            }
+        } else if (!parse_admission_option(argv[i], argv[i + 1], limits)
+                   && !parse_low_latency_option(argv[i], argv[i + 1], low_latency)) {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    admission.configure(limits);
     int port = atoi(argv[1]);
 
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -65,6 +144,23 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (enable_gro(sockfd)) {
+        cout << "UDP GRO enabled" << endl;
+    }
+    if (low_latency.enabled()) {
+        apply_low_latency(sockfd, low_latency);
+        cout << "Low-latency mode: busy poll " << low_latency.busy_poll_us << " us, spin " << low_latency.spin_us << " us" << endl;
+    }
+
+    // The socket stays open either way: it gets whatever the XDP program passes on
+    if (!xdp_interface.empty()) {
+        if (xdp.open(xdp_interface, port)) {
+            cout << "AF_XDP receive path on " << xdp_interface << " (" << (xdp.generic_mode ? "generic" : "native") << " mode)" << endl;
+        } else {
+            cout << "AF_XDP unavailable on " << xdp_interface << ", using the socket path" << endl;
+        }
+    }
+
     cout << "Waiting on port " << port << "..." << endl;
 
     while (true) {
@@ -72,12 +168,28 @@ int main(int argc, char* argv[]) {
         FD_ZERO(&readfds);
         FD_SET(sockfd, &readfds);
         FD_SET(STDIN_FILENO, &readfds);
+        int max_fd = sockfd;
+        if (xdp.is_open()) {
+            FD_SET(xdp.fd(), &readfds);
+            max_fd = max(max_fd, xdp.fd());
+        }
 
+        // Wake up in time for the earliest delayed ALIVE
+        int64_t wait_ms = 1000;
+        for (auto const& [id, sess] : sessions) {
+            int64_t due = sess.acks.ms_until_due();
+            if (due >= 0) {
+                wait_ms = min(wait_ms, due);
+            }
+        }
+        if (!scheduler.empty() || spin_until_readable(sockfd, low_latency.spin_us)) {
+            wait_ms = 0; // work is already there, skip the blocking wakeup
+        }
         struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+        timeout.tv_sec = wait_ms / 1000;
+        timeout.tv_usec = (wait_ms % 1000) * 1000;
         
-        int activity = select(sockfd + 1, &readfds, NULL, NULL, &timeout);
+        int activity = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
 
         if (activity < 0) {
             perror("select error");
@@ -98,110 +210,56 @@ int main(int argc, char* argv[]) {
         }
 
         if (FD_ISSET(sockfd, &readfds)) {
-            char buffer[BUFFER_SIZE];
-            struct sockaddr_in cli_addr;
-            socklen_t clilen = sizeof(cli_addr);
-
-            int n = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&cli_addr, &clilen);
-            if (n < 0) {
-                perror("ERROR in recvfrom");
-                continue;
-            }
-
-            if (n < sizeof(UAP_header)) {
-                continue;
+            // Drain everything queued; with GRO one read may carry many datagrams
+            static char buffer[GRO_BUFFER_SIZE];
+            while (true) {
+                struct sockaddr_in cli_addr;
+                size_t segment_size;
+                ssize_t n = recv_coalesced(sockfd, buffer, GRO_BUFFER_SIZE, &cli_addr, segment_size, MSG_DONTWAIT);
+                if (n < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("ERROR in recvfrom");
+                    }
+                    break;
+                }
+                for_each_segment(buffer, n, segment_size, [&](const char* datagram, size_t len) {
+                    capture.record(datagram, len, cli_addr);
+                    enqueue_datagram(sockfd, datagram, len, cli_addr);
+                });
             }
-            
-            uint64_t reception_time = get_current_microseconds();
+        }
 
-            UAP_header* header = (UAP_header*)buffer;
+        if (xdp.is_open() && FD_ISSET(xdp.fd(), &readfds)) {
+            xdp.receive([&](const char* datagram, size_t len, const struct sockaddr_in& cli_addr) {
+                capture.record(datagram, len, cli_addr);
+                enqueue_datagram(sockfd, datagram, len, cli_addr);
+            });
+        }
 
-            if (ntohs(header->magic) != UAP_MAGIC || header->version != UAP_VERSION) {
-                continue;
+        // Handle a batch in deficit round-robin order, so a session with a deep
+        // backlog can't hold up the others' packets. Each datagram's queue
+        // charge is given back first, as handling it may charge it again for
+        // the reorder buffer.
+        uint32_t queued_id;
+        QueuedDatagram queued;
+        for (int i = 0; i < SCHEDULER_BATCH && scheduler.pop(queued_id, queued); i++) {
+            admission.release(queued.data.size());
+            auto sess = sessions.find(queued_id);
+            if (queued.session_charged && sess != sessions.end()) {
+                sess->second.queued_bytes -= queued.data.size();
             }
+            handle_datagram(sockfd, queued.data.data(), queued.data.size(), queued.from);
+        }
 
-            server_logical_clock = max(server_logical_clock, ntohll(header->logical_clock)) + 1;
-            
-            // Calculate and Print One-Way Latency
-            uint64_t send_timestamp = ntohll(header->timestamp);
-            double latency_ms = (reception_time - send_timestamp) / 1000.0;
-            print_hex(ntohl(header->session_id));
-            cout << " [" << ntohl(header->sequence_number) << "] Latency: " << fixed << setprecision(2) << latency_ms << " ms" << endl;
-
-            uint32_t session_id = ntohl(header->session_id);
-            uint32_t client_seq_num = ntohl(header->sequence_number);
-            uint8_t command = header->command;
-            
-            auto it = sessions.find(session_id);
-            if (it == sessions.end()) {
-                if (command == UAP_COMMAND_HELLO) {
-                    print_hex(session_id);
-                    cout << " [" << client_seq_num << "] Session created" << endl;
-
-                    sessions[session_id] = {cli_addr, 1, time(nullptr), latency_ms, 1};
-                    
-                    send_uap_message(sockfd, cli_addr, session_id, UAP_COMMAND_HELLO);
-                } else {
-                    // Per FSA, initial message must be HELLO, otherwise terminate
-                    // We don't have a session to terminate, so we just ignore.
-                }
-            } else {
-                Session& session = it->second;
-                session.last_message_time = time(nullptr);
-                
-                session.total_latency += latency_ms;
-                session.packet_count++;
-                
-                switch (command) {
-                    case UAP_COMMAND_DATA: {
-                        if (client_seq_num < session.expected_seq_num) {
-                            // "from the past", protocol error, close session
-                             print_hex(session_id);
-                             cout << " [" << client_seq_num << "] Out-of-order packet. Closing session." << endl;
-                             close_session(sockfd, session_id, true);
-                             continue;
-                        }
-                        if (client_seq_num == session.expected_seq_num - 1) {
-                            // Duplicate packet
-                            print_hex(session_id);
-                            cout << " [" << client_seq_num << "] Duplicate packet received." << endl;
-                            // Discard the packet, don't send ALIVE
-                            continue;
-                        }
-                        while (client_seq_num > session.expected_seq_num) {
-                            // Lost packets
-                            print_hex(session_id);
-                            cout << " [" << session.expected_seq_num << "] Lost packet!" << endl;
-                            session.expected_seq_num++;
-                        }
-
-                        // Print payload
-                        size_t payload_len = n - sizeof(UAP_header);
-                        string payload(buffer + sizeof(UAP_header), payload_len);
-                        print_hex(session_id);
-                        cout << " [" << client_seq_num << "] " << payload << endl;
-                        
-                        session.expected_seq_num = client_seq_num + 1;
-
-                        // Respond with ALIVE
-                        send_uap_message(sockfd, cli_addr, session_id, UAP_COMMAND_ALIVE);
-                        break;
-                    }
-                    case UAP_COMMAND_GOODBYE: {
-                        print_hex(session_id);
-                        cout << " [" << client_seq_num << "] GOODBYE from client." << endl;
-                        close_session(sockfd, session_id, true); // send GOODBYE back
-                        break;
-                    }
-                    case UAP_COMMAND_HELLO:
-                    default: {
-                        // Protocol error: e.g., HELLO received in established session
-                        print_hex(session_id);
-                        cout << " [" << client_seq_num << "] Protocol error. Closing session." << endl;
-                        close_session(sockfd, session_id, true);
-                        break;
-                    }
-                }
+        // Send the delayed ALIVEs whose deadline has passed, and checkpoint
+        // the progress of resumable transfers
+        uint64_t now_us = get_current_microseconds();
+        for (auto& [id, sess] : sessions) {
+            if (sess.acks.due()) {
+                acknowledge(sockfd, id, sess);
+            }
+            if (sess.committed != sess.checkpointed && now_us - sess.checkpoint_time >= CHECKPOINT_INTERVAL_MS * 1000ULL) {
+                save_checkpoint(sess);
             }
         }
 
@@ -218,14 +276,33 @@ int main(int argc, char* argv[]) {
             cout << " Session timed out." << endl;
             close_session(sockfd, id, true);
         }
+        xdp.flush(); // replies queued in the TX ring during this pass
     }
 
     // Server Shutdown: Send GOODBYE to all active sessions
     cout << "Notifying active clients of shutdown..." << endl;
-    for (auto const& [id, sess] : sessions) {
+    for (auto& [id, sess] : sessions) {
         send_uap_message(sockfd, sess.client_addr, id, UAP_COMMAND_GOODBYE);
+        save_checkpoint(sess);
     }
     sessions.clear();
+    if (xdp.is_open()) {
+        xdp.flush();
+        cout << "AF_XDP: " << xdp.received << " datagrams received, " << xdp.sent << " sent" << endl;
+        xdp.close();
+    }
+    admission.print_stats(cout);
+    if (scheduler.dropped > 0) {
+        cout << "Scheduler: " << scheduler.dropped << " datagrams dropped on full session queues" << endl;
+    }
+    if (capture.is_open()) {
+        capture.close();
+        cout << "Captured " << capture.records << " datagrams (" << capture.dropped_bytes << " bytes dropped)" << endl;
+    }
+    if (shm_ring.is_open()) {
+        cout << "Shared memory ring: " << shm_ring.records << " records published" << endl;
+        shm_ring.close();
+    }
 
     close(sockfd);
     return 0;
@@ -236,25 +313,45 @@ void print_hex(uint32_t val) {
     cout << "0x" << hex << setw(8) << setfill('0') << val << dec;
 }
 
-void send_uap_message(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t command, const string& payload) {
-    size_t buffer_len = sizeof(UAP_header) + payload.length();
-    char buffer[buffer_len];
-
-    UAP_header header;
-    header.magic = htons(UAP_MAGIC);
-    header.version = UAP_VERSION;
-    header.command = command;
-    header.sequence_number = htonl(server_sequence_number++);
-    header.session_id = htonl(session_id);
-
+// Sessions that negotiated v2 get compact headers, except for the HELLO reply,
+// whose (v1) fields are the base for the deltas that follow.
+void send_uap_message(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t command, const string& payload, Session* session) {
+    char buffer[UAP_MAX_HEADER + payload.length()];
+    int32_t seq = server_sequence_number++;
     server_logical_clock++;
-    header.logical_clock = htonll(server_logical_clock);
-    header.timestamp = htonll(get_current_microseconds());
 
-    memcpy(buffer, &header, sizeof(UAP_header));
-    memcpy(buffer + sizeof(UAP_header), payload.c_str(), payload.length());
+    size_t header_len;
+    if (session != nullptr && session->version == UAP_VERSION_COMPACT && command != UAP_COMMAND_HELLO) {
+        // No timestamp: the clients don't read it from replies
+        header_len = encode_compact_header(buffer, command, seq, session_id, server_logical_clock, 0, session->server_base);
+    } else {
+        uint64_t timestamp = get_current_microseconds();
+        UAP_header header;
+        header.magic = htons(UAP_MAGIC);
+        header.version = UAP_VERSION;
+        header.command = command;
+        header.sequence_number = htonl(seq);
+        header.session_id = htonl(session_id);
+        header.logical_clock = htonll(server_logical_clock);
+        header.timestamp = htonll(timestamp);
+        memcpy(buffer, &header, sizeof(UAP_header));
+        header_len = sizeof(UAP_header);
+        if (session != nullptr && command == UAP_COMMAND_HELLO) {
+            session->server_base.reset(seq, server_logical_clock, timestamp);
+        }
+    }
+    memcpy(buffer + header_len, payload.c_str(), payload.length());
+    if (session != nullptr && command == UAP_COMMAND_HELLO) {
+        session->hello_packet.assign(buffer, header_len + payload.length());
+    }
+    send_datagram(sockfd, addr, buffer, header_len + payload.length());
+}
 
-    sendto(sockfd, buffer, buffer_len, 0, (const struct sockaddr*)&addr, sizeof(addr));
+void send_datagram(int sockfd, const struct sockaddr_in& addr, const char* buffer, size_t len) {
+    // Clients that reach us through XDP are answered through its TX ring
+    if (!xdp.send(addr, buffer, len)) {
+        sendto(sockfd, buffer, len, 0, (const struct sockaddr*)&addr, sizeof(addr));
+    }
 }
 
 uint64_t get_current_microseconds() {
@@ -263,18 +360,326 @@ uint64_t get_current_microseconds() {
     return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// ALIVE carries the cumulative ack; while packets are held behind a gap a NACK
+// listing the missing ranges is sent instead so the client resends only those.
+void acknowledge(int sockfd, uint32_t session_id, Session& session) {
+    if (session.reorder.empty()) {
+        int32_t ack = session.expected_seq_num - 1;
+        send_uap_message(sockfd, session.client_addr, session_id, UAP_COMMAND_ALIVE,
+                         session.acks.delayed() ? encode_ack(ack, session.acks.held_us()) : encode_ack(ack), &session);
+    } else {
+        send_uap_message(sockfd, session.client_addr, session_id, UAP_COMMAND_NACK, encode_nack(session.reorder.missing(session.expected_seq_num)), &session);
+    }
+    session.acks.sent();
+}
+
+void send_busy(int sockfd, const struct sockaddr_in& addr, uint32_t session_id, uint8_t reason, uint32_t ack) {
+    if (admission.busy_allowed()) {
+        send_uap_message(sockfd, addr, session_id, UAP_COMMAND_BUSY, encode_busy(reason, ack));
+    }
+}
+
+// Delivers held packets that are now in order. A gap that has slid out of the
+// sequence window can no longer be filled and is given up on as lost.
+void deliver_held(uint32_t session_id, Session& session) {
+    string payload;
+    while (true) {
+        if (session.reorder.pop(session.expected_seq_num, payload)) {
+            session.held_bytes -= sizeof(UAP_header) + payload.length();
+            admission.release(sizeof(UAP_header) + payload.length());
+            deliver(session_id, session, session.expected_seq_num, payload);
+            session.expected_seq_num++;
+        } else if ((int32_t)session.expected_seq_num < session.window.lowest()) {
+            int32_t next = session.window.lowest();
+            int32_t held;
+            if (session.reorder.first(held) && held < next) {
+                next = held;
+            }
+            print_hex(session_id);
+            cout << " [" << session.expected_seq_num << "-" << next - 1 << "] Lost packet!" << endl;
+            session.expected_seq_num = next;
+        } else {
+            break;
+        }
+    }
+}
+
+// Outputs a payload that is next in order and counts it as committed.
+void deliver(uint32_t session_id, Session& session, uint32_t seq, const string& payload) {
+    print_hex(session_id);
+    cout << " [" << seq << "] " << payload << endl;
+    shm_ring.publish(SHM_RECORD_DATA, session_id, seq, payload.data(), payload.length());
+    session.committed += payload.length() + 1; // one input line and its newline
+}
+
+void save_checkpoint(Session& session) {
+    if (session.transfer_id.empty() || session.committed == session.checkpointed) {
+        return;
+    }
+    if (checkpoints.save(session.transfer_id, session.committed)) {
+        session.checkpointed = session.committed;
+    }
+    session.checkpoint_time = get_current_microseconds();
+}
+
 void close_session(int sockfd, uint32_t session_id, bool notify_client) {
     auto it = sessions.find(session_id);
     if (it != sessions.end()) {
         if (notify_client) {
-            send_uap_message(sockfd, it->second.client_addr, session_id, UAP_COMMAND_GOODBYE);
+            send_uap_message(sockfd, it->second.client_addr, session_id, UAP_COMMAND_GOODBYE, "", &it->second);
         }
         
         // Print average latency for the closed session
-        double avg_latency = it->second.total_latency / it->second.packet_count;
+        double avg_latency = it->second.packet_count ? it->second.total_latency / it->second.packet_count : 0;
         print_hex(session_id);
-        cout << " Session closed (Avg Latency: " << fixed << setprecision(2) << avg_latency << " ms)" << endl;
+        cout << " Session closed (Avg Latency: " << fixed << setprecision(2) << avg_latency << " ms, Lost: " << it->second.window.lost() << ")" << endl;
         
+        admission.release(it->second.held_bytes);
+        save_checkpoint(it->second);
+        shm_ring.publish(SHM_RECORD_SESSION_END, session_id, it->second.expected_seq_num, nullptr, 0);
         sessions.erase(it);
+        admission.release(scheduler.remove(session_id)); // datagrams still queued are dropped
+    }
+}
+
+// Admits a received datagram and queues it on its session's scheduler queue.
+// Only a HELLO may open a queue for an unknown session. The datagram is charged
+// to the admission budget while it is queued; the packet the session is waiting
+// for is always taken, as in the reorder buffer.
+void enqueue_datagram(int sockfd, const char* buffer, size_t n, const struct sockaddr_in& cli_addr) {
+    int32_t session_id;
+    if (!peek_session_id(buffer, n, session_id)) {
+        return;
+    }
+    auto it = sessions.find(session_id);
+    CompactBase base = it == sessions.end() ? CompactBase() : it->second.client_base; // a copy: decoding a FULL header moves the base
+    UAP_header header;
+    size_t header_len;
+    if (!decode_header(buffer, n, header, header_len, base)) {
+        return;
+    }
+
+    uint8_t reason;
+    if (it == sessions.end()) {
+        if (header.command != UAP_COMMAND_HELLO) {
+            return;
+        }
+        if (!admission.reserve(0, n, reason)) {
+            send_busy(sockfd, cli_addr, session_id, reason, 0);
+            return;
+        }
+    } else {
+        Session& session = it->second;
+        if (uap_command_sequenced(header.command) && (uint32_t)header.sequence_number == session.expected_seq_num) {
+            admission.charge(n);
+        } else if (!admission.reserve(session.held_bytes + session.queued_bytes, n, reason)) {
+            send_busy(sockfd, cli_addr, session_id, reason, session.expected_seq_num - 1);
+            return;
+        }
+        session.queued_bytes += n;
+    }
+    bool session_charged = it != sessions.end();
+    if (!scheduler.push(session_id, {string(buffer, n), cli_addr, session_charged}, n)) {
+        admission.release(n);
+        if (session_charged) {
+            it->second.queued_bytes -= n;
+        }
+    }
+}
+
+void handle_datagram(int sockfd, const char* buffer, int n, const struct sockaddr_in& cli_addr) {
+    uint64_t reception_time = get_current_microseconds();
+
+    // v2 headers are deltas against the session's HELLO, so find the session first
+    int32_t peeked_id;
+    if (!peek_session_id(buffer, n, peeked_id)) {
+        return;
+    }
+    auto it = sessions.find(peeked_id);
+    CompactBase hello_base;
+    UAP_header header;
+    size_t header_len;
+    if (!decode_header(buffer, n, header, header_len, it == sessions.end() ? hello_base : it->second.client_base)) {
+        return;
+    }
+
+    server_logical_clock = max<uint64_t>(server_logical_clock, header.logical_clock) + 1;
+    
+    // Calculate and Print One-Way Latency (v2 packets may carry no timestamp)
+    bool has_timestamp = header.timestamp != 0;
+    double latency_ms = has_timestamp ? (reception_time - header.timestamp) / 1000.0 : 0;
+    if (has_timestamp) {
+        print_hex(header.session_id);
+        cout << " [" << header.sequence_number << "] Latency: " << fixed << setprecision(2) << latency_ms << " ms" << endl;
+    }
+
+    uint32_t session_id = header.session_id;
+    uint32_t client_seq_num = header.sequence_number;
+    uint8_t command = header.command;
+    
+    if (it == sessions.end()) {
+        if (command == UAP_COMMAND_HELLO) {
+            if (!admission.admit_session(sessions.size())) {
+                send_busy(sockfd, cli_addr, session_id, UAP_BUSY_SESSIONS, 0);
+                return;
+            }
+            // A resumable transfer carries on from its checkpoint, or from its
+            // previous session if that one hasn't timed out yet
+            HelloOptions requested, accepted;
+            requested.decode(buffer + header_len, n - header_len);
+            string transfer_id;
+            uint64_t resume_offset = 0;
+            if (checkpoints.is_open() && requested.get(HELLO_OPT_TRANSFER_ID, transfer_id) && valid_transfer_id(transfer_id)) {
+                resume_offset = checkpoints.load(transfer_id);
+                for (auto& [id, sess] : sessions) {
+                    if (sess.transfer_id == transfer_id) {
+                        resume_offset = sess.committed;
+                        close_session(sockfd, id, true);
+                        break;
+                    }
+                }
+            } else {
+                transfer_id.clear();
+            }
+
+            print_hex(session_id);
+            cout << " [" << client_seq_num << "] Session created" << endl;
+
+            Session& session = sessions[session_id];
+            session.client_addr = cli_addr;
+            session.expected_seq_num = client_seq_num + 1;
+            session.last_message_time = time(nullptr);
+            session.total_latency = latency_ms;
+            session.packet_count = has_timestamp ? 1 : 0;
+            session.window.reset(client_seq_num, window_width);
+            session.client_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+            
+            // Negotiate delayed acks and compact headers if the client asked for them
+            uint16_t ack_every, ack_delay_ms = ACK_DEFAULT_DELAY_MS;
+            if (requested.get_u16(HELLO_OPT_ACK_EVERY, ack_every)) {
+                requested.get_u16(HELLO_OPT_ACK_DELAY_MS, ack_delay_ms);
+                session.acks.configure(ack_every, ack_delay_ms);
+                accepted.set_u16(HELLO_OPT_ACK_EVERY, session.acks.get_every());
+                accepted.set_u16(HELLO_OPT_ACK_DELAY_MS, session.acks.get_delay_ms());
+            }
+            uint16_t version;
+            if (requested.get_u16(HELLO_OPT_VERSION, version) && version >= UAP_VERSION_COMPACT) {
+                session.version = UAP_VERSION_COMPACT;
+                accepted.set_u16(HELLO_OPT_VERSION, UAP_VERSION_COMPACT);
+            }
+            uint16_t priority;
+            if (requested.get_u16(HELLO_OPT_PRIORITY, priority)) {
+                session.priority = clamp_priority(priority);
+                scheduler.set_weight(session_id, session.priority);
+                accepted.set_u16(HELLO_OPT_PRIORITY, session.priority);
+            }
+            if (!transfer_id.empty()) {
+                session.transfer_id = transfer_id;
+                session.committed = session.checkpointed = resume_offset;
+                session.checkpoint_time = get_current_microseconds();
+                accepted.set(HELLO_OPT_TRANSFER_ID, transfer_id);
+                accepted.set_u64(HELLO_OPT_RESUME_OFFSET, resume_offset);
+                print_hex(session_id);
+                cout << " Transfer " << transfer_id << ", resuming at byte " << resume_offset << endl;
+            }
+            string object;
+            if (requested.get(HELLO_OPT_OBJECT, object)) {
+                print_hex(session_id);
+                cout << " Object " << object << endl;
+            }
+
+            send_uap_message(sockfd, cli_addr, session_id, UAP_COMMAND_HELLO, accepted.encode(), &session);
+        } else {
+            // Per FSA, initial message must be HELLO, otherwise terminate
+            // We don't have a session to terminate, so we just ignore.
+        }
+    } else {
+        Session& session = it->second;
+        session.last_message_time = time(nullptr);
+        
+        if (has_timestamp) {
+            session.total_latency += latency_ms;
+            session.packet_count++;
+        }
+        
+        switch (command) {
+            case UAP_COMMAND_DATA: {
+                SeqStatus status = session.window.check(client_seq_num);
+                if (status == SEQ_DUPLICATE || status == SEQ_TOO_OLD) {
+                    // Duplicate packet (usually a retransmission after a lost ALIVE/NACK),
+                    // or one so late that its gap was already given up on
+                    print_hex(session_id);
+                    cout << " [" << client_seq_num << "] " << (status == SEQ_DUPLICATE ? "Duplicate packet received." : "Packet older than the window, dropped.") << endl;
+                    acknowledge(sockfd, session_id, session);
+                    return;
+                }
+
+                size_t payload_len = n - header_len;
+                bool filling_gap = !session.reorder.empty();
+
+                if (client_seq_num > session.expected_seq_num) {
+                    // Ahead of a gap: hold it until the gap is retransmitted,
+                    // if the session and the server still have buffer room for it
+                    uint8_t reason;
+                    // (charged at v1 size whatever the header version, as deliver_held releases it)
+                    size_t held_size = sizeof(UAP_header) + payload_len;
+                    if (!admission.reserve(session.held_bytes + session.queued_bytes, held_size, reason)) {
+                        send_busy(sockfd, cli_addr, session_id, reason, session.expected_seq_num - 1);
+                        return;
+                    }
+                    session.held_bytes += held_size;
+                    session.window.update(client_seq_num);
+                    string payload(buffer + header_len, payload_len);
+                    print_hex(session_id);
+                    cout << " [" << client_seq_num << "] Held, waiting for [" << session.expected_seq_num << "]" << endl;
+                    session.reorder.hold(client_seq_num, payload);
+                } else {
+                    // Print payload
+                    session.window.update(client_seq_num);
+                    deliver(session_id, session, client_seq_num, string(buffer + header_len, payload_len));
+                    session.expected_seq_num = client_seq_num + 1;
+                }
+
+                // Then everything that was held behind it
+                deliver_held(session_id, session);
+
+                // Respond with ALIVE (or NACK if gaps remain). In delayed-ack mode
+                // a plain in-order packet only counts towards the next ALIVE.
+                if (!session.reorder.empty() || filling_gap || session.acks.on_data()) {
+                    acknowledge(sockfd, session_id, session);
+                }
+                break;
+            }
+            case UAP_COMMAND_GOODBYE: {
+                print_hex(session_id);
+                cout << " [" << client_seq_num << "] GOODBYE from client." << endl;
+                // The client sent everything: the transfer is complete
+                uint64_t final_offset;
+                if (!session.transfer_id.empty() && decode_offset(buffer + header_len, n - header_len, final_offset)
+                    && final_offset == session.committed) {
+                    checkpoints.remove(session.transfer_id);
+                    session.transfer_id.clear();
+                }
+                close_session(sockfd, session_id, true); // send GOODBYE back
+                break;
+            }
+            case UAP_COMMAND_HELLO:
+                if (cli_addr.sin_addr.s_addr == session.client_addr.sin_addr.s_addr && cli_addr.sin_port == session.client_addr.sin_port) {
+                    // The client missed our reply and asked again. Resend it
+                    // unchanged, as v2 deltas are against it.
+                    print_hex(session_id);
+                    cout << " [" << client_seq_num << "] HELLO repeated, reply resent." << endl;
+                    send_datagram(sockfd, cli_addr, session.hello_packet.data(), session.hello_packet.size());
+                    break;
+                }
+                [[fallthrough]];
+            default: {
+                // Protocol error: e.g., another peer's HELLO for an established session
+                print_hex(session_id);
+                cout << " [" << client_seq_num << "] Protocol error. Closing session." << endl;
+                close_session(sockfd, session_id, true);
+                break;
+            }
+        }
     }
 }
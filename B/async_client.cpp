@@ -0,0 +1,75 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include "uap_client.h"
+
+using namespace std;
+
+// Example for the coroutine client library: reads stdin and spreads its lines
+// round-robin over N sessions that all run on one UapLoop and one socket.
+
+static int sessions_done = 0;
+static int sessions_failed = 0;
+
+UapTask<void> transfer(UapSession& session, const vector<string>& lines, size_t first, size_t stride) {
+    if (!co_await session.connect()) {
+        cout << "Session " << session.id() << ": server did not accept the session" << endl;
+        sessions_failed++;
+        co_return;
+    }
+    for (size_t i = first; i < lines.size(); i += stride) {
+        if (!co_await session.send(lines[i])) {
+            cout << "Session " << session.id() << ": failed while sending" << endl;
+            sessions_failed++;
+            co_return;
+        }
+    }
+    if (!co_await session.close()) {
+        cout << "Session " << session.id() << ": failed to close cleanly" << endl;
+        sessions_failed++;
+        co_return;
+    }
+    sessions_done++;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <hostname> <port> [sessions]" << endl;
+        return 1;
+    }
+    int session_count = argc > 3 ? atoi(argv[3]) : 1;
+    if (session_count < 1) {
+        session_count = 1;
+    }
+
+    vector<string> lines;
+    string line;
+    while (getline(cin, line)) {
+        lines.push_back(line);
+    }
+
+    UapLoop loop;
+    if (!loop.open(argv[1], atoi(argv[2]))) {
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<UapSession*> sessions;
+    for (int i = 0; i < session_count; i++) {
+        UapSession& session = loop.create_session();
+        sessions.push_back(&session);
+        loop.spawn(transfer(session, lines, i, session_count));
+    }
+    loop.run();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t bytes = 0;
+    for (UapSession* s : sessions) {
+        bytes += s->bytes_sent();
+    }
+    cout << sessions_done << " sessions completed, " << sessions_failed << " failed; "
+         << lines.size() << " lines, " << bytes << " bytes in " << elapsed << " s" << endl;
+    return sessions_failed == 0 ? 0 : 1;
+}
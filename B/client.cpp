@@ -6,19 +6,33 @@
 #include <sys/select.h>
 #include <unistd.h>
 #include <string>
+#include <vector>
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "../include/UAP_header.h"
 #include "../include/pack.h"
 #include "../include/unpack.h"
+#include "../include/reliability.h"
+#include "../include/rate_control.h"
+#include "../include/admission.h"
+#include "../include/udp_offload.h"
+#include "../include/hello_opts.h"
+#include "../include/latency_histogram.h"
+#include "../include/striping.h"
+#include "../include/dedup.h"
 
 using namespace std;
 using namespace std::chrono;
 auto deadline = steady_clock::now() + seconds(10);
 
 UAP_header last_header;
+RetransmitBuffer retransmit_buffer;
+Pacer pacer(0, true);
+LatencyHistogram rtt_histogram; // DATA -> ALIVE round trips
 
 int32_t sequence = 0;
 int64_t clk = 0;
@@ -31,9 +45,164 @@ state current_state = HELLO;
 
 int32_t sessionID = getpid();
 
+size_t bulk_size = 0;   // --bulk: fixed-size DATA payloads read as raw bytes, sent in GSO batches
+bool use_gso = false;
+const int BULK_ACK_EVERY = 16; // delayed acks requested in bulk mode unless --ack-every says otherwise
+int stripe_count = 1;          // --stripes: bulk batches rotate over this many source ports
+vector<int> stripe_sockets;    // the first is the session's own socket, which gets every reply
+size_t next_stripe = 0;
+string dedup_name;             // --dedup: send stdin as a deduplicated transfer of this file
+bool dedup_mode = false;       // the server accepted it
+DedupSender dedup;
+const size_t DEDUP_FALLBACK_BULK = 900; // bulk payload size when the server doesn't take --dedup
+
+uint8_t wire_version = UAP_VERSION; // UAP_VERSION_COMPACT once the server accepts --version 2
+CompactBase client_base;            // v2: our deltas are against our HELLO
+CompactBase server_base;            // v2: the server's against its HELLO reply
+
+// Packs a packet in the negotiated header version into `buffer` (UAP_MAX_HEADER
+// + payload bytes) and returns its length.
+size_t pack_packet(char* buffer, const string& payload, uint8_t command, int32_t seq) {
+    if (wire_version == UAP_VERSION_COMPACT) {
+        return pack_compact(buffer, payload, command, seq, sessionID, clk, get_current_time(), client_base);
+    }
+    pack(buffer, payload, command, seq, sessionID, clk, get_current_time());
+    return sizeof(UAP_header) + payload.size();
+}
+
+void resend(int sock, const sockaddr_in& addr, int32_t seq) {
+    RetransmitBuffer::Entry* entry = retransmit_buffer.take_for_resend(seq, get_current_time());
+    if (entry != nullptr) {
+        sendto(sock, entry->packet.data(), entry->packet.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+        pacer.on_sent(entry->packet.size());
+    }
+}
+
+// Packs up to UDP_OFFLOAD_MAX_SEGMENTS DATA packets of `bulk_size` stdin bytes
+// back to back, as far as the pacer and retransmit window allow, and sends them
+// with one GSO sendmsg. Returns false once stdin is exhausted. Always v1: GSO
+// needs equal-sized segments, which variable-length v2 headers would break.
+// With --stripes each batch goes out from the next stripe socket.
+bool send_bulk(const sockaddr_in& addr) {
+    int sock = stripe_sockets[next_stripe++ % stripe_sockets.size()];
+    size_t segment = sizeof(UAP_header) + bulk_size;
+    vector<char> batch;
+    batch.reserve(segment * UDP_OFFLOAD_MAX_SEGMENTS);
+    string data(bulk_size, '\0');
+    bool more = true;
+    int count = 0;
+    while (count < UDP_OFFLOAD_MAX_SEGMENTS && batch.size() + segment <= UDP_OFFLOAD_MAX_BYTES
+           && !retransmit_buffer.full() && (count == 0 || pacer.delay_ns(segment) == 0)) {
+        data.resize(bulk_size);
+        cin.read(&data[0], bulk_size);
+        data.resize(cin.gcount());
+        if (data.empty()) {
+            more = false;
+            break;
+        }
+        size_t offset = batch.size();
+        batch.resize(offset + sizeof(UAP_header) + data.size());
+        clk = max(clk, last_header.logical_clock) + 1;
+        int32_t seq = sequence++;
+        pack(&batch[offset], data, UAP_COMMAND_DATA, seq, sessionID, clk, get_current_time());
+        retransmit_buffer.store(seq, &batch[offset], batch.size() - offset);
+        pacer.on_sent(batch.size() - offset);
+        count++;
+        if (data.size() < bulk_size) {
+            more = false; // a short segment has to be the last one
+            break;
+        }
+    }
+    if (!batch.empty() && send_segments(sock, addr, batch.data(), batch.size(), segment, use_gso) < 0) {
+        perror("sendmsg");
+    }
+    return more;
+}
+
+// Sends the CHUNKs the server asked for, then the next MANIFESTs, as far as the
+// pacer and retransmit window allow.
+void send_dedup(int sock, const sockaddr_in& addr) {
+    uint8_t command;
+    string payload;
+    for (int count = 0; count < UDP_OFFLOAD_MAX_SEGMENTS && !retransmit_buffer.full()
+         && (count == 0 || pacer.delay_ns(sizeof(UAP_header) + DEDUP_MAX_PAYLOAD) == 0) && dedup.next(command, payload); count++) {
+        char buffer[UAP_MAX_HEADER + payload.size()];
+        clk = max(clk, last_header.logical_clock) + 1;
+        int32_t seq = sequence++;
+        size_t len = pack_packet(buffer, payload, command, seq);
+        retransmit_buffer.store(seq, buffer, len);
+        if (command == UAP_COMMAND_MANIFEST) {
+            dedup.manifest_sent_as(seq, payload, get_current_time());
+        }
+        if (sendto(sock, buffer, len, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("sendto");
+        }
+        pacer.on_sent(len);
+    }
+}
+
+// Sends MANIFESTs again, with their original sequence numbers, whose NEED
+// hasn't arrived in time; the server answers the duplicate with a new NEED.
+void resend_overdue_manifests(int sock, const sockaddr_in& addr) {
+    vector<pair<int32_t, string>> overdue;
+    dedup.overdue(get_current_time(), overdue);
+    for (auto const& [seq, payload] : overdue) {
+        char buffer[UAP_MAX_HEADER + payload.size()];
+        size_t len = pack_packet(buffer, payload, UAP_COMMAND_MANIFEST, seq);
+        sendto(sock, buffer, len, 0, (struct sockaddr*)&addr, sizeof(addr));
+        pacer.on_sent(len);
+    }
+}
+
 int main(int argc, char* argv[]) {
     char* server_ip = argv[1];
     int server_port = atoi(argv[2]);
+    HelloOptions hello_options;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--rate") {
+            pacer = Pacer(atof(argv[i + 1]), false); // fixed rate in bytes/s, 0 disables pacing
+        } else if (string(argv[i]) == "--bulk") {
+            bulk_size = min<size_t>(atoi(argv[i + 1]), 1024 - sizeof(UAP_header)); // fits the servers' buffers
+        } else if (string(argv[i]) == "--ack-every") {
+            hello_options.set_u16(HELLO_OPT_ACK_EVERY, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--ack-delay") {
+            hello_options.set_u16(HELLO_OPT_ACK_DELAY_MS, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--version") {
+            hello_options.set_u16(HELLO_OPT_VERSION, atoi(argv[i + 1])); // 2: compact headers after the HELLO
+        } else if (string(argv[i]) == "--priority") {
+            hello_options.set_u16(HELLO_OPT_PRIORITY, atoi(argv[i + 1])); // scheduling weight on the server, 1-16
+        } else if (string(argv[i]) == "--stripes") {
+            stripe_count = max(1, min(atoi(argv[i + 1]), UAP_MAX_STRIPES));
+        } else if (string(argv[i]) == "--dedup") {
+            dedup_name = argv[i + 1]; // name the server rebuilds the file under
+        }
+    }
+    if (!dedup_name.empty()) {
+        // Chunks are read straight from the mapped file, so it has to be one
+        struct stat st;
+        if (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode)) {
+            cout << "--dedup needs a regular file on stdin" << endl;
+            return 1;
+        }
+        const char* input = "";
+        if (st.st_size > 0 && (input = (const char*)mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0)) == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        dedup.start(input, st.st_size);
+        cout << "Deduplicated transfer of " << dedup_name << ": " << st.st_size << " bytes in " << dedup.chunk_count() << " chunks" << endl;
+        hello_options.set(HELLO_OPT_DEDUP, dedup_name);
+        stripe_count = 1;
+    }
+    if ((bulk_size > 0 || !dedup_name.empty()) && !hello_options.has(HELLO_OPT_ACK_EVERY)) {
+        hello_options.set_u16(HELLO_OPT_ACK_EVERY, BULK_ACK_EVERY);
+    }
+    if (bulk_size == 0) {
+        stripe_count = 1; // line mode sends one packet at a time, nothing to spread
+    }
+    if (stripe_count > 1) {
+        hello_options.set_u16(HELLO_OPT_STRIPES, stripe_count);
+    }
 
 
     int clientSocket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -41,6 +210,11 @@ int main(int argc, char* argv[]) {
         cout << "Failed to create socket" << endl;
         return 1;
     }
+    if (bulk_size > 0) {
+        use_gso = gso_supported(clientSocket);
+        cout << "Bulk mode, " << bulk_size << " byte packets, GSO " << (use_gso ? "on" : "unavailable") << endl;
+    }
+    stripe_sockets = open_stripe_sockets(clientSocket, stripe_count);
 
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -51,9 +225,12 @@ int main(int argc, char* argv[]) {
     FD_ZERO(&readfds);
     FD_SET(clientSocket, &readfds);
 
-    char buffer[sizeof(UAP_header)];
+    string hello_payload = hello_options.encode();
+    char buffer[sizeof(UAP_header) + hello_payload.size()];
     clk = max(clk, last_header.logical_clock) + 1;
-    pack(buffer, "", UAP_COMMAND_HELLO, sequence++, sessionID, clk, get_current_time());
+    int64_t hello_time = get_current_time();
+    client_base.reset(sequence, clk, hello_time);
+    pack(buffer, hello_payload, UAP_COMMAND_HELLO, sequence++, sessionID, clk, hello_time); // always v1
     int send = sendto(clientSocket, buffer, sizeof(buffer), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
     current_state = HELLO_WAIT;
     if (send < 0) {
@@ -67,8 +244,9 @@ int main(int argc, char* argv[]) {
     timeout.tv_usec = 0;
 
     int activity = select(clientSocket + 1, &readfds, NULL, NULL, &timeout);
+    if(activity < 0) { perror("select"); close(clientSocket); return 1; }
     if(FD_ISSET(clientSocket, &readfds)) {
-        char buffer[sizeof(UAP_header)];
+        char buffer[1024];
         struct sockaddr_in from_addr;
         socklen_t from_len = sizeof(from_addr);
         int n = recvfrom(clientSocket, buffer, sizeof(buffer), 0, (struct sockaddr*)&from_addr, &from_len);
@@ -76,19 +254,46 @@ int main(int argc, char* argv[]) {
 
         string payload = "";
         UAP_header header;
-        if(!unPack(buffer, n, header, payload)) {
+        if(!unPack(buffer, n, header, payload, server_base)) {
             cout << "Failed to unpack message" << endl;
             close(clientSocket);
             return 1;
         }
 
-        if(header.magic != UAP_MAGIC || header.version != UAP_VERSION) {
+        if(header.magic != UAP_MAGIC || !uap_version_supported(header.version)) {
             close(clientSocket);
             return 1;
         }
 
         if(header.command == UAP_COMMAND_HELLO) {
             current_state = READY;
+            HelloOptions accepted;
+            uint16_t ack_every, ack_delay_ms, version;
+            accepted.decode(payload.data(), payload.size());
+            if(accepted.get_u16(HELLO_OPT_ACK_EVERY, ack_every) && accepted.get_u16(HELLO_OPT_ACK_DELAY_MS, ack_delay_ms)) {
+                cout << "Delayed acks: one ALIVE per " << ack_every << " packets or " << ack_delay_ms << " ms" << endl;
+            }
+            uint16_t stripes;
+            if(accepted.get_u16(HELLO_OPT_STRIPES, stripes)) {
+                cout << "Striping over " << stripe_sockets.size() << " source ports" << endl;
+            }
+            if(accepted.get_u16(HELLO_OPT_VERSION, version) && version == UAP_VERSION_COMPACT) {
+                wire_version = UAP_VERSION_COMPACT;
+                server_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+                cout << "Compact (v2) headers" << endl;
+            }
+            if(!dedup_name.empty() && accepted.has(HELLO_OPT_DEDUP)) {
+                dedup_mode = true;
+            }else if(!dedup_name.empty()) {
+                // stdin was only mapped, not read, so it can still be sent as is
+                bulk_size = bulk_size > 0 ? bulk_size : DEDUP_FALLBACK_BULK;
+                use_gso = gso_supported(clientSocket);
+                cout << "Server doesn't take deduplicated transfers, sending in bulk" << endl;
+            }
+        }else if(header.command == UAP_COMMAND_BUSY) {
+            cout << "Server busy, session refused" << endl;
+            close(clientSocket);
+            return 1;
         }else{
             close(clientSocket);
             return 1;
@@ -100,17 +305,39 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    bool draining = false; // quitting, waiting for unacked DATA to be acknowledged
+    string input_buffer;   // line read from stdin, waiting for the pacer
+    bool has_input = false;
     while(true) {
+        if (draining && retransmit_buffer.empty()) {
+            break;
+        }
+
         fd_set readfds;
         FD_ZERO(&readfds);
         FD_SET(clientSocket, &readfds);
-        FD_SET(STDIN_FILENO, &readfds);
+        bool bulk_ready = bulk_size > 0 && !draining && !retransmit_buffer.full();
+        bool dedup_ready = dedup_mode && !draining && !retransmit_buffer.full() && dedup.has_packet();
+        bool read_stdin = bulk_size == 0 && !dedup_mode && !draining && !retransmit_buffer.full() && !has_input;
+        if (read_stdin) {
+            FD_SET(STDIN_FILENO, &readfds);
+        }
 
         auto now = steady_clock::now();
         struct timeval timeout;
 
         if (now < deadline) {
-            auto remaining_time = duration_cast<microseconds>(deadline - now);
+            auto remaining_time = min(duration_cast<microseconds>(deadline - now), microseconds(RETRANSMIT_PROBE_MS * 1000));
+            if (has_input || bulk_ready || dedup_ready) {
+                int64_t wait_ns = pacer.delay_ns(sizeof(UAP_header) + (bulk_ready ? bulk_size : dedup_ready ? DEDUP_MAX_PAYLOAD : input_buffer.size()));
+                if (wait_ns < 1000000) {
+                    // select() can't time sub-millisecond gaps precisely; sleep on the fine-grained timer instead
+                    sleep_until_ns(monotonic_ns() + wait_ns);
+                    remaining_time = microseconds(0);
+                } else {
+                    remaining_time = min(remaining_time, microseconds(wait_ns / 1000));
+                }
+            }
             timeout.tv_sec = remaining_time.count() / 1000000;
             timeout.tv_usec = remaining_time.count() % 1000000;
         } else {
@@ -121,23 +348,57 @@ int main(int argc, char* argv[]) {
 
         int max_fd = max(clientSocket, STDIN_FILENO);
         int activity = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
+        if(activity < 0) { perror("select"); close(clientSocket); return 1; }
 
-        string input_buffer;
-        if(FD_ISSET(STDIN_FILENO, &readfds) && getline(cin, input_buffer)) {
+        if(read_stdin && FD_ISSET(STDIN_FILENO, &readfds) && getline(cin, input_buffer)) {
             if(input_buffer == "q") {
                 current_state = CLOSING;
-                break;
+                draining = true;
             }else{
-                char buffer[sizeof(UAP_header) + input_buffer.size()];
-                clk = max(clk, last_header.logical_clock) + 1;
-                pack(buffer, input_buffer, UAP_COMMAND_DATA, sequence++, sessionID, clk, get_current_time());
-                int send = sendto(clientSocket, buffer, sizeof(buffer), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-                if(send < 0) { perror("sendto"); break; }
-                current_state = READY_TIMER;
+                has_input = true;
             }
-        }else if (cin.eof()) {
+        }else if (bulk_size == 0 && !dedup_mode && cin.eof() && !has_input) {
             current_state = CLOSING;
-            break;
+            draining = true;
+        }
+
+        if(has_input && pacer.delay_ns(sizeof(UAP_header) + input_buffer.size()) == 0) {
+            char buffer[UAP_MAX_HEADER + input_buffer.size()];
+            clk = max(clk, last_header.logical_clock) + 1;
+            int32_t seq = sequence++;
+            size_t len = pack_packet(buffer, input_buffer, UAP_COMMAND_DATA, seq);
+            retransmit_buffer.store(seq, buffer, len); // before sending, so the RTT clock starts first
+            int send = sendto(clientSocket, buffer, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+            if(send < 0) { perror("sendto"); break; }
+            pacer.on_sent(len);
+            has_input = false;
+            current_state = READY_TIMER;
+        }
+
+        if(bulk_ready && pacer.delay_ns(sizeof(UAP_header) + bulk_size) == 0) {
+            if(!send_bulk(server_addr)) {
+                current_state = CLOSING;
+                draining = true;
+            }else{
+                current_state = READY_TIMER;
+            }
+        }
+
+        if(dedup_mode && !draining) {
+            if(dedup_ready && pacer.delay_ns(sizeof(UAP_header) + DEDUP_MAX_PAYLOAD) == 0) {
+                send_dedup(clientSocket, server_addr);
+                current_state = READY_TIMER;
+            }
+            resend_overdue_manifests(clientSocket, server_addr);
+            if(dedup.done()) {
+                current_state = CLOSING;
+                draining = true;
+            }
+        }
+
+        if (retransmit_buffer.probe_due()) {
+            resend(clientSocket, server_addr, retransmit_buffer.newest());
+            retransmit_buffer.probe_sent();
         }
 
         if(FD_ISSET(clientSocket, &readfds)) {
@@ -150,19 +411,54 @@ int main(int argc, char* argv[]) {
 
             string payload = "";
             UAP_header header;
-            if(!unPack(buffer, n, header, payload)) {
+            if(!unPack(buffer, n, header, payload, server_base)) {
                 cout << "Failed to unpack message" << endl;
                 continue;
             }
 
-            if(header.magic != UAP_MAGIC || header.version != UAP_VERSION) {
+            if(header.magic != UAP_MAGIC || !uap_version_supported(header.version)) {
                 continue;
             }
 
             if(header.command == UAP_COMMAND_ALIVE) {
-                if(current_state == READY_TIMER) {
+                int32_t ack;
+                if(decode_ack(payload.data(), payload.size(), ack)) {
+                    int64_t rtt_us;
+                    if(retransmit_buffer.rtt_sample(ack, rtt_us)) {
+                        // Don't count the time the server held a delayed ALIVE back
+                        rtt_us = max<int64_t>(1, rtt_us - decode_ack_delay(payload.data(), payload.size()));
+                        rtt_histogram.record(rtt_us);
+                        retransmit_buffer.on_rtt_sample(rtt_us);
+                        pacer.on_rtt_sample(rtt_us);
+                    }
+                    retransmit_buffer.ack_through(ack);
+                }
+                if(current_state == READY_TIMER && retransmit_buffer.empty()) {
                     current_state = READY;
                 }
+            }else if(header.command == UAP_COMMAND_BUSY) {
+                // Server dropped a packet for lack of buffer space: slow down and
+                // resend the one it is waiting for, which is always admitted
+                pacer.on_loss();
+                uint8_t reason;
+                int32_t ack;
+                if(decode_busy(payload.data(), payload.size(), reason, ack)) {
+                    retransmit_buffer.ack_through(ack);
+                    resend(clientSocket, server_addr, ack + 1);
+                }
+            }else if(header.command == UAP_COMMAND_NACK) {
+                vector<SeqRange> ranges;
+                if(decode_nack(payload.data(), payload.size(), ranges) && !ranges.empty()) {
+                    retransmit_buffer.ack_through(ranges.front().first - 1);
+                    pacer.on_loss();
+                    for(auto const& [first, last] : ranges) {
+                        for(int32_t seq = first; seq <= last; seq++) {
+                            resend(clientSocket, server_addr, seq);
+                        }
+                    }
+                }
+            }else if(header.command == UAP_COMMAND_NEED) {
+                dedup.on_need(payload.data(), payload.size());
             }else if(header.command == UAP_COMMAND_GOODBYE) {
                 current_state = CLOSING;
             }
@@ -171,16 +467,28 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    char buffer2[sizeof(UAP_header)];
+    char buffer2[UAP_MAX_HEADER];
     clk = max(clk, last_header.logical_clock) + 1;
-    pack(buffer2, "", UAP_COMMAND_GOODBYE, sequence++, sessionID, clk, get_current_time());
-    send = sendto(clientSocket, buffer2, sizeof(buffer2), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    size_t goodbye_len = pack_packet(buffer2, "", UAP_COMMAND_GOODBYE, sequence++);
+    send = sendto(clientSocket, buffer2, goodbye_len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
     if (send < 0) {
         cout << "Failed to send GOODBYE" << endl;
     }
     current_state = CLOSED;
+    if (pacer.is_adaptive()) {
+        cout << "Final send rate: " << (int64_t)pacer.get_rate() << " B/s (smoothed RTT " << pacer.get_srtt_us() << " us)" << endl;
+    }
+    if (dedup_mode) {
+        cout << "Deduplicated: sent " << dedup.chunks_sent << " of " << dedup.chunk_count() << " chunks, "
+             << dedup.sent_bytes << " of " << dedup.total_bytes << " bytes" << endl;
+    }
+    if (rtt_histogram.count() > 0) {
+        rtt_histogram.print(cout, "Round trip (us)");
+    }
 
-    close(clientSocket);
+    for (int sock : stripe_sockets) {
+        close(sock);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "uap_client.h"
+#include "hello_opts.h"
+#include "work_stealing.h"
+#include "object_receiver.h"
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+// Transfers a directory tree over many concurrent sessions.
+//
+// Every regular file under the directory is cut into work items of at most
+// --item-mb MB, and each item is sent as one session of raw DATA payloads whose
+// HELLO names it (HELLO_OPT_OBJECT, "path@offset+length"). A B server started
+// with --receive-dir writes each item to that path and offset, rebuilding the
+// tree; otherwise the servers only log the names.
+// The items go into a work-stealing pool, one file's items per thread in turn,
+// largest files first; each of the --threads threads has its own UapLoop and
+// socket and keeps --sessions items in flight on it. A thread works through its
+// own queue from the small-file end and, once that is empty, steals from the
+// large-file end of the others', so a few huge files end up spread over every
+// thread while the many small ones keep the sessions busy. Each loop paces its
+// sessions with the delay-based controller, or at --rate bytes/s split over the
+// threads (0 turns pacing off). A failed item is retried up to
+// DIR_ITEM_ATTEMPTS times. Progress is reported every second.
+
+const size_t DIR_PAYLOAD_BYTES = 1024 - sizeof(UAP_header);    // fits the servers' buffers
+const int DIR_DEFAULT_THREADS = 4;
+const int DIR_DEFAULT_SESSIONS = 8;     // per thread
+const int DIR_DEFAULT_ITEM_MB = 4;
+const int DIR_ITEM_ATTEMPTS = 3;
+const int DIR_IDLE_MS = 10;             // pool empty but items still in flight elsewhere
+const int DIR_PROGRESS_MS = 1000;
+const uint16_t DIR_ACK_EVERY = 16;      // delayed acks, as the B client asks for in bulk mode
+const uint16_t DIR_ACK_DELAY_MS = 1;    // short, as every item ends waiting for its last ack
+
+struct FileEntry {
+    string path;                        // relative to the directory, as sent
+    string full_path;
+    uint64_t size;
+    atomic<int> items_left;
+
+    FileEntry(string path, string full_path, uint64_t size, int items)
+        : path(std::move(path)), full_path(std::move(full_path)), size(size), items_left(items) {}
+};
+
+struct WorkItem {
+    size_t file;
+    uint64_t offset;
+    uint64_t length;
+    int attempts;
+};
+
+deque<FileEntry> files;
+unique_ptr<WorkStealingPool<WorkItem>> pool;
+
+atomic<uint64_t> wire_bytes{0};         // payload bytes sent, including items that were retried
+atomic<uint64_t> done_bytes{0};         // bytes of completed items
+atomic<uint64_t> files_done{0};
+atomic<uint64_t> items_done{0};
+atomic<uint64_t> items_retried{0};
+atomic<uint64_t> items_failed{0};
+
+string describe(const WorkItem& item) {
+    return format_object(files[item.file].path, item.offset, item.length);
+}
+
+// Sends one item as one session; true once the server has all of it.
+UapTask<bool> send_item(UapLoop& loop, const WorkItem& item) {
+    int fd = open(files[item.file].full_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        co_return false;
+    }
+    UapSession& session = loop.create_session();
+    HelloOptions options;
+    options.set(HELLO_OPT_OBJECT, describe(item));
+    options.set_u16(HELLO_OPT_ACK_EVERY, DIR_ACK_EVERY);
+    options.set_u16(HELLO_OPT_ACK_DELAY_MS, DIR_ACK_DELAY_MS);
+    session.set_hello_options(options.encode());
+
+    bool ok = co_await session.connect();
+    string payload;
+    uint64_t sent = 0;
+    while (ok && sent < item.length) {
+        payload.resize(min<uint64_t>(DIR_PAYLOAD_BYTES, item.length - sent));
+        ssize_t n = pread(fd, payload.data(), payload.size(), item.offset + sent);
+        if (n <= 0) {
+            ok = false; // file shrank or can't be read any more
+            break;
+        }
+        payload.resize(n);
+        ok = co_await session.send(payload);
+        sent += n;
+        wire_bytes += n;
+    }
+    bool closed = co_await session.close();
+    close(fd);
+    loop.release(session);
+    co_return ok && closed;
+}
+
+// One of a thread's concurrent senders: takes items until the whole job is done.
+UapTask<void> sender(UapLoop& loop, size_t worker) {
+    WorkItem item;
+    while (true) {
+        if (!pool->pop(worker, item)) {
+            if (pool->remaining() == 0) {
+                co_return;
+            }
+            co_await loop.sleep(DIR_IDLE_MS); // a failing item may still come back
+            continue;
+        }
+        if (co_await send_item(loop, item)) {
+            done_bytes += item.length;
+            items_done++;
+            if (--files[item.file].items_left == 0) {
+                files_done++;
+            }
+        } else if (++item.attempts < DIR_ITEM_ATTEMPTS) {
+            items_retried++;
+            pool->push(worker, item);
+        } else {
+            items_failed++;
+            cout << "Failed to transfer " << describe(item) << " after " << item.attempts << " attempts" << endl;
+        }
+        pool->finish();
+    }
+}
+
+void run_worker(UapLoop* loop, size_t worker, int session_count) {
+    for (int i = 0; i < session_count; i++) {
+        loop->spawn(sender(*loop, worker));
+    }
+    loop->run();
+}
+
+void print_progress(uint64_t total_bytes, double seconds, uint64_t last_wire, double interval) {
+    cout << fixed << setprecision(1)
+         << "Progress: " << done_bytes / 1e6 << " / " << total_bytes / 1e6 << " MB ("
+         << (total_bytes ? 100.0 * done_bytes / total_bytes : 100.0) << "%), "
+         << files_done << " / " << files.size() << " files, "
+         << (interval > 0 ? (wire_bytes - last_wire) / interval / 1e6 : 0) << " MB/s, "
+         << seconds << " s" << defaultfloat << setprecision(6) << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc % 2 != 0) {
+        cerr << "Usage: " << argv[0] << " <hostname> <port> <directory> [--threads N] [--sessions N, per thread] [--item-mb N] [--rate bytes/s]" << endl;
+        return 1;
+    }
+    int thread_count = DIR_DEFAULT_THREADS;
+    int session_count = DIR_DEFAULT_SESSIONS;
+    int item_mb = DIR_DEFAULT_ITEM_MB;
+    double rate = -1;   // adaptive
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--threads") {
+            thread_count = max(1, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--sessions") {
+            session_count = max(1, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--item-mb") {
+            item_mb = max(1, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--rate") {
+            rate = max(0.0, atof(argv[i + 1]));
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    uint64_t item_bytes = (uint64_t)item_mb << 20;
+
+    // Collect the regular files, largest first
+    fs::path root(argv[3]);
+    error_code ec;
+    vector<pair<uint64_t, fs::path>> found;
+    for (fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec) && !it->is_symlink(ec)) {
+            found.push_back({it->file_size(ec), it->path()});
+        }
+    }
+    if (ec) {
+        cerr << "Cannot read directory " << argv[3] << ": " << ec.message() << endl;
+        return 1;
+    }
+    sort(found.begin(), found.end(), [](auto const& a, auto const& b) { return a.first > b.first; });
+
+    pool = make_unique<WorkStealingPool<WorkItem>>(thread_count);
+    uint64_t total_bytes = 0;
+    size_t item_count = 0;
+    for (auto const& [size, path] : found) {
+        int items = size == 0 ? 1 : (int)((size + item_bytes - 1) / item_bytes);
+        files.emplace_back(path.lexically_relative(root).string(), path.string(), size, items);
+        size_t index = files.size() - 1;
+        for (int i = 0; i < items; i++) {
+            uint64_t offset = (uint64_t)i * item_bytes;
+            pool->push(index, {index, offset, min(item_bytes, size - offset), 0});
+        }
+        total_bytes += size;
+        item_count += items;
+    }
+    cout << "Sending " << files.size() << " files, " << total_bytes << " bytes as " << item_count << " items over "
+         << thread_count << " threads x " << session_count << " sessions" << endl;
+
+    vector<unique_ptr<UapLoop>> loops;
+    for (int i = 0; i < thread_count; i++) {
+        loops.push_back(make_unique<UapLoop>());
+        if (!loops.back()->open(argv[1], atoi(argv[2]))) {
+            return 1;
+        }
+        if (rate < 0) {
+            loops.back()->set_pacing(0, true);
+        } else if (rate > 0) {
+            loops.back()->set_pacing(rate / thread_count, false);
+        }
+    }
+
+    auto start = steady_clock::now();
+    vector<thread> workers;
+    for (int i = 0; i < thread_count; i++) {
+        workers.emplace_back(run_worker, loops[i].get(), i, session_count);
+    }
+    auto last = start;
+    uint64_t last_wire = 0;
+    while (pool->remaining() > 0) {
+        this_thread::sleep_for(milliseconds(DIR_IDLE_MS));
+        auto now = steady_clock::now();
+        if (now - last >= milliseconds(DIR_PROGRESS_MS)) {
+            print_progress(total_bytes, duration<double>(now - start).count(), last_wire, duration<double>(now - last).count());
+            last = now;
+            last_wire = wire_bytes;
+        }
+    }
+    for (thread& t : workers) {
+        t.join();
+    }
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    cout << files_done << " of " << files.size() << " files transferred, " << done_bytes << " bytes in " << elapsed << " s ("
+         << (elapsed > 0 ? done_bytes / elapsed / 1e6 : 0) << " MB/s)" << endl;
+    cout << items_done << " items completed, " << pool->steals << " stolen, " << items_retried << " retried, "
+         << items_failed << " failed" << endl;
+    return items_failed == 0 ? 0 : 1;
+}
@@ -16,4 +16,12 @@ void pack(char* buff, const std::string& payload, uint8_t command, int32_t seqNo
     memcpy(buff, &header, sizeof(UAP_header));
 
     memcpy(buff + sizeof(UAP_header), payload.c_str(), payload.length());
+}
+
+size_t pack_compact(char* buff, const std::string& payload, uint8_t command, int32_t seqNo, int32_t sessionID, int64_t logical_clock, int64_t timestamp, CompactBase& base)
+{
+    size_t header_len = encode_compact_header(buff, command, seqNo, sessionID, logical_clock, timestamp, base);
+
+    memcpy(buff + header_len, payload.c_str(), payload.length());
+    return header_len + payload.length();
 }
\ No newline at end of file
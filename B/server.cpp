@@ -4,7 +4,6 @@
 #include <netinet/in.h>
 #include <thread>
 #include <map>
-#include <queue>
 #include <utility>
 #include <unistd.h>
 #include <cstring>
@@ -13,10 +12,26 @@
 #include <string>
 #include <chrono>
 #include <atomic>
+#include <deque>
+#include <condition_variable>
 #include <fcntl.h>
+#include <poll.h>
 #include "../include/UAP_header.h"
 #include "../include/pack.h"
 #include "../include/unpack.h"
+#include "../include/reliability.h"
+#include "../include/admission.h"
+#include "../include/seq_window.h"
+#include "../include/udp_offload.h"
+#include "../include/hello_opts.h"
+#include "../include/low_latency.h"
+#include "../include/trace_file.h"
+#include "../include/compact_header.h"
+#include "../include/striping.h"
+#include "../include/drr_scheduler.h"
+#include "../include/shm_ring.h"
+#include "../include/dedup.h"
+#include "../include/object_receiver.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -24,11 +39,39 @@ using namespace std::chrono;
 int32_t global_squence_no = 0;
 mutex global_mutex;
 
+const int WORKER_BATCH = 64;     // messages a worker handles before checking timers and new sessions
+const int WORKER_TICK_MS = 1;   // how often an idle worker checks its sessions' timers
+
 class sessions;
-void handle_session(sessions&);
 atomic<bool> quitFlag(false);
 
-map<int32_t, unique_ptr<sessions>> session_threads;
+// A thread that handles the sessions assigned to it (by session id). The
+// dispatcher queues their DATA on `scheduler`, which the worker serves in
+// weighted round-robin order.
+class session_worker {
+public:
+    thread worker_thread;
+    mutex mtx;                                                  // guards scheduler and starting
+    condition_variable wakeup;
+    DrrScheduler<int32_t, pair<UAP_header, string>> scheduler;
+    deque<sessions*> starting;                                  // HELLO reply still to be sent
+    map<int32_t, sessions*> active;                             // worker thread only
+};
+
+map<int32_t, unique_ptr<sessions>> session_map;
+mutex dispatch_mutex; // session_map, with --sockets > 1 shared by the receive threads
+int socket_count = 1; // --sockets: SO_REUSEPORT sockets bound to the port
+int worker_count = 1; // --workers: threads the sessions are spread over
+vector<unique_ptr<session_worker>> workers;
+AdmissionControl admission;
+int window_width = SEQ_WINDOW_DEFAULT;
+LowLatencyOptions low_latency;
+TraceWriter capture; // --capture: raw incoming datagrams for uap_replay
+ShmRingWriter shm_ring; // --shm: in-order payloads for local consumer processes
+ChunkStore chunk_store; // --chunk-store: chunks and rebuilt files of deduplicated transfers
+string receive_dir; // --receive-dir: where the files of directory transfers are written
+uint64_t dedup_max_bytes = DEDUP_MAX_FILE_BYTES; // --dedup-max-bytes: largest file a deduplicated transfer may send
+size_t helper_threads = 0; // workers and receive threads, for CPU pinning
 int64_t clk = 0;
 int64_t get_current_time() {
     return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
@@ -39,145 +82,645 @@ public:
     int32_t session_id;
     int server_socket;
     sockaddr_in client_addr;
-    thread session_thread;
     UAP_header last_header;
-    mutex session_mutex;
     atomic<bool> is_done{false};
     steady_clock::time_point timeout_counter;
     int64_t count = 0;
     int64_t latency_sum = 0;
 
-    queue<pair<UAP_header, string>> message_queue;
+    ReorderBuffer<pair<UAP_header, string>> reorder; // DATA received ahead of a gap
+    atomic<size_t> buffered_bytes{0};                // charged by the dispatcher, released once handled
+    atomic<int32_t> next_expected{0};                // lets the dispatcher always admit gap fillers
+    SequenceWindow window;                           // which recent sequence numbers were received
+    AckScheduler acks;                               // when the next cumulative ALIVE is due
+    string hello_reply;                              // options accepted from the client's HELLO
+    string hello_packet;                             // the HELLO reply as sent (worker only)
+    atomic<bool> hello_repeated{false};              // the client missed the reply and asked again
+    uint8_t version = UAP_VERSION;                   // header version negotiated in the HELLO
+    CompactBase client_base;                         // v2: client's deltas are against its HELLO (dispatcher only)
+    CompactBase server_base;                         // v2: ours against our HELLO reply (worker only)
+    int stripes = 1;                                 // source ports the client stripes DATA over
+    bool nack_armed = false;                         // striped: a gap is waiting out STRIPE_REORDER_MS
+    steady_clock::time_point nack_due;
+    uint16_t priority = SESSION_PRIORITY_DEFAULT;    // weight in its worker's scheduler
+    unique_ptr<DedupReceiver> dedup;                 // deduplicated transfer, if negotiated
+    string object;                                   // what the client says the session carries
+    unique_ptr<ObjectWriter> object_writer;          // --receive-dir: the file range `object` names
 
-    sessions(int32_t id, int sock, sockaddr_in addr, UAP_header header) : session_id(id), server_socket(sock), client_addr(addr) {
+    sessions(int32_t id, int sock, sockaddr_in addr, UAP_header header, const string& hello_payload) : session_id(id), server_socket(sock), client_addr(addr) {
         last_header = header;
         last_header.session_id = id;
-        session_thread = thread(handle_session, ref(*this));
+        next_expected = header.sequence_number + 1;
+        window.reset(header.sequence_number, window_width);
+        client_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+
+        // Negotiate the options the client asked for
+        HelloOptions requested, accepted;
+        requested.decode(hello_payload.data(), hello_payload.size());
+        uint16_t ack_every, ack_delay_ms = ACK_DEFAULT_DELAY_MS;
+        if (requested.get_u16(HELLO_OPT_ACK_EVERY, ack_every)) {
+            requested.get_u16(HELLO_OPT_ACK_DELAY_MS, ack_delay_ms);
+            acks.configure(ack_every, ack_delay_ms);
+            accepted.set_u16(HELLO_OPT_ACK_EVERY, acks.get_every());
+            accepted.set_u16(HELLO_OPT_ACK_DELAY_MS, acks.get_delay_ms());
+        }
+        uint16_t requested_version;
+        if (requested.get_u16(HELLO_OPT_VERSION, requested_version) && requested_version >= UAP_VERSION_COMPACT) {
+            version = UAP_VERSION_COMPACT;
+            accepted.set_u16(HELLO_OPT_VERSION, UAP_VERSION_COMPACT);
+        }
+        uint16_t requested_stripes;
+        if (requested.get_u16(HELLO_OPT_STRIPES, requested_stripes) && requested_stripes > 1) {
+            stripes = min<int>(requested_stripes, UAP_MAX_STRIPES);
+            accepted.set_u16(HELLO_OPT_STRIPES, stripes);
+        }
+        uint16_t requested_priority;
+        if (requested.get_u16(HELLO_OPT_PRIORITY, requested_priority)) {
+            priority = clamp_priority(requested_priority);
+            accepted.set_u16(HELLO_OPT_PRIORITY, priority);
+        }
+        string dedup_name;
+        if (requested.get(HELLO_OPT_DEDUP, dedup_name) && chunk_store.is_open()) {
+            dedup = make_unique<DedupReceiver>(dedup_name, dedup_max_bytes, &admission);
+            accepted.set(HELLO_OPT_DEDUP, dedup_name);
+        }
+        requested.get(HELLO_OPT_OBJECT, object);
+        hello_reply = accepted.encode();
     }
 };
 
-void handle_session(sessions &s) {
-    char buffer[sizeof(UAP_header)];
+// Returns a handled message's bytes to the session and global admission budgets.
+void release_message(sessions &s, const string& payload) {
+    size_t bytes = sizeof(UAP_header) + payload.size();
+    s.buffered_bytes -= bytes;
+    admission.release(bytes);
+}
+
+// Packs a reply to `s` into `buffer` (UAP_MAX_HEADER + payload bytes) and returns
+// its length: v2 once negotiated, without the timestamp the client doesn't read.
+size_t pack_reply(sessions &s, char* buffer, const string& payload, uint8_t command, int32_t seq, int64_t clock, int64_t timestamp) {
+    if (s.version == UAP_VERSION_COMPACT) {
+        return pack_compact(buffer, payload, command, seq, s.session_id, clock, 0, s.server_base);
+    }
+    pack(buffer, payload, command, seq, s.session_id, clock, timestamp);
+    return sizeof(UAP_header) + payload.size();
+}
+
+// Sends a v1 reply from the dispatcher, which doesn't touch the sessions' v2 bases.
+void send_dispatcher_reply(int sock, const sockaddr_in& addr, int32_t session_id, uint8_t command, const string& payload) {
+    char buffer[sizeof(UAP_header) + payload.size()];
+    {
+        lock_guard<mutex> lock(global_mutex);
+        clk++;
+        pack(buffer, payload, command, global_squence_no, session_id, clk, get_current_time());
+        global_squence_no++;
+    }
+    sendto(sock, buffer, sizeof(buffer), 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+void send_busy(int sock, const sockaddr_in& addr, int32_t session_id, uint8_t reason, int32_t ack) {
+    if (admission.busy_allowed()) {
+        send_dispatcher_reply(sock, addr, session_id, UAP_COMMAND_BUSY, encode_busy(reason, ack));
+    }
+}
+
+// Pops the next held packet that can be delivered in order. A gap that has slid
+// out of the sequence window can no longer be filled and is skipped as lost.
+bool pop_deliverable(sessions &s, pair<UAP_header, string>& next) {
+    int32_t lowest = s.window.lowest();
+    if(s.last_header.sequence_number + 1 < lowest) {
+        int32_t resume = lowest;
+        int32_t held;
+        if(s.reorder.first(held) && held < resume) {
+            resume = held;
+        }
+        cout << "lost packet " << s.last_header.sequence_number + 1 << "-" << resume - 1 << endl;
+        s.last_header.sequence_number = resume - 1;
+        s.next_expected = resume;
+    }
+    return s.reorder.pop(s.last_header.sequence_number + 1, next);
+}
+
+// Cumulative ALIVE for everything delivered so far, or a NACK listing the
+// missing ranges while packets are held behind a gap.
+int send_ack(sessions &s, const UAP_header& head) {
+    string payload = !s.reorder.empty() ? encode_nack(s.reorder.missing(s.last_header.sequence_number + 1))
+                   : s.acks.delayed()   ? encode_ack(s.last_header.sequence_number, s.acks.held_us())
+                                        : encode_ack(s.last_header.sequence_number);
+    uint8_t command = s.reorder.empty() ? UAP_COMMAND_ALIVE : UAP_COMMAND_NACK;
+    char buffer[UAP_MAX_HEADER + payload.size()];
+    size_t len;
+    {
+        lock_guard<mutex> lock(global_mutex);
+        clk = max(clk, head.logical_clock) + 1;
+        len = pack_reply(s, buffer, payload, command, s.last_header.sequence_number, clk, get_current_time());
+        global_squence_no++;
+    }
+    s.timeout_counter = steady_clock::now();
+    s.acks.sent();
+    return sendto(s.server_socket, buffer, len, 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+}
+
+// NACKs the gaps in the reorder buffer. Sub-flows of a striped session overtake
+// each other, so there the NACK is only armed and sent once the gap has stayed
+// open for STRIPE_REORDER_MS.
+int nack_gaps(sessions &s, const UAP_header& head) {
+    if (s.stripes <= 1) {
+        return send_ack(s, head);
+    }
+    if (!s.nack_armed) {
+        s.nack_armed = true;
+        s.nack_due = steady_clock::now() + milliseconds(STRIPE_REORDER_MS);
+    }
+    return 0;
+}
+
+// Takes in a MANIFEST or CHUNK of a deduplicated transfer. A MANIFEST, also a
+// duplicate one, is answered with the NEED for its chunks.
+void handle_dedup(sessions &s, const UAP_header& head, const string& payload) {
+    if(!s.dedup) {
+        return;
+    }
+    if(head.command == UAP_COMMAND_CHUNK) {
+        s.dedup->on_chunk(chunk_store, s.buffered_bytes, payload.data(), payload.size());
+        return;
+    }
+    string need = s.dedup->on_manifest(chunk_store, payload.data(), payload.size());
+    if(need.empty()) {
+        return;
+    }
+    char buffer[UAP_MAX_HEADER + need.size()];
+    size_t len;
+    {
+        lock_guard<mutex> lock(global_mutex);
+        clk = max(clk, head.logical_clock) + 1;
+        len = pack_reply(s, buffer, need, UAP_COMMAND_NEED, s.last_header.sequence_number, clk, get_current_time());
+        global_squence_no++;
+    }
+    sendto(s.server_socket, buffer, len, 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+}
+
+// Rebuilds the file of a deduplicated transfer from the chunk store.
+void finish_dedup(sessions &s) {
+    DedupReceiver &d = *s.dedup;
+    string path;
+    if(d.rebuild(chunk_store, path)) {
+        cout << "Rebuilt " << path << " for session " << s.session_id << ": " << d.file_size() << " bytes, "
+             << d.chunk_count() << " chunks, " << d.chunks_received << " new (" << d.bytes_received << " bytes received)" << endl;
+    }else {
+        cout << "Deduplicated transfer of " << d.name << " for session " << s.session_id << " incomplete, not rebuilt"
+             << (d.too_large ? " (file larger than --dedup-max-bytes)" : "")
+             << (d.corrupt ? " (corrupt chunks received)" : "")
+             << (d.chunks_dropped ? " (chunks dropped over the buffer limits)" : "") << endl;
+    }
+}
+
+// Sends the HELLO reply that opens the session. False if it couldn't be sent.
+bool start_session(sessions &s) {
+    if(!receive_dir.empty() && !s.object.empty()) {
+        s.object_writer = make_unique<ObjectWriter>();
+        if(!s.object_writer->open(receive_dir, s.object)) {
+            cout << "Cannot write object " << s.object << " for session " << s.session_id << ", refusing it" << endl;
+            return false;
+        }
+    }
+    char buffer[sizeof(UAP_header) + s.hello_reply.size()];
     {
         lock_guard<mutex> lock(global_mutex);
         clk = max(clk, s.last_header.logical_clock) + 1;
-        pack(buffer, "", UAP_COMMAND_HELLO, s.last_header.sequence_number, s.session_id, clk, get_current_time());
+        int64_t t1 = get_current_time();
+        pack(buffer, s.hello_reply, UAP_COMMAND_HELLO, s.last_header.sequence_number, s.session_id, clk, t1);
+        s.server_base.reset(s.last_header.sequence_number, clk, t1); // the HELLO reply is always v1
         global_squence_no++;
     }
+    s.hello_packet.assign(buffer, sizeof(buffer));
+    s.hello_repeated = false; // answered by this reply
     s.timeout_counter = steady_clock::now();
-    int send = sendto(s.server_socket, buffer, sizeof(UAP_header), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
-    if(send < 0) { perror("sendto"); s.is_done = true; return; }
+    int send = sendto(s.server_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+    if(send < 0) { perror("sendto"); return false; }
+    return true;
+}
+
+// Handles one DATA, GOODBYE, MANIFEST or CHUNK of `s`. False once the session is over.
+bool handle_message(sessions &s, UAP_header head, string payload) {
+    s.count++;
+    SeqStatus status = s.window.check(head.sequence_number);
+    if(status == SEQ_DUPLICATE || status == SEQ_TOO_OLD) {
+        cout << (status == SEQ_DUPLICATE ? "duplicate packet" : "packet older than the window") << endl;
+        if(head.command == UAP_COMMAND_MANIFEST) {
+            handle_dedup(s, head, payload); // resent because its NEED went missing
+        }
+        release_message(s, payload);
+        send_ack(s, head);
+        return true;
+    }
+    s.window.update(head.sequence_number);
+    bool filling_gap = !s.reorder.empty();
+
+    if(head.sequence_number != s.last_header.sequence_number + 1) {
+        cout << "lost packet, holding " << head.sequence_number << endl;
+        s.reorder.hold(head.sequence_number, {head, payload});
+        pair<UAP_header, string> next;
+        if(!pop_deliverable(s, next)) {
+            nack_gaps(s, head);
+            return true;
+        }
+        head = next.first;
+        payload = next.second;
+    }
 
+    // Deliver this packet and everything that was held behind it
+    bool goodbye = false;
     while(true) {
-        if(!s.message_queue.empty()) {
-            UAP_header head;
-            string payload = "";
+        release_message(s, payload);
+        if(head.command == UAP_COMMAND_GOODBYE) {
+            char buffer[UAP_MAX_HEADER];
+            size_t len;
             {
-                lock_guard<mutex> lock(s.session_mutex);
-                auto [h, p] = s.message_queue.front();
-                head = h;
-                payload = p;
-                s.message_queue.pop();
-                s.count++;
-            }
-
-            if(head.sequence_number != s.last_header.sequence_number + 1) {
-                if(head.sequence_number < s.last_header.sequence_number) {
-                    char buffer[sizeof(UAP_header)];
-                    {
-                        lock_guard<mutex> lock(global_mutex);
-                        clk = max(clk, head.logical_clock) + 1;
-                        int64_t t1 = get_current_time();
-                        pack(buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, s.session_id, clk, t1);
-                        cout << "One-way Latency: " << t1 - head.timestamp << endl;
-                        s.latency_sum += (t1 - head.timestamp);
-                        global_squence_no++;
-                    }
-                    int send = sendto(s.server_socket, buffer, sizeof(UAP_header), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
-                    break;
-                }else if(head.sequence_number == s.last_header.sequence_number) {
-                    cout << "duplicate packet" << endl;
-                    continue;
-                }else{
-                    for(int i=s.last_header.sequence_number + 1; i < head.sequence_number; i++) {
-                        cout << "lost packet" << endl;
-                    }
+                lock_guard<mutex> lock(global_mutex);
+                clk = max(clk, head.logical_clock) + 1;
+                int64_t t1 = get_current_time();
+                len = pack_reply(s, buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, clk, t1);
+                if(head.timestamp != 0) {
+                    cout << "One-way Latency: " << t1 - head.timestamp << endl;
+                    s.latency_sum += (t1 - head.timestamp);
                 }
+                global_squence_no++;
             }
+            sendto(s.server_socket, buffer, len, 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+            goodbye = true;
+            break;
+        }
 
-            if(head.command == UAP_COMMAND_GOODBYE) {
-                char buffer[sizeof(UAP_header)];
+        s.last_header = head;
+        if(head.command == UAP_COMMAND_MANIFEST || head.command == UAP_COMMAND_CHUNK) {
+            handle_dedup(s, head, payload);
+            if(s.dedup && s.dedup->too_large) {
+                // Refused: end the session rather than leave the client waiting for a NEED
+                char buffer[UAP_MAX_HEADER];
+                size_t len;
                 {
                     lock_guard<mutex> lock(global_mutex);
                     clk = max(clk, head.logical_clock) + 1;
-                    int64_t t1 = get_current_time();
-                    pack(buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, s.session_id, clk, t1);
-                    cout << "One-way Latency: " << t1 - head.timestamp << endl;
-                    s.latency_sum += (t1 - head.timestamp);
+                    len = pack_reply(s, buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, clk, get_current_time());
                     global_squence_no++;
                 }
-                int send = sendto(s.server_socket, buffer, sizeof(UAP_header), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+                sendto(s.server_socket, buffer, len, 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+                goodbye = true;
                 break;
             }
-
-            s.last_header = head;
+        }else if(s.object_writer) {
+            s.object_writer->write(payload.data(), payload.size());
+        }else {
             cout << s.session_id << " [" << s.last_header.sequence_number << "] " << payload << endl;
+            shm_ring.publish(SHM_RECORD_DATA, s.session_id, s.last_header.sequence_number, payload.data(), payload.length());
+        }
 
-            char buffer[sizeof(UAP_header)];
+        pair<UAP_header, string> held;
+        if(!pop_deliverable(s, held)) {
+            break;
+        }
+        head = held.first;
+        payload = held.second;
+    }
+    s.next_expected = s.last_header.sequence_number + 1;
+    if(goodbye) {
+        return false;
+    }
+    if(!s.reorder.empty()) {
+        nack_gaps(s, head); // gaps remain: NACK them
+        return true;
+    }
+    s.nack_armed = false;
+
+    if(head.timestamp != 0) { // optional in v2
+        int64_t t1 = get_current_time();
+        cout << "One-way Latency: " << t1 - head.timestamp << " | " << head.timestamp << " | " << t1 << endl;
+        s.latency_sum += (t1 - head.timestamp);
+    }
+
+    // In delayed-ack mode a plain in-order packet only counts towards the next ALIVE
+    if(!filling_gap && !s.acks.on_data()) {
+        return true;
+    }
+    int send = send_ack(s, head);
+    if(send < 0) { perror("sendto"); return false; }
+    return true;
+}
+
+// Delayed NACKs and ALIVEs, and the idle timeout. False once the session timed out.
+bool handle_timers(sessions &s) {
+    if(s.hello_repeated.exchange(false)) {
+        // Resent unchanged, as v2 deltas are against it
+        sendto(s.server_socket, s.hello_packet.data(), s.hello_packet.size(), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+    }
+    if(s.nack_armed && steady_clock::now() >= s.nack_due) {
+        s.nack_armed = false;
+        if(!s.reorder.empty()) {
+            send_ack(s, s.last_header);
+        }
+    }else if(s.acks.due()) {
+        send_ack(s, s.last_header);
+    }else {
+        auto elapsed = duration_cast<seconds>(steady_clock::now() - s.timeout_counter).count();
+        if(elapsed > 10) {
+            char buffer[UAP_MAX_HEADER];
+            size_t len;
             {
                 lock_guard<mutex> lock(global_mutex);
-                clk = max(clk, head.logical_clock) + 1;
+                clk = max(clk, s.last_header.logical_clock) + 1;
                 int64_t t1 = get_current_time();
-                pack(buffer, "", UAP_COMMAND_ALIVE, head.sequence_number, s.session_id, clk, t1);
-                cout << "One-way Latency: " << t1 - head.timestamp << " | " << head.timestamp << " | " << t1 << endl;
-                s.latency_sum += (t1 - head.timestamp);
-                global_squence_no++;
-            }
-            s.timeout_counter = steady_clock::now();
-            int send = sendto(s.server_socket, buffer, sizeof(UAP_header), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
-            
-            if(send < 0) { perror("sendto"); break; }
-            
-        }else {
-            auto elapsed = duration_cast<seconds>(steady_clock::now() - s.timeout_counter).count();
-            if(elapsed > 10) {
-                char buffer[sizeof(UAP_header)];
-                {
-                    lock_guard<mutex> lock(global_mutex);
-                    clk = max(clk, s.last_header.logical_clock) + 1;
-                    int64_t t1 = get_current_time();
-                    pack(buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, s.session_id, clk, t1);
+                len = pack_reply(s, buffer, "", UAP_COMMAND_GOODBYE, global_squence_no, clk, t1);
+                if(s.last_header.timestamp != 0) {
                     cout << "One-way Latency: " << t1 - s.last_header.timestamp << endl;
                     s.latency_sum += (t1 - s.last_header.timestamp);
-                    global_squence_no++;
                 }
-                int send = sendto(s.server_socket, buffer, sizeof(UAP_header), 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
-                break;
+                global_squence_no++;
             }
+            sendto(s.server_socket, buffer, len, 0, (struct sockaddr*)&s.client_addr, sizeof(s.client_addr));
+            return false;
         }
     }
-    s.is_done = true;
+    return true;
+}
 
+void finish_session(session_worker &w, sessions &s) {
     cout << "Average Latency for session " << s.session_id << ": " << (s.count ? (s.latency_sum / s.count) : 0) << endl;
+    cout << "Lost packets for session " << s.session_id << ": " << s.window.lost() << endl;
+    if(s.dedup) {
+        finish_dedup(s);
+    }
+    if(s.object_writer) {
+        if(s.object_writer->complete()) {
+            cout << "Received " << s.object << " for session " << s.session_id << endl;
+        }else {
+            cout << "Object " << s.object << " for session " << s.session_id << " incomplete ("
+                 << (s.object_writer->failed ? "write failed" : to_string(s.object_writer->remaining()) + " bytes missing") << ")" << endl;
+        }
+        s.object_writer->close();
+    }
+    shm_ring.publish(SHM_RECORD_SESSION_END, s.session_id, s.next_expected, nullptr, 0);
+    {
+        lock_guard<mutex> lock(w.mtx);
+        w.scheduler.remove(s.session_id);
+    }
+    w.active.erase(s.session_id);
+    s.is_done = true; // from here on the dispatcher may free it
+}
+
+// Serves the sessions of one worker: DATA in deficit round-robin order across
+// sessions, weighted by their priority, then the sessions' timers.
+void run_worker(session_worker &w) {
+    unique_lock<mutex> lock(w.mtx);
+    while(!quitFlag) {
+        while(!w.starting.empty()) {
+            sessions* s = w.starting.front();
+            w.starting.pop_front();
+            lock.unlock();
+            if(start_session(*s)) {
+                w.active[s->session_id] = s;
+            }else {
+                s->is_done = true;
+            }
+            lock.lock();
+        }
+
+        int32_t id;
+        pair<UAP_header, string> message;
+        for(int i = 0; i < WORKER_BATCH && w.scheduler.pop(id, message); i++) {
+            lock.unlock();
+            // Messages that raced with the end of their session were already
+            // released with the rest of its buffered bytes
+            auto it = w.active.find(id);
+            if(it != w.active.end() && !handle_message(*it->second, message.first, message.second)) {
+                finish_session(w, *it->second);
+            }
+            lock.lock();
+        }
+
+        lock.unlock();
+        for(auto it = w.active.begin(); it != w.active.end();) {
+            sessions &s = *(it++)->second; // finish_session erases it
+            if(!handle_timers(s)) {
+                finish_session(w, s);
+            }
+        }
+        lock.lock();
+
+        if(w.scheduler.empty() && w.starting.empty() && !quitFlag) {
+            w.wakeup.wait_for(lock, milliseconds(WORKER_TICK_MS));
+        }
+    }
+    lock.unlock();
+    while(!w.active.empty()) {
+        finish_session(w, *w.active.begin()->second);
+    }
+}
+
+session_worker& worker_for(int32_t session_id) {
+    return *workers[(uint32_t)session_id % workers.size()];
+}
+
+// Admits, unpacks and routes one UAP datagram to its session's worker.
+void dispatch(int server_socket, const char* buffer, int n, const sockaddr_in& client_addr) {
+    // v1 or v2 header; v2 is delta-encoded against the session's HELLO, so the
+    // session is looked up first
+    int32_t peeked_id;
+    if (!peek_session_id(buffer, n, peeked_id)) {
+        return;
+    }
+    auto found = session_map.find(peeked_id);
+    CompactBase hello_base;
+    UAP_header header;
+    size_t header_len;
+    if (!decode_header(buffer, n, header, header_len, found == session_map.end() ? hello_base : found->second->client_base)) {
+        return;
+    }
+
+    // Admission check before the payload is copied. Charged at the v1 size
+    // whatever the header version, as release_message gives it back.
+    size_t charged = sizeof(UAP_header) + (n - header_len);
+    if (found == session_map.end()) {
+        if (header.command == UAP_COMMAND_HELLO && !admission.admit_session(session_map.size())) {
+            send_busy(server_socket, client_addr, header.session_id, UAP_BUSY_SESSIONS, 0);
+            return;
+        }
+    } else if (uap_command_sequenced(header.command)) {
+        // Replies go to where the HELLO came from: a striped client only
+        // reads its main socket, not the sub-flow this packet came from
+        const sessions& s = *found->second;
+        uint8_t reason;
+        int32_t next_expected = s.next_expected;
+        if (header.sequence_number < next_expected && header.command != UAP_COMMAND_MANIFEST) {
+            // Already delivered, so its ack went missing: ack again without
+            // buffering it. A MANIFEST goes through, its NEED is resent.
+            send_dispatcher_reply(s.server_socket, s.client_addr, header.session_id, UAP_COMMAND_ALIVE, encode_ack(next_expected - 1));
+            return;
+        }
+        if (header.sequence_number == next_expected) {
+            admission.charge(charged);
+        } else if (!admission.reserve(s.buffered_bytes, charged, reason)) {
+            send_busy(s.server_socket, s.client_addr, header.session_id, reason, next_expected - 1);
+            return;
+        }
+        found->second->buffered_bytes += charged;
+    }
+
+    string payload(buffer + header_len, n - header_len);
+
+    if(header.command == UAP_COMMAND_HELLO) {
+        const int32_t session_id_copy = header.session_id;
+        if (session_map.find(session_id_copy) == session_map.end()) {
+            sessions* s = (session_map[session_id_copy] = make_unique<sessions>(session_id_copy, server_socket, client_addr, header, payload)).get();
+            if (!s->object.empty()) {
+                cout << session_id_copy << " Object " << s->object << endl;
+            }
+            session_worker& w = worker_for(session_id_copy);
+            {
+                lock_guard<mutex> lock(w.mtx);
+                w.scheduler.set_weight(session_id_copy, s->priority);
+                w.starting.push_back(s);
+            }
+            w.wakeup.notify_one();
+        }else if(found->second->client_addr.sin_addr.s_addr == client_addr.sin_addr.s_addr
+                 && found->second->client_addr.sin_port == client_addr.sin_port) {
+            // The client missed our reply: its worker sends it again
+            cout << "HELLO repeated for session " << session_id_copy << ", resending the reply" << endl;
+            found->second->hello_repeated = true;
+            worker_for(session_id_copy).wakeup.notify_one();
+        }else{
+            cout << "Session ID already exists, ignoring HELLO" << endl;
+        }
+    }else if(uap_command_sequenced(header.command)) {
+        if(found != session_map.end()) {
+            session_worker& w = worker_for(header.session_id);
+            bool queued;
+            {
+                lock_guard<mutex> lock(w.mtx);
+                queued = w.scheduler.push(header.session_id, {header, payload}, n);
+            }
+            if (!queued) {
+                found->second->buffered_bytes -= charged;
+                admission.release(charged);
+                return;
+            }
+            w.wakeup.notify_one();
+        }
+    }
+}
+
+// Receives one datagram (or GRO batch) from `sock` and dispatches its segments.
+void receive_datagrams(int sock) {
+    // With GRO one read may hold several coalesced datagrams
+    static thread_local char buffer[GRO_BUFFER_SIZE];
+    struct sockaddr_in client_addr;
+    size_t segment_size;
+    ssize_t n = recv_coalesced(sock, buffer, sizeof(buffer), &client_addr, segment_size);
+    if (n > 0) {
+        lock_guard<mutex> lock(dispatch_mutex);
+        for_each_segment(buffer, n, segment_size, [&](const char* datagram, size_t len) {
+            capture.record(datagram, len, client_addr);
+            dispatch(sock, datagram, len, client_addr);
+        });
+    }
+}
+
+// --sockets: serves one of the extra SO_REUSEPORT sockets until quitFlag is set.
+// The kernel hashes each client address to one socket, so the sub-flows of a
+// striped session are received in parallel and merged by their session's worker.
+void receive_loop(int sock) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (!quitFlag) {
+        if (spin_until_readable(sock, low_latency.spin_us) || poll(&pfd, 1, 100) > 0) {
+            receive_datagrams(sock);
+        }
+    }
 }
 
 int main(int argc, char* argv[]) {
+    AdmissionLimits limits;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--window") {
+            window_width = atoi(argv[i + 1]);
+        } else if (string(argv[i]) == "--workers") {
+            worker_count = max(1, atoi(argv[i + 1]));
+        } else if (string(argv[i]) == "--sockets") {
+            socket_count = max(1, min(atoi(argv[i + 1]), UAP_MAX_SERVER_SOCKETS));
+        } else if (string(argv[i]) == "--capture") {
+            if (!capture.open(argv[i + 1])) {
+                cout << "Failed to open capture file " << argv[i + 1] << endl;
+                return 1;
+            }
+        } else if (string(argv[i]) == "--chunk-store") {
+            if (!chunk_store.open(argv[i + 1])) {
+                cout << "Failed to open chunk store " << argv[i + 1] << endl;
+                return 1;
+            }
+        } else if (string(argv[i]) == "--shm") {
+            if (!shm_ring.open(argv[i + 1])) {
+                cout << "Failed to create shared memory ring " << argv[i + 1] << endl;
+                return 1;
+            }
+        } else if (string(argv[i]) == "--dedup-max-bytes") {
+            dedup_max_bytes = strtoull(argv[i + 1], nullptr, 10);
+        } else if (string(argv[i]) == "--receive-dir") {
+            receive_dir = argv[i + 1];
+            error_code ec;
+            if (!filesystem::is_directory(receive_dir, ec)) {
+                cout << "Receive directory " << receive_dir << " does not exist" << endl;
+                return 1;
+            }
+        } else if (!parse_admission_option(argv[i], argv[i + 1], limits)
+                   && !parse_low_latency_option(argv[i], argv[i + 1], low_latency)) {
+            cout << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    admission.configure(limits);
+
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(atoi(argv[1]));
     server_addr.sin_addr.s_addr = INADDR_ANY;
     
-    int server_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_socket < 0) {
-        cout << "Failed to create socket" << endl;
-        return 1;
-    }
-
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    vector<int> server_sockets = open_reuseport_sockets(server_addr, socket_count);
+    if (server_sockets.empty()) {
         cout << "Bind failed" << endl;
-        close(server_socket);
         return 1;
     }
+    int server_socket = server_sockets[0];
+    bool gro = false;
+    for (int sock : server_sockets) {
+        gro = enable_gro(sock);
+        if (low_latency.enabled()) {
+            apply_low_latency(sock, low_latency);
+        }
+    }
+    if (gro) {
+        cout << "UDP GRO enabled" << endl;
+    }
+    if (low_latency.enabled()) {
+        cout << "Low-latency mode: busy poll " << low_latency.busy_poll_us << " us, spin " << low_latency.spin_us << " us" << endl;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        workers.push_back(make_unique<session_worker>());
+        workers.back()->worker_thread = thread(run_worker, ref(*workers.back()));
+        int cpu = helper_cpu(low_latency, helper_threads++);
+        if (cpu >= 0) {
+            pin_thread(workers.back()->worker_thread.native_handle(), cpu);
+        }
+    }
+    vector<thread> receivers;
+    for (size_t i = 1; i < server_sockets.size(); i++) {
+        receivers.emplace_back(receive_loop, server_sockets[i]);
+        int cpu = helper_cpu(low_latency, helper_threads++);
+        if (cpu >= 0) {
+            pin_thread(receivers.back().native_handle(), cpu);
+        }
+    }
+    if (server_sockets.size() > 1) {
+        cout << "Receiving on " << server_sockets.size() << " SO_REUSEPORT sockets" << endl;
+    }
 
     while(true) {
         fd_set read_fds;
@@ -187,7 +730,9 @@ int main(int argc, char* argv[]) {
 
         int max_fd = max(server_socket, STDIN_FILENO);
 
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        struct timeval no_wait = {0, 0};
+        bool ready = spin_until_readable(server_socket, low_latency.spin_us); // data already there: don't block
+        int activity = select(max_fd + 1, &read_fds, NULL, NULL, ready ? &no_wait : NULL);
 
         if (activity < 0) {
             perror("select error");
@@ -205,49 +750,14 @@ int main(int argc, char* argv[]) {
         }
 
         if (FD_ISSET(server_socket, &read_fds)) {
-
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_len = sizeof(client_addr);
-
-            char buffer[1024];
-            int n = recvfrom(server_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&client_addr, &client_addr_len);
-            if (n < 0) {
-                continue;
-            }
-
-            string payload = "";
-            UAP_header header;
-            if(!unPack(buffer, n, header, payload)) {
-                cout << "Failed to unpack message" << endl;
-                continue;
-            }
-
-            if(header.magic != UAP_MAGIC || header.version != UAP_VERSION) {
-                continue;
-            }
-
-            if(header.command == UAP_COMMAND_HELLO) {
-                const int32_t session_id_copy = header.session_id;
-                if (session_threads.find(session_id_copy) == session_threads.end()) {
-                    session_threads[session_id_copy] = make_unique<sessions>(session_id_copy, server_socket, client_addr, header);
-                }else{
-                    cout << "Session ID already exists, ignoring HELLO" << endl;
-                }
-            }else if(header.command == UAP_COMMAND_DATA) {
-                if(session_threads.find(header.session_id) != session_threads.end()) {
-                    session_threads[header.session_id]->message_queue.push({header, payload});
-                }
-            }else if (header.command == UAP_COMMAND_GOODBYE) {
-                if(session_threads.find(header.session_id) != session_threads.end()) {
-                    session_threads[header.session_id]->message_queue.push({header, ""});
-                }
-            }
+            receive_datagrams(server_socket);
         }
 
-        for (auto it = session_threads.begin(); it != session_threads.end();) {
+        lock_guard<mutex> lock(dispatch_mutex);
+        for (auto it = session_map.begin(); it != session_map.end();) {
             if (it->second->is_done) {
-                it->second->session_thread.join();
-                it = session_threads.erase(it);
+                admission.release(it->second->buffered_bytes);
+                it = session_map.erase(it);
             } else {
                 ++it;
             }
@@ -255,7 +765,11 @@ int main(int argc, char* argv[]) {
     }
 
     cout << "Shutting down server..." << endl;
-    for(auto& [id, s] : session_threads) {
+    quitFlag = true;
+    for (thread& receiver : receivers) {
+        receiver.join();
+    }
+    for(auto& [id, s] : session_map) {
         if (s && !s->is_done) {
             char buffer[sizeof(UAP_header)];
             {
@@ -268,12 +782,29 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    for(auto& [id, s] : session_threads) {
-        if (s && s->session_thread.joinable()) {
-            s->session_thread.join();
-        }
+    for (auto& w : workers) {
+        w->wakeup.notify_one();
+        w->worker_thread.join();
     }
 
-    close(server_socket);
+    admission.print_stats(cout);
+    uint64_t scheduler_drops = 0;
+    for (auto& w : workers) {
+        scheduler_drops += w->scheduler.dropped;
+    }
+    if (scheduler_drops > 0) {
+        cout << "Scheduler: " << scheduler_drops << " messages dropped on full session queues" << endl;
+    }
+    if (capture.is_open()) {
+        capture.close();
+        cout << "Captured " << capture.records << " datagrams (" << capture.dropped_bytes << " bytes dropped)" << endl;
+    }
+    if (shm_ring.is_open()) {
+        cout << "Shared memory ring: " << shm_ring.records << " records published" << endl;
+        shm_ring.close();
+    }
+    for (int sock : server_sockets) {
+        close(sock);
+    }
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,494 @@
+#include "uap_client.h"
+#include "pack.h"
+#include "unpack.h"
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+using namespace std;
+using namespace std::chrono;
+
+static int64_t get_current_time() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+static int64_t steady_ms() {
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// ---- UapOperation ----
+
+bool UapOperation::await_ready() {
+    if (kind == SLEEP) {
+        result = true;
+        return wake_ms <= steady_ms();
+    }
+    return session->start(this);
+}
+
+void UapOperation::await_suspend(coroutine_handle<> h) {
+    waiter = h;
+    if (kind == SLEEP) {
+        loop->add_timer(this);
+    }
+}
+
+// ---- UapSession ----
+
+// Runs from await_ready, before `op` has a waiter: an operation that completes
+// here returns true with its result set instead of being woken.
+bool UapSession::start(UapOperation* op) {
+    int64_t now = steady_ms();
+    switch (op->kind) {
+        case UapOperation::CONNECT:
+            if (current_state != IDLE) {
+                op->result = false;
+                return true;
+            }
+            transmit(UAP_COMMAND_HELLO, sequence++, hello_options);
+            current_state = HELLO_WAIT;
+            state_since_ms = last_hello_ms = last_progress_ms = now;
+            connect_op = op;
+            return false;
+
+        case UapOperation::SEND:
+            if (current_state != READY || closing_after_flush) {
+                op->result = false;
+                return true;
+            }
+            if (retransmit_buffer.full() || !send_ops.empty() || !may_send(op)) {
+                send_ops.push_back(op);
+                if (!retransmit_buffer.full()) {
+                    queue_for_pacing();
+                }
+                return false;
+            }
+            transmit(UAP_COMMAND_DATA, sequence++, op->payload);
+            op->result = true;
+            return true;
+
+        case UapOperation::FLUSH:
+            if (current_state != READY) {
+                op->result = false;
+                return true;
+            }
+            if (retransmit_buffer.empty() && send_ops.empty()) {
+                op->result = true;
+                return true;
+            }
+            flush_op = op;
+            return false;
+
+        case UapOperation::CLOSE:
+            if (current_state == IDLE || current_state == CLOSED) {
+                current_state = CLOSED;
+                op->result = true;
+                return true;
+            }
+            if (current_state == HELLO_WAIT) {
+                // Completes here: `op` isn't suspended yet, so fail() mustn't wake it
+                fail();
+                op->result = false;
+                return true;
+            }
+            close_op = op;
+            closing_after_flush = true;
+            wake_senders(); // says GOODBYE right away if nothing is outstanding
+            return false;
+
+        default:
+            op->result = false;
+            return true;
+    }
+}
+
+void UapSession::transmit(uint8_t command, int32_t seq, const string& payload) {
+    char buffer[sizeof(UAP_header) + payload.size()];
+    logical_clock++;
+    pack(buffer, payload, command, seq, session_id, logical_clock, get_current_time());
+    if (command == UAP_COMMAND_DATA) {
+        retransmit_buffer.store(seq, buffer, sizeof(buffer)); // before sending, so the RTT clock starts first
+        payload_bytes += payload.size();
+        loop->pacer.on_sent(sizeof(buffer));
+    }
+    loop->send_packet(buffer, sizeof(buffer));
+}
+
+void UapSession::resend(int32_t seq) {
+    RetransmitBuffer::Entry* entry = retransmit_buffer.take_for_resend(seq, get_current_time());
+    if (entry != nullptr) {
+        loop->send_packet(entry->packet.data(), entry->packet.size());
+        loop->pacer.on_sent(entry->packet.size());
+    }
+}
+
+// Paced sessions wait their turn behind the others before asking the pacer.
+bool UapSession::may_send(const UapOperation* op) {
+    if (!loop->pacer.is_enabled()) {
+        return true;
+    }
+    return loop->paced.empty() && loop->pacer.delay_ns(sizeof(UAP_header) + op->payload.size()) == 0;
+}
+
+void UapSession::queue_for_pacing() {
+    if (loop->pacer.is_enabled() && !pacing_queued) {
+        loop->paced.push_back(this);
+        pacing_queued = true;
+    }
+}
+
+void UapSession::wake(UapOperation* op, bool result) {
+    if (op != nullptr) {
+        op->result = result;
+        loop->schedule(op->waiter);
+    }
+}
+
+// Moves queued sends into the window as acks free it up, then completes
+// flush() and starts the GOODBYE exchange once nothing is outstanding.
+void UapSession::wake_senders() {
+    while (!send_ops.empty() && !retransmit_buffer.full() && may_send(send_ops.front())) {
+        UapOperation* op = send_ops.front();
+        send_ops.pop_front();
+        transmit(UAP_COMMAND_DATA, sequence++, op->payload);
+        wake(op, true);
+    }
+    if (!send_ops.empty() && !retransmit_buffer.full()) {
+        queue_for_pacing();
+    }
+    if (!retransmit_buffer.empty() || !send_ops.empty()) {
+        return;
+    }
+    if (flush_op != nullptr) {
+        wake(flush_op, true);
+        flush_op = nullptr;
+    }
+    if (closing_after_flush && current_state == READY) {
+        transmit(UAP_COMMAND_GOODBYE, sequence++, "");
+        current_state = CLOSING;
+        state_since_ms = steady_ms();
+    }
+}
+
+void UapSession::fail(bool notify_server) {
+    if (current_state == CLOSED) {
+        return;
+    }
+    if (notify_server && current_state != IDLE) {
+        transmit(UAP_COMMAND_GOODBYE, sequence++, "");
+    }
+    current_state = CLOSED;
+    wake(connect_op, false);
+    wake(flush_op, false);
+    wake(close_op, false);
+    connect_op = flush_op = close_op = nullptr;
+    for (UapOperation* op : send_ops) {
+        wake(op, false);
+    }
+    send_ops.clear();
+}
+
+void UapSession::on_packet(const UAP_header& header, const string& payload) {
+    logical_clock = max(logical_clock, header.logical_clock) + 1;
+    last_progress_ms = steady_ms();
+
+    switch (header.command) {
+        case UAP_COMMAND_HELLO:
+            if (current_state == HELLO_WAIT) {
+                current_state = READY;
+                wake(connect_op, true);
+                connect_op = nullptr;
+            }
+            break;
+
+        case UAP_COMMAND_GOODBYE:
+            if (current_state == CLOSING) {
+                current_state = CLOSED;
+                wake(close_op, true);
+                close_op = nullptr;
+            } else {
+                fail(false); // server ended the session; don't answer its GOODBYE
+            }
+            break;
+
+        case UAP_COMMAND_BUSY: {
+            uint8_t reason;
+            int32_t ack;
+            if (current_state == HELLO_WAIT) {
+                fail();
+            } else if (decode_busy(payload.data(), payload.size(), reason, ack)) {
+                loop->pacer.on_loss();
+                retransmit_buffer.ack_through(ack);
+                resend(ack + 1);
+                wake_senders();
+            }
+            break;
+        }
+
+        case UAP_COMMAND_ALIVE: {
+            int32_t ack;
+            if (decode_ack(payload.data(), payload.size(), ack)) {
+                int64_t rtt_us;
+                if (retransmit_buffer.rtt_sample(ack, rtt_us)) {
+                    // Don't count the time the server held a delayed ALIVE back
+                    rtt_us = max<int64_t>(1, rtt_us - decode_ack_delay(payload.data(), payload.size()));
+                    retransmit_buffer.on_rtt_sample(rtt_us);
+                    loop->pacer.on_rtt_sample(rtt_us);
+                }
+                retransmit_buffer.ack_through(ack);
+                wake_senders();
+            }
+            break;
+        }
+
+        case UAP_COMMAND_NACK: {
+            vector<SeqRange> ranges;
+            if (decode_nack(payload.data(), payload.size(), ranges) && !ranges.empty()) {
+                retransmit_buffer.ack_through(ranges.front().first - 1);
+                loop->pacer.on_loss();
+                for (auto const& [first, last] : ranges) {
+                    for (int32_t seq = first; seq <= last; seq++) {
+                        resend(seq);
+                    }
+                }
+                wake_senders();
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+void UapSession::on_tick(int64_t now) {
+    switch (current_state) {
+        case HELLO_WAIT:
+            if (now - state_since_ms >= UAP_CLIENT_TIMEOUT_MS) {
+                fail();
+            } else if (now - last_hello_ms >= UAP_CLIENT_HELLO_RETRY_MS) {
+                transmit(UAP_COMMAND_HELLO, 0, hello_options);
+                last_hello_ms = now;
+            }
+            break;
+
+        case READY:
+            if (retransmit_buffer.probe_due()) {
+                resend(retransmit_buffer.newest());
+                retransmit_buffer.probe_sent();
+            }
+            if (!retransmit_buffer.empty() && now - last_progress_ms >= UAP_CLIENT_TIMEOUT_MS) {
+                fail();
+            }
+            break;
+
+        case CLOSING:
+            if (now - state_since_ms >= UAP_CLIENT_TIMEOUT_MS) {
+                // GOODBYE response timed out; everything was acknowledged before it
+                current_state = CLOSED;
+                wake(close_op, true);
+                close_op = nullptr;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+// ---- UapLoop ----
+
+struct UapLoop::Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+UapLoop::Detached UapLoop::run_detached(UapTask<void> task) {
+    co_await task;
+    active_tasks--;
+}
+
+UapLoop::UapLoop() {
+    epfd = epoll_create1(0);
+}
+
+UapLoop::~UapLoop() {
+    if (sockfd >= 0) close(sockfd);
+    if (epfd >= 0) close(epfd);
+}
+
+bool UapLoop::open(const char* host, int port) {
+    struct hostent* server = gethostbyname(host);
+    if (server == NULL) {
+        cerr << "ERROR, no such host" << endl;
+        return false;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    server_addr.sin_port = htons(port);
+
+    sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return false;
+    }
+    // Thousands of sessions share this socket; give bursts of replies room
+    int rcvbuf = 4 << 20;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+    return true;
+}
+
+UapSession& UapLoop::create_session() {
+    static mt19937 gen(random_device{}());
+    uniform_int_distribution<int32_t> distrib;
+    int32_t id;
+    do {
+        id = distrib(gen);
+    } while (sessions.count(id));
+    UapSession* session = new UapSession(this, id);
+    sessions[id].reset(session);
+    return *session;
+}
+
+void UapLoop::release(UapSession& session) {
+    if (session.pacing_queued) {
+        paced.erase(find(paced.begin(), paced.end(), &session));
+    }
+    sessions.erase(session.id());
+}
+
+void UapLoop::spawn(UapTask<void> task) {
+    active_tasks++;
+    run_detached(std::move(task));
+}
+
+UapOperation UapLoop::sleep(int ms) {
+    return UapOperation(this, steady_ms() + ms);
+}
+
+void UapLoop::send_packet(const char* data, size_t len) {
+    sendto(sockfd, data, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+}
+
+void UapLoop::receive() {
+    char buffer[2048];
+    while (true) {
+        int n = recvfrom(sockfd, buffer, sizeof(buffer), 0, NULL, NULL);
+        if (n < 0) {
+            return; // EAGAIN: drained
+        }
+        UAP_header header;
+        string payload;
+        if (!unPack(buffer, n, header, payload)) {
+            continue;
+        }
+        auto it = sessions.find(header.session_id);
+        if (it != sessions.end()) {
+            it->second->on_packet(header, payload);
+        }
+    }
+}
+
+void UapLoop::tick() {
+    int64_t now = steady_ms();
+    for (auto& [id, session] : sessions) {
+        session->on_tick(now);
+    }
+}
+
+// Hands the pacer's tokens to the waiting sessions in turn, one packet each, so
+// none is starved however low the rate gets. A session whose window fills up
+// leaves the queue until acks make room. Returns how long until the pacer has
+// tokens for the next one, -1 if nobody is waiting.
+int64_t UapLoop::pace() {
+    while (!paced.empty()) {
+        UapSession* session = paced.front();
+        if (session->send_ops.empty() || session->retransmit_buffer.full()) {
+            paced.pop_front();
+            session->pacing_queued = false;
+            continue;
+        }
+        UapOperation* op = session->send_ops.front();
+        int64_t delay = pacer.delay_ns(sizeof(UAP_header) + op->payload.size());
+        if (delay > 0) {
+            return delay;
+        }
+        paced.pop_front();
+        session->send_ops.pop_front();
+        session->transmit(UAP_COMMAND_DATA, session->sequence++, op->payload);
+        session->wake(op, true);
+        if (session->send_ops.empty()) {
+            session->pacing_queued = false;
+        } else {
+            paced.push_back(session);
+        }
+    }
+    return -1;
+}
+
+void UapLoop::run() {
+    struct epoll_event events[8];
+    while (active_tasks > 0) {
+        while (!ready.empty()) {
+            coroutine_handle<> h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        if (active_tasks == 0) {
+            break;
+        }
+
+        int64_t now = steady_ms();
+        if (now >= next_tick_ms) {
+            tick();
+            next_tick_ms = now + UAP_CLIENT_TICK_MS;
+        }
+        while (!timers.empty() && timers.top().first <= now) {
+            schedule(timers.top().second->waiter);
+            timers.pop();
+        }
+        if (!ready.empty()) {
+            continue;
+        }
+
+        int64_t timeout = next_tick_ms - now;
+        if (!timers.empty()) {
+            timeout = min(timeout, timers.top().first - now);
+        }
+        if (pacer.is_enabled()) {
+            int64_t wait_ns = pace();
+            if (!ready.empty()) {
+                continue;
+            }
+            if (wait_ns >= 0) {
+                timeout = min(timeout, (wait_ns + 999999) / 1000000);
+            }
+        }
+        int n = epoll_wait(epfd, events, 8, (int)max<int64_t>(timeout, 0));
+        if (n > 0) {
+            receive();
+        }
+    }
+}
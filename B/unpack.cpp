@@ -28,5 +28,15 @@ bool unPack(const char* buffer, int n, UAP_header& header, std::string& payload)
         payload.clear();
     }
 
+    return true;
+}
+
+bool unPack(const char* buffer, int n, UAP_header& header, std::string& payload, CompactBase& base) {
+    size_t header_len;
+    if (n < 0 || !decode_header(buffer, n, header, header_len, base)) {
+        return false;
+    }
+
+    payload.assign(buffer + header_len, n - header_len);
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/UAP_header.h"
+#include "../include/udp_offload.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Loopback throughput of the bulk DATA path with and without UDP GSO/GRO.
+// A sender streams equal-sized UAP DATA packets at a receiver for a fixed time;
+// the receiver splits every read into datagrams and checks each header, as the
+// servers do. Reported rates are what the receiver got, not what was offered.
+
+struct Result {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t reads = 0;
+    uint64_t sends = 0;
+};
+
+void fill_batch(vector<char>& batch, size_t segment, int count, int32_t& seq) {
+    batch.assign(segment * count, 'x');
+    for (int i = 0; i < count; i++) {
+        UAP_header header;
+        header.magic = htons(UAP_MAGIC);
+        header.version = UAP_VERSION;
+        header.command = UAP_COMMAND_DATA;
+        header.sequence_number = htonl(seq++);
+        header.session_id = htonl(1);
+        header.logical_clock = 0;
+        header.timestamp = 0;
+        memcpy(&batch[i * segment], &header, sizeof(header));
+    }
+}
+
+Result run(bool offload, size_t segment, double seconds_to_run) {
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 8 << 20;
+    setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval tv = {0, 100000};
+    setsockopt(rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(rx, (struct sockaddr*)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(rx, (struct sockaddr*)&addr, &len);
+
+    bool use_gso = offload;
+    if (offload) {
+        enable_gro(rx);
+    }
+
+    atomic<bool> stop{false};
+    Result result;
+    thread receiver([&] {
+        static char buffer[GRO_BUFFER_SIZE];
+        while (!stop) {
+            size_t segment_size;
+            ssize_t n = recv_coalesced(rx, buffer, sizeof(buffer), nullptr, segment_size);
+            if (n <= 0) {
+                continue;
+            }
+            result.reads++;
+            for_each_segment(buffer, n, segment_size, [&](const char* datagram, size_t dlen) {
+                const UAP_header* header = (const UAP_header*)datagram;
+                if (dlen >= sizeof(UAP_header) && ntohs(header->magic) == UAP_MAGIC) {
+                    result.packets++;
+                    result.bytes += dlen;
+                }
+            });
+        }
+    });
+
+    int per_send = min<int>(UDP_OFFLOAD_MAX_SEGMENTS, UDP_OFFLOAD_MAX_BYTES / segment);
+    vector<char> batch;
+    int32_t seq = 1;
+    auto end = steady_clock::now() + duration<double>(seconds_to_run);
+    while (steady_clock::now() < end) {
+        fill_batch(batch, segment, per_send, seq);
+        if (use_gso) {
+            send_segments(tx, addr, batch.data(), batch.size(), segment, use_gso);
+            result.sends++;
+        } else {
+            for (int i = 0; i < per_send; i++) {
+                sendto(tx, &batch[i * segment], segment, 0, (struct sockaddr*)&addr, sizeof(addr));
+                result.sends++;
+            }
+        }
+    }
+    this_thread::sleep_for(milliseconds(200)); // let the receiver drain
+    stop = true;
+    receiver.join();
+    close(rx);
+    close(tx);
+    return result;
+}
+
+void report(const string& name, const Result& r, double seconds_to_run) {
+    cout << left << setw(16) << name << right << fixed << setprecision(1)
+         << setw(10) << r.bytes / seconds_to_run / 1e6 << " MB/s  "
+         << setw(10) << (uint64_t)(r.packets / seconds_to_run) << " pkt/s  "
+         << setw(10) << r.sends << " send calls  "
+         << setw(10) << r.reads << " reads" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds_to_run = argc > 1 ? atof(argv[1]) : 2.0;
+    size_t segment = argc > 2 ? atoi(argv[2]) : 1024;
+    if (segment < sizeof(UAP_header) || segment > 1472) {
+        cerr << "Usage: " << argv[0] << " [seconds] [packet size, " << sizeof(UAP_header) << "..1472]" << endl;
+        return 1;
+    }
+
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    bool gso = gso_supported(probe);
+    bool gro = enable_gro(probe);
+    close(probe);
+    cout << "Packet size " << segment << " bytes, " << seconds_to_run << " s per run; GSO "
+         << (gso ? "supported" : "unsupported") << ", GRO " << (gro ? "supported" : "unsupported") << endl;
+
+    Result plain = run(false, segment, seconds_to_run);
+    report("sendto/recvfrom", plain, seconds_to_run);
+    if (!gso) {
+        cout << "Kernel lacks UDP_SEGMENT, skipping the offload run" << endl;
+        return 0;
+    }
+    Result offload = run(true, segment, seconds_to_run);
+    report("GSO/GRO", offload, seconds_to_run);
+    if (plain.bytes > 0) {
+        cout << "Speedup: " << setprecision(2) << (double)offload.bytes / plain.bytes << "x" << endl;
+    }
+    return 0;
+}
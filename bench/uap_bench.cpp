@@ -0,0 +1,579 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/UAP_header.h"
+#include "../include/pack.h"
+#include "../include/unpack.h"
+#include "../include/reliability.h"
+#include "../include/rate_control.h"
+#include "../include/latency_histogram.h"
+#include "../include/thread_safe_queue.h"
+#include "../include/compact_header.h"
+#include "../include/hello_opts.h"
+#include "../include/drr_scheduler.h"
+
+using namespace std;
+
+// Microbenchmarks of the protocol hot paths. Every result is printed as one
+// JSON object per line so runs can be stored and compared commit to commit:
+//
+//   {"bench":"pack","payload":32,"iterations":4194304,"ns_per_op":9.81,"ops_per_sec":101936799}
+//
+// The round-trip benchmark talks HELLO -> DATA -> ALIVE over loopback, either to
+// a small in-process responder (default) or to a running server (--port), with
+// v1 or, after negotiating it in the HELLO, v2 headers (--version). With --load
+// N that many bulk sessions flood the server with DATA at the same time, which
+// shows how well the server keeps the interactive session's latency bounded;
+// --priority sets the interactive session's scheduling weight.
+
+const int BENCH_DEFAULT_MIN_TIME_MS = 200;      // each timed run lasts at least this long
+const int BENCH_DEFAULT_ROUNDTRIPS = 10000;
+const int BENCH_REPLY_TIMEOUT_MS = 1000;
+const int BENCH_SWAP_BATCH = 1024;              // values byte-swapped per call
+const size_t BENCH_LOAD_PAYLOAD = 900;          // DATA payload of the --load sessions
+const size_t BENCH_SCHED_BACKLOG = 1024;        // packets each simulated bulk session keeps queued
+const int BENCH_SCHED_SERVICES = 200000;        // packets served per scheduler_wait run
+const int BENCH_SCHED_INTERACTIVE_EVERY = 50;   // one interactive packet per this many served
+
+int min_time_ms = BENCH_DEFAULT_MIN_TIME_MS;
+string filter;
+
+// Round-trip client's header state
+uint8_t wire_version = UAP_VERSION;
+CompactBase client_base;
+CompactBase server_base;
+
+// Keeps the compiler from optimising away a result.
+template<typename T>
+inline void keep(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+bool selected(const string& name) {
+    return filter.empty() || name.find(filter) != string::npos;
+}
+
+// Runs `op` (which performs `ops_per_call` operations) often enough to last at
+// least min_time_ms and prints the per-operation cost. `params` is extra JSON,
+// e.g. "\"payload\":32,".
+template<typename F>
+void measure(const string& name, const string& params, uint64_t ops_per_call, F op) {
+    if (!selected(name)) {
+        return;
+    }
+    uint64_t calls = 1;
+    int64_t elapsed_ns = 0;
+    int64_t min_ns = (int64_t)min_time_ms * 1000000;
+    while (true) {
+        int64_t start = monotonic_ns();
+        for (uint64_t i = 0; i < calls; i++) {
+            op();
+        }
+        elapsed_ns = monotonic_ns() - start;
+        if (elapsed_ns >= min_ns) {
+            break;
+        }
+        // Aim a little past the target so the final run is usually the last
+        uint64_t scale = elapsed_ns > 0 ? min(100.0, 1.2 * min_ns / elapsed_ns) : 100;
+        calls *= max<uint64_t>(2, scale);
+    }
+    uint64_t ops = calls * ops_per_call;
+    double ns_per_op = (double)elapsed_ns / ops;
+    cout << "{\"bench\":\"" << name << "\"," << params << "\"iterations\":" << ops
+         << ",\"ns_per_op\":" << fixed << setprecision(2) << ns_per_op
+         << ",\"ops_per_sec\":" << setprecision(0) << 1e9 / ns_per_op << "}" << endl;
+}
+
+void bench_pack_unpack() {
+    for (size_t payload_len : {32, 1024}) {
+        string payload(payload_len, 'x');
+        string params = "\"payload\":" + to_string(payload_len) + ",\"version\":1,";
+        char buffer[2048];
+        int32_t seq = 0;
+        measure("pack", params, 1, [&] {
+            pack(buffer, payload, UAP_COMMAND_DATA, seq, 0x1234, seq, 1700000000000000LL);
+            keep(buffer);
+            seq++;
+        });
+
+        pack(buffer, payload, UAP_COMMAND_DATA, 1, 0x1234, 1, 1700000000000000LL);
+        int n = sizeof(UAP_header) + payload_len;
+        UAP_header header;
+        string out;
+        measure("unpack", params, 1, [&] {
+            bool ok = unPack(buffer, n, header, out);
+            keep(ok);
+            keep(header);
+        });
+    }
+}
+
+// v2 headers: size on the wire for a DATA packet `offset` packets (and
+// milliseconds) after the HELLO, and pack / unPack cost next to v1's.
+void bench_compact_header() {
+    const int64_t hello_time = 1700000000000000LL;
+    if (selected("header_size")) {
+        for (int32_t offset : {1, 100, 10000, 1000000}) {
+            CompactBase base;
+            base.reset(0, 0, hello_time);
+            char out[UAP_COMPACT_MAX_HEADER];
+            size_t with_timestamp = encode_compact_header(out, UAP_COMMAND_DATA, offset, 0x1234, offset, hello_time + offset * 1000LL, base);
+            size_t without_timestamp = encode_compact_header(out, UAP_COMMAND_ALIVE, offset, 0x1234, offset, 0, base);
+            cout << "{\"bench\":\"header_size\",\"seq_offset\":" << offset << ",\"v1_bytes\":" << sizeof(UAP_header)
+                 << ",\"v2_bytes\":" << with_timestamp << ",\"v2_no_timestamp_bytes\":" << without_timestamp << "}" << endl;
+        }
+    }
+
+    for (size_t payload_len : {32, 1024}) {
+        string payload(payload_len, 'x');
+        string params = "\"payload\":" + to_string(payload_len) + ",\"version\":2,";
+        char buffer[2048];
+        CompactBase tx_base;
+        tx_base.reset(0, 0, hello_time);
+        int32_t seq = 1;
+        measure("pack", params, 1, [&] {
+            size_t len = pack_compact(buffer, payload, UAP_COMMAND_DATA, seq, 0x1234, seq, hello_time + seq, tx_base);
+            keep(len);
+            keep(buffer);
+            seq++;
+        });
+
+        int n = pack_compact(buffer, payload, UAP_COMMAND_DATA, 100, 0x1234, 100, hello_time + 100000, tx_base);
+        CompactBase rx_base = tx_base;
+        UAP_header header;
+        string out;
+        measure("unpack", params, 1, [&] {
+            bool ok = unPack(buffer, n, header, out, rx_base);
+            keep(ok);
+            keep(header);
+        });
+    }
+}
+
+void bench_byte_swap() {
+    vector<uint64_t> values(BENCH_SWAP_BATCH);
+    mt19937_64 rng(1);
+    for (auto& v : values) {
+        v = rng();
+    }
+    measure("htonll", "", BENCH_SWAP_BATCH, [&] {
+        for (auto& v : values) {
+            v = htonll(v);
+        }
+        keep(values.data());
+    });
+    measure("ntohll", "", BENCH_SWAP_BATCH, [&] {
+        for (auto& v : values) {
+            v = ntohll(v);
+        }
+        keep(values.data());
+    });
+}
+
+// Session lookup by session id, as both servers do for every datagram. The
+// servers use std::map; unordered_map is measured alongside for comparison.
+void bench_session_lookup() {
+    for (size_t sessions : {16, 1024, 65536}) {
+        mt19937 rng(sessions);
+        vector<uint32_t> ids(sessions);
+        map<uint32_t, uint64_t> ordered;
+        unordered_map<uint32_t, uint64_t> hashed;
+        for (auto& id : ids) {
+            id = rng();
+            ordered[id] = id;
+            hashed[id] = id;
+        }
+        vector<uint32_t> probes(4096);
+        for (auto& p : probes) {
+            p = ids[rng() % sessions];
+        }
+        string params = "\"sessions\":" + to_string(sessions) + ",";
+        size_t i = 0;
+        measure("session_lookup_map", params, 1, [&] {
+            auto it = ordered.find(probes[i++ & (probes.size() - 1)]);
+            keep(it->second);
+        });
+        i = 0;
+        measure("session_lookup_unordered_map", params, 1, [&] {
+            auto it = hashed.find(probes[i++ & (probes.size() - 1)]);
+            keep(it->second);
+        });
+    }
+}
+
+void bench_queue() {
+    ThreadSafeQueue<string> queue;
+    string line(64, 'x');
+    string out;
+    measure("queue_push_pop", "\"payload\":64,", 1, [&] {
+        queue.push(line);
+        queue.try_pop(out);
+        keep(out);
+    });
+
+    // Producer and consumer on different threads, as in the A client.
+    if (!selected("queue_handoff")) {
+        return;
+    }
+    const uint64_t batch = 1 << 14;
+    measure("queue_handoff", "\"payload\":64,", batch, [&] {
+        thread producer([&] {
+            for (uint64_t i = 0; i < batch; i++) {
+                queue.push(line);
+            }
+        });
+        for (uint64_t received = 0; received < batch;) {
+            if (queue.try_pop(out)) {
+                received++;
+            } else {
+                this_thread::yield();
+            }
+        }
+        producer.join();
+    });
+}
+
+// How long an interactive session's packets wait behind bulk sessions that
+// always have BENCH_SCHED_BACKLOG packets queued, with arrival-order (FIFO)
+// handling as the servers used to do and with the DRR scheduler. Measured in
+// bytes handled between a packet's arrival and its turn, so the result doesn't
+// depend on the machine: divide by the server's byte rate for a time.
+void bench_scheduler() {
+    DrrScheduler<int, int> scheduler;
+    for (int session = 0; session < 16; session++) {
+        scheduler.set_weight(session, SESSION_PRIORITY_DEFAULT);
+    }
+    int i = 0;
+    measure("drr_push_pop", "\"sessions\":16,", 1, [&] {
+        int key = 0, item = 0;
+        scheduler.push(i & 15, i, BENCH_LOAD_PAYLOAD);
+        i++;
+        scheduler.pop(key, item);
+        keep(item);
+    });
+    if (!selected("scheduler_wait")) {
+        return;
+    }
+    const size_t interactive_payload = 64;
+    for (int bulk_sessions : {1, 4, 16}) {
+        for (string policy : {"fifo", "drr"}) {
+            // item: bytes served when it arrived, or -1 for a bulk packet
+            deque<pair<int, int64_t>> fifo;
+            DrrScheduler<int, int64_t> drr;
+            auto push = [&](int session, int64_t item, size_t cost) {
+                if (policy == "fifo") {
+                    fifo.emplace_back(session, item);
+                } else {
+                    drr.push(session, item, cost);
+                }
+            };
+            for (size_t i = 0; i < BENCH_SCHED_BACKLOG; i++) {
+                for (int session = 1; session <= bulk_sessions; session++) {
+                    push(session, -1, BENCH_LOAD_PAYLOAD);
+                }
+            }
+            LatencyHistogram wait;
+            int64_t served = 0;
+            for (int n = 0; n < BENCH_SCHED_SERVICES; n++) {
+                if (n % BENCH_SCHED_INTERACTIVE_EVERY == 0) {
+                    push(0, served, interactive_payload);
+                }
+                int session = 0;
+                int64_t arrived = 0;
+                if (policy == "fifo") {
+                    tie(session, arrived) = fifo.front();
+                    fifo.pop_front();
+                } else {
+                    drr.pop(session, arrived);
+                }
+                if (session == 0) {
+                    wait.record(served - arrived);
+                    served += interactive_payload;
+                } else {
+                    served += BENCH_LOAD_PAYLOAD;
+                    push(session, -1, BENCH_LOAD_PAYLOAD); // keep the bulk session backlogged
+                }
+            }
+            cout << "{\"bench\":\"scheduler_wait\",\"policy\":\"" << policy << "\",\"bulk_sessions\":" << bulk_sessions
+                 << ",\"backlog\":" << BENCH_SCHED_BACKLOG << ",\"samples\":" << wait.count()
+                 << ",\"p50_bytes\":" << wait.percentile(50) << ",\"p99_bytes\":" << wait.percentile(99)
+                 << ",\"max_bytes\":" << wait.max() << "}" << endl;
+        }
+    }
+}
+
+// Minimal stand-in for a server: answers HELLO with HELLO and every DATA with
+// an ALIVE carrying the cumulative ack, using the same pack / unPack calls.
+void responder(int sockfd, atomic<bool>& stop) {
+    char buffer[2048];
+    char reply[UAP_MAX_HEADER + 16];
+    uint8_t version = UAP_VERSION; // negotiated by the (single) session's HELLO
+    CompactBase peer_base, own_base;
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    while (!stop) {
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &from_len);
+        UAP_header header;
+        string payload;
+        if (n <= 0 || !unPack(buffer, n, header, payload, peer_base)) {
+            continue;
+        }
+        string body;
+        uint8_t command = header.command;
+        if (header.command == UAP_COMMAND_DATA) {
+            command = UAP_COMMAND_ALIVE;
+            body = encode_ack(header.sequence_number);
+        } else if (header.command == UAP_COMMAND_HELLO) {
+            HelloOptions requested, accepted;
+            uint16_t requested_version;
+            requested.decode(payload.data(), payload.size());
+            version = requested.get_u16(HELLO_OPT_VERSION, requested_version) && requested_version >= UAP_VERSION_COMPACT
+                    ? UAP_VERSION_COMPACT : UAP_VERSION;
+            if (version == UAP_VERSION_COMPACT) {
+                accepted.set_u16(HELLO_OPT_VERSION, UAP_VERSION_COMPACT);
+            }
+            body = accepted.encode();
+            peer_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+            own_base.reset(0, header.logical_clock + 1, header.timestamp);
+        } else if (header.command != UAP_COMMAND_GOODBYE) {
+            continue;
+        }
+        size_t len;
+        if (version == UAP_VERSION_COMPACT && command != UAP_COMMAND_HELLO) {
+            len = pack_compact(reply, body, command, 0, header.session_id, header.logical_clock + 1, 0, own_base);
+        } else {
+            pack(reply, body, command, 0, header.session_id, header.logical_clock + 1, header.timestamp);
+            len = sizeof(UAP_header) + body.size();
+        }
+        sendto(sockfd, reply, len, 0, (struct sockaddr*)&from, from_len);
+    }
+}
+
+// Sends one packet and waits for the reply with `expected` command, whose
+// payload is left in `reply`. Returns the round trip in nanoseconds, or -1 on
+// timeout.
+int64_t exchange(int sockfd, const struct sockaddr_in& server, uint8_t command, int32_t seq, uint32_t session_id,
+                 const string& payload, uint8_t expected, string& reply) {
+    char packet[2048];
+    char buffer[2048];
+    int64_t start = monotonic_ns();
+    size_t len;
+    if (wire_version == UAP_VERSION_COMPACT) {
+        len = pack_compact(packet, payload, command, seq, session_id, seq, start / 1000, client_base);
+    } else {
+        pack(packet, payload, command, seq, session_id, seq, start / 1000);
+        len = sizeof(UAP_header) + payload.size();
+        if (command == UAP_COMMAND_HELLO) {
+            client_base.reset(seq, seq, start / 1000);
+        }
+    }
+    sendto(sockfd, packet, len, 0, (struct sockaddr*)&server, sizeof(server));
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    while (true) {
+        int left_ms = BENCH_REPLY_TIMEOUT_MS - (monotonic_ns() - start) / 1000000;
+        if (left_ms <= 0 || poll(&pfd, 1, left_ms) <= 0) {
+            return -1;
+        }
+        int n = recv(sockfd, buffer, sizeof(buffer), 0);
+        UAP_header header;
+        if (n > 0 && unPack(buffer, n, header, reply, server_base) && header.command == expected) {
+            if (command == UAP_COMMAND_HELLO) {
+                server_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+            }
+            return monotonic_ns() - start;
+        }
+    }
+}
+
+// One --load session: HELLO, then DATA as fast as the socket takes it until
+// `stop`. Replies are read and thrown away; nothing is retransmitted.
+void bulk_load(const struct sockaddr_in& server, atomic<bool>& stop, atomic<uint64_t>& sent) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    uint32_t session_id = random_device()();
+    char packet[sizeof(UAP_header) + BENCH_LOAD_PAYLOAD];
+    char buffer[2048];
+    pack(packet, "", UAP_COMMAND_HELLO, 0, session_id, 0, monotonic_ns() / 1000);
+    sendto(sockfd, packet, sizeof(UAP_header), 0, (struct sockaddr*)&server, sizeof(server));
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    if (poll(&pfd, 1, BENCH_REPLY_TIMEOUT_MS) <= 0) {
+        close(sockfd);
+        return;
+    }
+    string payload(BENCH_LOAD_PAYLOAD, 'b');
+    int32_t seq = 1;
+    while (!stop) {
+        pack(packet, payload, UAP_COMMAND_DATA, seq, session_id, seq, monotonic_ns() / 1000);
+        seq++;
+        if (sendto(sockfd, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr*)&server, sizeof(server)) < 0) {
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, 1);
+            pfd.events = POLLIN;
+            seq--;
+            continue;
+        }
+        sent++;
+        while (recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+        }
+    }
+    pack(packet, "", UAP_COMMAND_GOODBYE, seq, session_id, seq, monotonic_ns() / 1000);
+    sendto(sockfd, packet, sizeof(UAP_header), 0, (struct sockaddr*)&server, sizeof(server));
+    close(sockfd);
+}
+
+void bench_roundtrip(const string& host, int port, int roundtrips, int version, int load, int priority) {
+    if (!selected("roundtrip")) {
+        return;
+    }
+    atomic<bool> stop{false};
+    thread local_server;
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    if (port == 0) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(fd, (struct sockaddr*)&server, sizeof(server));
+        socklen_t len = sizeof(server);
+        getsockname(fd, (struct sockaddr*)&server, &len);
+        local_server = thread([fd, &stop] {
+            responder(fd, stop);
+            close(fd);
+        });
+    } else {
+        struct hostent* he = gethostbyname(host.c_str());
+        if (he == NULL) {
+            cerr << "ERROR, no such host" << endl;
+            return;
+        }
+        memcpy(&server.sin_addr.s_addr, he->h_addr, he->h_length);
+        server.sin_port = htons(port);
+    }
+
+    atomic<bool> stop_load{false};
+    atomic<uint64_t> load_sent{0};
+    vector<thread> loaders;
+    for (int i = 0; i < load; i++) {
+        loaders.emplace_back(bulk_load, server, ref(stop_load), ref(load_sent));
+    }
+    if (load > 0) {
+        this_thread::sleep_for(chrono::milliseconds(200)); // let the backlog build up
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    uint32_t session_id = random_device()();
+    LatencyHistogram rtt;
+    int lost = 0;
+    HelloOptions offered, accepted;
+    if (version >= UAP_VERSION_COMPACT) {
+        offered.set_u16(HELLO_OPT_VERSION, UAP_VERSION_COMPACT);
+    }
+    if (priority > 0) {
+        offered.set_u16(HELLO_OPT_PRIORITY, priority);
+    }
+    string reply;
+    uint16_t accepted_version;
+    int64_t start = monotonic_ns();
+    if (exchange(sockfd, server, UAP_COMMAND_HELLO, 0, session_id, offered.encode(), UAP_COMMAND_HELLO, reply) < 0) {
+        cerr << "No HELLO reply from the server" << endl;
+    } else {
+        accepted.decode(reply.data(), reply.size());
+        if (accepted.get_u16(HELLO_OPT_VERSION, accepted_version) && accepted_version == UAP_VERSION_COMPACT) {
+            wire_version = UAP_VERSION_COMPACT;
+        }
+        string payload(32, 'x');
+        for (int seq = 1; seq <= roundtrips; seq++) {
+            int64_t ns = exchange(sockfd, server, UAP_COMMAND_DATA, seq, session_id, payload, UAP_COMMAND_ALIVE, reply);
+            if (ns < 0) {
+                lost++;
+            } else {
+                rtt.record(ns / 1000);
+            }
+        }
+        exchange(sockfd, server, UAP_COMMAND_GOODBYE, roundtrips + 1, session_id, "", UAP_COMMAND_GOODBYE, reply);
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    close(sockfd);
+    stop_load = true;
+    for (thread& loader : loaders) {
+        loader.join();
+    }
+    stop = true;
+    if (local_server.joinable()) {
+        local_server.join();
+    }
+
+    cout << "{\"bench\":\"roundtrip\",\"target\":\"" << (port == 0 ? "in-process" : host + ":" + to_string(port))
+         << "\",\"payload\":32,\"version\":" << (int)wire_version << ",\"load\":" << load
+         << ",\"load_mb_per_sec\":" << fixed << setprecision(2) << (seconds > 0 ? load_sent * BENCH_LOAD_PAYLOAD / seconds / 1e6 : 0)
+         << ",\"samples\":" << rtt.count() << ",\"lost\":" << lost
+         << ",\"min_us\":" << rtt.min() << ",\"p50_us\":" << rtt.percentile(50) << ",\"p90_us\":" << rtt.percentile(90)
+         << ",\"p99_us\":" << rtt.percentile(99) << ",\"p999_us\":" << rtt.percentile(99.9) << ",\"max_us\":" << rtt.max()
+         << ",\"mean_us\":" << fixed << setprecision(2) << rtt.mean()
+         << ",\"ops_per_sec\":" << setprecision(0) << (seconds > 0 ? rtt.count() / seconds : 0) << "}" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc % 2 != 1) {
+        cerr << "Usage: " << argv[0] << " [--filter name] [--min-time ms] [--roundtrips N] [--host hostname] [--port portnum] [--version 1|2]"
+             << " [--load sessions] [--priority 1..16]" << endl;
+        return 1;
+    }
+    string host = "127.0.0.1";
+    int port = 0; // 0: in-process responder
+    int roundtrips = BENCH_DEFAULT_ROUNDTRIPS;
+    int version = UAP_VERSION; // header version the round trip offers in its HELLO
+    int load = 0;              // bulk sessions flooding the server during the round trips
+    int priority = 0;          // 0: don't ask for one
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        if (flag == "--filter") {
+            filter = argv[i + 1];
+        } else if (flag == "--min-time") {
+            min_time_ms = atoi(argv[i + 1]);
+        } else if (flag == "--roundtrips") {
+            roundtrips = atoi(argv[i + 1]);
+        } else if (flag == "--host") {
+            host = argv[i + 1];
+        } else if (flag == "--port") {
+            port = atoi(argv[i + 1]);
+        } else if (flag == "--version") {
+            version = atoi(argv[i + 1]);
+        } else if (flag == "--load") {
+            load = atoi(argv[i + 1]);
+        } else if (flag == "--priority") {
+            priority = atoi(argv[i + 1]);
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    bench_pack_unpack();
+    bench_compact_header();
+    bench_byte_swap();
+    bench_session_lookup();
+    bench_queue();
+    bench_scheduler();
+    bench_roundtrip(host, port, roundtrips, version, load, priority);
+    return 0;
+}
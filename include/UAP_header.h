@@ -6,10 +6,21 @@ const uint8_t UAP_COMMAND_HELLO = 0;
 const uint8_t UAP_COMMAND_DATA = 1;
 const uint8_t UAP_COMMAND_ALIVE = 2;
 const uint8_t UAP_COMMAND_GOODBYE = 3;
+const uint8_t UAP_COMMAND_NACK = 4;
+const uint8_t UAP_COMMAND_BUSY = 5;
+const uint8_t UAP_COMMAND_MANIFEST = 6; // deduplicated transfers, see dedup.h
+const uint8_t UAP_COMMAND_NEED = 7;
+const uint8_t UAP_COMMAND_CHUNK = 8;
 
 const uint16_t UAP_MAGIC = 0xC461;
 const uint8_t UAP_VERSION = 1;
 
+// Commands the client numbers in sequence and the server delivers in order.
+inline bool uap_command_sequenced(uint8_t command) {
+    return command == UAP_COMMAND_DATA || command == UAP_COMMAND_GOODBYE
+        || command == UAP_COMMAND_MANIFEST || command == UAP_COMMAND_CHUNK;
+}
+
 typedef struct __attribute__((packed)){
     uint16_t magic;
     uint8_t version;
@@ -0,0 +1,124 @@
+#pragma once
+#include <stdint.h>
+#include <cstdlib>
+#include <string>
+#include <atomic>
+#include <ostream>
+#include <time.h>
+#include "reliability.h"
+
+// Server-side admission control. The dispatcher checks every datagram against
+// these limits using only the raw header and datagram length, before anything is
+// allocated for it; over-limit packets are dropped, counted, and answered with a
+// (rate-limited) BUSY so the client backs off.
+//
+// BUSY payload: 1-byte reason followed by the session's cumulative ack (as in
+// ALIVE), so the client can resend the packet the server is waiting for; that
+// packet is always admitted, which keeps a full session from deadlocking.
+
+const uint8_t UAP_BUSY_SESSIONS = 0;    // BUSY payload: too many sessions, HELLO refused
+const uint8_t UAP_BUSY_SESSION = 1;     // BUSY payload: this session's buffer is full
+const uint8_t UAP_BUSY_SERVER = 2;      // BUSY payload: server-wide buffer is full
+
+const int BUSY_MAX_PER_SECOND = 100;
+
+inline std::string encode_busy(uint8_t reason, int32_t ack) {
+    return std::string(1, (char)reason) + encode_ack(ack);
+}
+
+inline bool decode_busy(const char* payload, size_t len, uint8_t& reason, int32_t& ack) {
+    if (len < 1) {
+        return false;
+    }
+    reason = (uint8_t)payload[0];
+    return decode_ack(payload + 1, len - 1, ack);
+}
+
+struct AdmissionLimits {
+    size_t max_sessions = 1024;
+    size_t max_session_bytes = 4 << 20;     // queued + held datagram bytes per session
+    size_t max_global_bytes = 64 << 20;     // queued + held datagram bytes across all sessions
+};
+
+// Parses "--max-sessions", "--max-session-bytes" and "--max-buffered-bytes".
+// Returns false if `flag` is not an admission option.
+inline bool parse_admission_option(const std::string& flag, const char* value, AdmissionLimits& limits) {
+    if (flag == "--max-sessions") {
+        limits.max_sessions = strtoull(value, nullptr, 10);
+    } else if (flag == "--max-session-bytes") {
+        limits.max_session_bytes = strtoull(value, nullptr, 10);
+    } else if (flag == "--max-buffered-bytes") {
+        limits.max_global_bytes = strtoull(value, nullptr, 10);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+class AdmissionControl {
+private:
+    AdmissionLimits limits;
+    std::atomic<size_t> global_bytes{0};
+    std::atomic<time_t> busy_second{0};
+    std::atomic<int> busy_sent{0};
+
+public:
+    std::atomic<uint64_t> rejected_sessions{0};
+    std::atomic<uint64_t> dropped_session_limit{0};
+    std::atomic<uint64_t> dropped_global_limit{0};
+
+    void configure(const AdmissionLimits& l) { limits = l; }
+    const AdmissionLimits& get_limits() const { return limits; }
+
+    bool admit_session(size_t active_sessions) {
+        if (active_sessions >= limits.max_sessions) {
+            rejected_sessions++;
+            return false;
+        }
+        return true;
+    }
+
+    // Charges `bytes` to the session and to the global budget. On failure nothing
+    // is charged and `reason` is set to the BUSY code to report.
+    bool reserve(size_t session_bytes, size_t bytes, uint8_t& reason) {
+        if (session_bytes + bytes > limits.max_session_bytes) {
+            dropped_session_limit++;
+            reason = UAP_BUSY_SESSION;
+            return false;
+        }
+        if (global_bytes.fetch_add(bytes) + bytes > limits.max_global_bytes) {
+            global_bytes -= bytes;
+            dropped_global_limit++;
+            reason = UAP_BUSY_SERVER;
+            return false;
+        }
+        return true;
+    }
+
+    // Charges without checking; for packets that must get through, e.g. the one
+    // filling the gap that all the held packets are waiting on.
+    void charge(size_t bytes) {
+        global_bytes += bytes;
+    }
+
+    void release(size_t bytes) {
+        global_bytes -= bytes;
+    }
+
+    size_t buffered_bytes() const { return global_bytes; }
+
+    // BUSY replies are capped per second so a flood can't be amplified.
+    bool busy_allowed() {
+        time_t now = time(nullptr);
+        if (busy_second.exchange(now) != now) {
+            busy_sent = 0;
+        }
+        return busy_sent++ < BUSY_MAX_PER_SECOND;
+    }
+
+    void print_stats(std::ostream& out) const {
+        out << "Admission: " << rejected_sessions << " HELLO rejected, "
+            << dropped_session_limit << " dropped (session limit), "
+            << dropped_global_limit << " dropped (server limit)" << std::endl;
+    }
+};
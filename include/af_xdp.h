@@ -0,0 +1,453 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include "UAP_header.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// Kernel-bypass ingress for the UAP server (AF_XDP).
+//
+// A small XDP program, assembled here and loaded with the bpf() syscall (no
+// libbpf needed), redirects IPv4/UDP packets to the server port that start with
+// UAP_MAGIC into an AF_XDP socket. The server reads the frames straight out of
+// the shared UMEM area, parses Ethernet/IPv4/UDP itself, and sends its replies
+// by writing whole frames into the TX ring. Everything else, and any packet that
+// wouldn't fit a UMEM frame (e.g. a loopback GSO super-packet), is passed on to
+// the kernel stack, where the server's ordinary socket still receives it.
+//
+// The program is attached in driver mode where the NIC supports it and in
+// generic (SKB) mode otherwise, so it also runs on veth and loopback. Only one
+// RX queue is bound; on a multi-queue NIC steer the port to that queue or run
+// with a single queue. Needs CAP_NET_ADMIN + CAP_BPF and a 5.9+ kernel (BPF
+// links); if anything fails, open() returns false and the caller keeps using the
+// socket path.
+
+const uint32_t XDP_FRAME_SIZE = 2048;
+const uint32_t XDP_FRAME_COUNT = 4096;      // half for the fill ring, half for TX
+const uint32_t XDP_RING_SIZE = 2048;
+const uint32_t XDP_TX_KICK_BATCH = 32;      // frames the kernel sends per kick in copy mode
+
+// Producer/consumer ring shared with the kernel.
+template <typename T>
+struct XdpRing {
+    uint32_t* producer = nullptr;
+    uint32_t* consumer = nullptr;
+    T* descs = nullptr;
+    void* map = MAP_FAILED;
+    size_t map_size = 0;
+
+    bool mmap_ring(int fd, const struct xdp_ring_offset& off, uint64_t pgoff) {
+        map_size = off.desc + XDP_RING_SIZE * sizeof(T);
+        map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        producer = (uint32_t*)((char*)map + off.producer);
+        consumer = (uint32_t*)((char*)map + off.consumer);
+        descs = (T*)((char*)map + off.desc);
+        return true;
+    }
+    void unmap() {
+        if (map != MAP_FAILED) {
+            munmap(map, map_size);
+            map = MAP_FAILED;
+        }
+    }
+    T& at(uint32_t index) { return descs[index & (XDP_RING_SIZE - 1)]; }
+    uint32_t load_producer() const { return __atomic_load_n(producer, __ATOMIC_ACQUIRE); }
+    uint32_t load_consumer() const { return __atomic_load_n(consumer, __ATOMIC_ACQUIRE); }
+    void store_producer(uint32_t v) { __atomic_store_n(producer, v, __ATOMIC_RELEASE); }
+    void store_consumer(uint32_t v) { __atomic_store_n(consumer, v, __ATOMIC_RELEASE); }
+};
+
+inline long bpf_call(int cmd, union bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+inline struct bpf_insn bpf_op(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    struct bpf_insn insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+// The XDP program: redirect UDP datagrams for `port` whose payload starts with
+// UAP_MAGIC to the AF_XDP socket of their RX queue, pass everything else.
+inline std::vector<struct bpf_insn> uap_xdp_program(int xsk_map_fd, uint16_t port) {
+    const int16_t ETH_LEN = 14, IP_LEN = 20, UDP_LEN = 8;
+    std::vector<struct bpf_insn> prog;
+    std::vector<size_t> to_pass; // jumps to patch to the XDP_PASS exit
+    auto jump_to_pass = [&](struct bpf_insn insn) {
+        to_pass.push_back(prog.size());
+        prog.push_back(insn);
+    };
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));                // r6 = ctx
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, 0, 0));                 // r2 = data
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, 4, 0));                 // r3 = data_end
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_LEN + IP_LEN + UDP_LEN + 2));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0));                   // headers + magic present
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, XDP_FRAME_SIZE - XDP_PACKET_HEADROOM));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_3, BPF_REG_4, 0, 0));                   // fits a UMEM frame
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(0x0800)));                // IPv4
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN, 0));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0x45));                         // no IP options
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETH_LEN + 9, 0));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, IPPROTO_UDP));
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_LEN + IP_LEN + 2, 0));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(port)));                  // destination port
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETH_LEN + IP_LEN + UDP_LEN, 0));
+    jump_to_pass(bpf_op(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, htons(UAP_MAGIC)));
+    prog.push_back(bpf_op(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 16, 0));                // r2 = rx_queue_index
+    prog.push_back(bpf_op(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsk_map_fd)); // r1 = &xsk_map
+    prog.push_back(bpf_op(0, 0, 0, 0, 0));
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));                 // no socket: pass
+    prog.push_back(bpf_op(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+    prog.push_back(bpf_op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    size_t pass = prog.size();
+    prog.push_back(bpf_op(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+    prog.push_back(bpf_op(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    for (size_t at : to_pass) {
+        prog[at].off = (int16_t)(pass - at - 1);
+    }
+    return prog;
+}
+
+class XdpIngress {
+private:
+    struct Peer {
+        uint8_t mac[6];         // the peer's, and ours as it addressed us
+        uint8_t our_mac[6];
+        uint32_t our_ip;        // network byte order
+    };
+
+    int xsk = -1, map_fd = -1, prog_fd = -1, link_fd = -1;
+    char* umem = (char*)MAP_FAILED;
+    XdpRing<uint64_t> fill, completion;
+    XdpRing<struct xdp_desc> rx, tx;
+    std::vector<uint64_t> free_frames;          // TX frames not in flight
+    uint32_t tx_unsent = 0;                     // queued in the TX ring since the last kick
+    uint16_t port = 0;                          // network byte order
+    uint16_t ip_id = 0;
+    std::unordered_map<uint64_t, Peer> peers;   // (ip << 16 | port) -> addressing for replies
+
+    static uint64_t peer_key(uint32_t ip, uint16_t port) { return ((uint64_t)ip << 16) | port; }
+
+    bool fail(const char* what) {
+        std::cerr << "AF_XDP: " << what << ": " << strerror(errno) << std::endl;
+        close();
+        return false;
+    }
+
+    bool load_program(int ifindex) {
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type = BPF_MAP_TYPE_XSKMAP;
+        attr.key_size = sizeof(uint32_t);
+        attr.value_size = sizeof(uint32_t);
+        attr.max_entries = 64;
+        map_fd = bpf_call(BPF_MAP_CREATE, &attr);
+        if (map_fd < 0) {
+            return fail("creating the XSKMAP");
+        }
+
+        std::vector<struct bpf_insn> prog = uap_xdp_program(map_fd, ntohs(port));
+        static char log[16384];
+        memset(&attr, 0, sizeof(attr));
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.expected_attach_type = BPF_XDP;
+        attr.insns = (uint64_t)(uintptr_t)prog.data();
+        attr.insn_cnt = prog.size();
+        attr.license = (uint64_t)(uintptr_t)"GPL";
+        attr.log_buf = (uint64_t)(uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        prog_fd = bpf_call(BPF_PROG_LOAD, &attr);
+        if (prog_fd < 0) {
+            std::cerr << log;
+            return fail("loading the XDP program");
+        }
+
+        uint32_t queue = 0;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = map_fd;
+        attr.key = (uint64_t)(uintptr_t)&queue;
+        attr.value = (uint64_t)(uintptr_t)&xsk;
+        if (bpf_call(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+            return fail("registering the socket");
+        }
+
+        // Native mode if the driver has it, generic mode otherwise
+        for (uint32_t flags : {(uint32_t)XDP_FLAGS_DRV_MODE, (uint32_t)XDP_FLAGS_SKB_MODE}) {
+            memset(&attr, 0, sizeof(attr));
+            attr.link_create.prog_fd = prog_fd;
+            attr.link_create.target_ifindex = ifindex;
+            attr.link_create.attach_type = BPF_XDP;
+            attr.link_create.flags = flags;
+            link_fd = bpf_call(BPF_LINK_CREATE, &attr);
+            if (link_fd >= 0) {
+                generic_mode = flags == XDP_FLAGS_SKB_MODE;
+                return true;
+            }
+        }
+        return fail("attaching the XDP program");
+    }
+
+    // Returns the frames the kernel finished sending to the free list.
+    void reclaim_tx() {
+        uint32_t cons = *completion.consumer;
+        uint32_t prod = completion.load_producer();
+        for (; cons != prod; cons++) {
+            free_frames.push_back(completion.at(cons));
+        }
+        completion.store_consumer(cons);
+    }
+
+public:
+    bool generic_mode = false;
+    uint64_t received = 0, sent = 0;
+
+    ~XdpIngress() { close(); }
+
+    // Binds queue 0 of `ifname` and redirects UAP traffic for `udp_port` (host
+    // byte order) to it.
+    bool open(const std::string& ifname, uint16_t udp_port) {
+        int ifindex = if_nametoindex(ifname.c_str());
+        if (ifindex == 0) {
+            return fail("unknown interface");
+        }
+        port = htons(udp_port);
+
+        xsk = socket(AF_XDP, SOCK_RAW, 0);
+        if (xsk < 0) {
+            return fail("socket");
+        }
+        umem = (char*)mmap(nullptr, (size_t)XDP_FRAME_SIZE * XDP_FRAME_COUNT, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (umem == MAP_FAILED) {
+            return fail("allocating the UMEM");
+        }
+        struct xdp_umem_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.addr = (uint64_t)(uintptr_t)umem;
+        reg.len = (uint64_t)XDP_FRAME_SIZE * XDP_FRAME_COUNT;
+        reg.chunk_size = XDP_FRAME_SIZE;
+        uint32_t ring_size = XDP_RING_SIZE;
+        if (setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0
+            || setsockopt(xsk, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0
+            || setsockopt(xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0
+            || setsockopt(xsk, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0
+            || setsockopt(xsk, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0) {
+            return fail("setting up the rings");
+        }
+        struct xdp_mmap_offsets off;
+        socklen_t optlen = sizeof(off);
+        if (getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0
+            || !fill.mmap_ring(xsk, off.fr, XDP_UMEM_PGOFF_FILL_RING)
+            || !completion.mmap_ring(xsk, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING)
+            || !rx.mmap_ring(xsk, off.rx, XDP_PGOFF_RX_RING)
+            || !tx.mmap_ring(xsk, off.tx, XDP_PGOFF_TX_RING)) {
+            return fail("mapping the rings");
+        }
+
+        // First half of the frames receive, the second half send
+        for (uint32_t i = 0; i < XDP_FRAME_COUNT / 2; i++) {
+            fill.at(i) = (uint64_t)i * XDP_FRAME_SIZE;
+        }
+        fill.store_producer(XDP_FRAME_COUNT / 2);
+        for (uint32_t i = XDP_FRAME_COUNT / 2; i < XDP_FRAME_COUNT; i++) {
+            free_frames.push_back((uint64_t)i * XDP_FRAME_SIZE);
+        }
+
+        struct sockaddr_xdp sxdp;
+        memset(&sxdp, 0, sizeof(sxdp));
+        sxdp.sxdp_family = AF_XDP;
+        sxdp.sxdp_ifindex = ifindex;
+        sxdp.sxdp_queue_id = 0;
+        if (bind(xsk, (struct sockaddr*)&sxdp, sizeof(sxdp)) < 0) {
+            return fail("bind");
+        }
+        return load_program(ifindex);
+    }
+
+    bool is_open() const { return link_fd >= 0; }
+    int fd() const { return xsk; }
+
+    // Calls on_datagram(const char* datagram, size_t len, const sockaddr_in& from)
+    // for every UAP datagram in the RX ring and hands the frames back to the
+    // kernel. Returns the number of datagrams.
+    template <typename F>
+    size_t receive(F&& on_datagram) {
+        if (!is_open()) {
+            return 0;
+        }
+        uint32_t cons = *rx.consumer;
+        uint32_t prod = rx.load_producer();
+        uint32_t fill_prod = *fill.producer;
+        size_t count = 0;
+        for (; cons != prod; cons++) {
+            const struct xdp_desc& desc = rx.at(cons);
+            const uint8_t* frame = (const uint8_t*)umem + desc.addr;
+            uint32_t ihl = (frame[14] & 0x0F) * 4;
+            uint16_t udp_len;
+            memcpy(&udp_len, frame + 14 + ihl + 4, sizeof(udp_len));
+            udp_len = ntohs(udp_len);
+            if (desc.len >= 14 + ihl + 8 && udp_len >= 8 && 14 + ihl + udp_len <= desc.len) {
+                struct sockaddr_in from;
+                memset(&from, 0, sizeof(from));
+                from.sin_family = AF_INET;
+                memcpy(&from.sin_addr.s_addr, frame + 14 + 12, sizeof(uint32_t));
+                memcpy(&from.sin_port, frame + 14 + ihl, sizeof(uint16_t));
+
+                Peer& peer = peers[peer_key(from.sin_addr.s_addr, from.sin_port)];
+                memcpy(peer.mac, frame + 6, 6);
+                memcpy(peer.our_mac, frame, 6);
+                memcpy(&peer.our_ip, frame + 14 + 16, sizeof(uint32_t));
+
+                received++;
+                count++;
+                on_datagram((const char*)frame + 14 + ihl + 8, (size_t)udp_len - 8, from);
+            }
+            fill.at(fill_prod++) = desc.addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+        }
+        rx.store_consumer(cons);
+        fill.store_producer(fill_prod);
+        return count;
+    }
+
+    // Queues a datagram to `to` in the TX ring. Fails (and the caller should use
+    // its socket) for peers that never reached us through XDP, for loopback
+    // peers (a frame injected on lo without a route attached is dropped as a
+    // martian) and when no TX frame is free. Frames go out on the next flush().
+    bool send(const struct sockaddr_in& to, const char* data, size_t len) {
+        if (!is_open() || len > XDP_FRAME_SIZE - 42 || (ntohl(to.sin_addr.s_addr) >> 24) == 127) {
+            return false;
+        }
+        auto it = peers.find(peer_key(to.sin_addr.s_addr, to.sin_port));
+        if (it == peers.end()) {
+            return false;
+        }
+        if (free_frames.empty()) {
+            reclaim_tx();
+        }
+        if (free_frames.empty() || *tx.producer - tx.load_consumer() >= XDP_RING_SIZE) {
+            return false;
+        }
+        const Peer& peer = it->second;
+        uint64_t addr = free_frames.back();
+        free_frames.pop_back();
+        uint8_t* frame = (uint8_t*)umem + addr;
+
+        memcpy(frame, peer.mac, 6);
+        memcpy(frame + 6, peer.our_mac, 6);
+        frame[12] = 0x08;
+        frame[13] = 0x00;
+
+        uint8_t* ip = frame + 14;
+        uint16_t total = htons(20 + 8 + len), id = htons(ip_id++);
+        ip[0] = 0x45;
+        ip[1] = 0;
+        memcpy(ip + 2, &total, 2);
+        memcpy(ip + 4, &id, 2);
+        ip[6] = 0x40; // don't fragment
+        ip[7] = 0;
+        ip[8] = 64;
+        ip[9] = IPPROTO_UDP;
+        ip[10] = ip[11] = 0;
+        memcpy(ip + 12, &peer.our_ip, 4);
+        memcpy(ip + 16, &to.sin_addr.s_addr, 4);
+        uint32_t sum = 0;
+        for (int i = 0; i < 20; i += 2) {
+            sum += (ip[i] << 8) | ip[i + 1];
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        uint16_t checksum = htons(~sum & 0xFFFF);
+        memcpy(ip + 10, &checksum, 2);
+
+        uint8_t* udp = ip + 20;
+        uint16_t udp_len = htons(8 + len);
+        memcpy(udp, &port, 2);
+        memcpy(udp + 2, &to.sin_port, 2);
+        memcpy(udp + 4, &udp_len, 2);
+        udp[6] = udp[7] = 0; // no UDP checksum (allowed over IPv4)
+        memcpy(udp + 8, data, len);
+
+        uint32_t prod = *tx.producer;
+        tx.at(prod).addr = addr;
+        tx.at(prod).len = 14 + 20 + 8 + len;
+        tx.at(prod).options = 0;
+        tx.store_producer(prod + 1);
+        tx_unsent++;
+        sent++;
+        return true;
+    }
+
+    // Tells the kernel to transmit everything queued by send().
+    void flush() {
+        if (tx_unsent == 0) {
+            return;
+        }
+        // Copy mode sends at most a batch per kick and reports EAGAIN for the rest
+        for (uint32_t kicks = tx_unsent / XDP_TX_KICK_BATCH + 2; kicks > 0; kicks--) {
+            if (sendto(xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0) >= 0 || (errno != EAGAIN && errno != EBUSY)) {
+                break;
+            }
+        }
+        tx_unsent = 0;
+        reclaim_tx();
+    }
+
+    void close() {
+        if (link_fd >= 0) {
+            ::close(link_fd); // detaches the program
+            link_fd = -1;
+        }
+        for (int* fd : {&prog_fd, &map_fd}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+        fill.unmap();
+        completion.unmap();
+        rx.unmap();
+        tx.unmap();
+        if (xsk >= 0) {
+            ::close(xsk);
+            xsk = -1;
+        }
+        if (umem != MAP_FAILED) {
+            munmap(umem, (size_t)XDP_FRAME_SIZE * XDP_FRAME_COUNT);
+            umem = (char*)MAP_FAILED;
+        }
+        free_frames.clear();
+        peers.clear();
+    }
+};
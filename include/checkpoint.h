@@ -0,0 +1,110 @@
+#pragma once
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "UAP_header.h"
+
+// Resumable transfers.
+//
+// A client that names its transfer (HELLO_OPT_TRANSFER_ID, a stable id of its
+// choosing) can pick it up where it broke off, under a new session id. The
+// server counts the input bytes it has delivered in order, the committed
+// offset: each DATA is one input line, so its payload plus the newline. It
+// persists the offset to <dir>/<transfer id> every CHECKPOINT_INTERVAL_MS and
+// when the session ends, and answers the HELLO of a transfer it knows with the
+// offset to resume from (HELLO_OPT_RESUME_OFFSET). If the old session is still
+// open, because the server hasn't timed it out yet, its in-memory offset is
+// used and the old session is closed.
+//
+// A client that has sent its whole input puts the final offset in its GOODBYE
+// payload (u64). The transfer is then complete, and the server deletes the
+// checkpoint so the id can be used again; an empty GOODBYE keeps it.
+
+const int CHECKPOINT_INTERVAL_MS = 1000;
+const size_t TRANSFER_ID_MAX = 64;
+
+// Ids are used as file names: letters, digits, '.', '-' and '_', not starting with '.'.
+inline bool valid_transfer_id(const std::string& id) {
+    if (id.empty() || id.size() > TRANSFER_ID_MAX || id[0] == '.') {
+        return false;
+    }
+    for (char c : id) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string encode_offset(uint64_t offset) {
+    uint64_t net = htonll(offset);
+    return std::string((const char*)&net, sizeof(net));
+}
+
+inline bool decode_offset(const char* payload, size_t len, uint64_t& offset) {
+    if (len != sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t net;
+    memcpy(&net, payload, sizeof(net));
+    offset = ntohll(net);
+    return true;
+}
+
+class CheckpointStore {
+private:
+    std::string dir;
+
+public:
+    bool open(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+            return false;
+        }
+        dir = path;
+        return true;
+    }
+
+    bool is_open() const { return !dir.empty(); }
+
+    // Committed offset of `id`, 0 for a transfer without a checkpoint.
+    uint64_t load(const std::string& id) const {
+        FILE* file = fopen((dir + "/" + id).c_str(), "r");
+        if (file == nullptr) {
+            return 0;
+        }
+        unsigned long long offset = 0;
+        if (fscanf(file, "%llu", &offset) != 1) {
+            offset = 0;
+        }
+        fclose(file);
+        return offset;
+    }
+
+    // Written to a temporary file, synced and renamed over the old checkpoint,
+    // so a crash leaves either the old offset or the new one.
+    bool save(const std::string& id, uint64_t offset) const {
+        std::string path = dir + "/" + id;
+        std::string tmp = path + ".tmp";
+        FILE* file = fopen(tmp.c_str(), "w");
+        if (file == nullptr) {
+            return false;
+        }
+        bool ok = fprintf(file, "%llu\n", (unsigned long long)offset) > 0 && fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void remove(const std::string& id) const {
+        unlink((dir + "/" + id).c_str());
+    }
+};
@@ -0,0 +1,181 @@
+#pragma once
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <arpa/inet.h>
+#include "UAP_header.h"
+
+// UAP version 2: a compact, variable-length header for short messages.
+//
+//   u16 magic, u8 version (2), u8 flags | command, u32 session id (big-endian,
+//   as in v1), then LEB128 varints: sequence number, logical clock and, if
+//   UAP_COMPACT_TIMESTAMP is set, the timestamp.
+//
+// The varints are zigzag-encoded deltas against the sender's base, the fields of
+// the HELLO it sent, so every packet still decodes on its own when earlier ones
+// were lost or reordered. A packet flagged UAP_COMPACT_FULL carries absolute
+// values instead and becomes the new base. A timestamp of 0 means "none" and is
+// left out; the servers send their replies without one.
+//
+// v2 is negotiated in the HELLO exchange, which always uses v1: the client
+// offers HELLO_OPT_VERSION = 2 and both sides switch once the server's reply
+// echoes it. Servers take v1 and v2 packets side by side.
+
+const uint8_t UAP_VERSION_COMPACT = 2;
+const uint8_t UAP_COMPACT_FULL = 0x80;
+const uint8_t UAP_COMPACT_TIMESTAMP = 0x40;
+const uint8_t UAP_COMPACT_COMMAND_MASK = 0x3F;
+const size_t UAP_COMPACT_FIXED_SIZE = 8;        // magic, version, flags | command, session id
+const size_t UAP_COMPACT_MAX_HEADER = UAP_COMPACT_FIXED_SIZE + 5 + 10 + 10;
+const size_t UAP_MAX_HEADER = UAP_COMPACT_MAX_HEADER > sizeof(UAP_header) ? UAP_COMPACT_MAX_HEADER : sizeof(UAP_header);
+
+// One direction's reference values for the deltas.
+struct CompactBase {
+    bool set = false;
+    int32_t sequence_number = 0;
+    int64_t logical_clock = 0;
+    int64_t timestamp = 0;
+
+    void reset(int32_t seq, int64_t clock, int64_t ts) {
+        set = true;
+        sequence_number = seq;
+        logical_clock = clock;
+        timestamp = ts;
+    }
+};
+
+inline bool uap_version_supported(uint8_t version) {
+    return version == UAP_VERSION || version == UAP_VERSION_COMPACT;
+}
+
+inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+inline size_t put_varint(char* out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char)v;
+    return n;
+}
+
+inline bool get_varint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes a v2 header for host-order field values to `out` (at least
+// UAP_COMPACT_MAX_HEADER bytes) and returns its length. Without a base the
+// header is sent FULL and becomes the base.
+inline size_t encode_compact_header(char* out, uint8_t command, int32_t seq, uint32_t session_id,
+                                    int64_t logical_clock, int64_t timestamp, CompactBase& base) {
+    bool full = !base.set;
+    uint8_t flags = (command & UAP_COMPACT_COMMAND_MASK) | (full ? UAP_COMPACT_FULL : 0) | (timestamp != 0 ? UAP_COMPACT_TIMESTAMP : 0);
+    uint16_t magic = htons(UAP_MAGIC);
+    uint32_t session = htonl(session_id);
+    memcpy(out, &magic, sizeof(magic));
+    out[2] = UAP_VERSION_COMPACT;
+    out[3] = flags;
+    memcpy(out + 4, &session, sizeof(session));
+
+    size_t n = UAP_COMPACT_FIXED_SIZE;
+    n += put_varint(out + n, zigzag_encode(full ? seq : (int64_t)seq - base.sequence_number));
+    n += put_varint(out + n, zigzag_encode(full ? logical_clock : logical_clock - base.logical_clock));
+    if (timestamp != 0) {
+        n += put_varint(out + n, zigzag_encode(full ? timestamp : timestamp - base.timestamp));
+    }
+    if (full) {
+        base.reset(seq, logical_clock, timestamp);
+    }
+    return n;
+}
+
+// Decodes a v2 header into host-order fields. Fails for a delta-encoded packet
+// when the sender's base is not known yet.
+inline bool decode_compact_header(const char* buffer, size_t n, UAP_header& header, size_t& header_len, CompactBase& base) {
+    if (n < UAP_COMPACT_FIXED_SIZE) {
+        return false;
+    }
+    uint16_t magic;
+    uint32_t session;
+    memcpy(&magic, buffer, sizeof(magic));
+    memcpy(&session, buffer + 4, sizeof(session));
+    uint8_t flags = buffer[3];
+    bool full = flags & UAP_COMPACT_FULL;
+    if (ntohs(magic) != UAP_MAGIC || (uint8_t)buffer[2] != UAP_VERSION_COMPACT || (!full && !base.set)) {
+        return false;
+    }
+
+    const char* p = buffer + UAP_COMPACT_FIXED_SIZE;
+    const char* end = buffer + n;
+    uint64_t seq, clock, timestamp = 0;
+    if (!get_varint(p, end, seq) || !get_varint(p, end, clock)
+        || ((flags & UAP_COMPACT_TIMESTAMP) && !get_varint(p, end, timestamp))) {
+        return false;
+    }
+    header.magic = UAP_MAGIC;
+    header.version = UAP_VERSION_COMPACT;
+    header.command = flags & UAP_COMPACT_COMMAND_MASK;
+    header.session_id = ntohl(session);
+    if (full) {
+        header.sequence_number = (int32_t)zigzag_decode(seq);
+        header.logical_clock = zigzag_decode(clock);
+        header.timestamp = zigzag_decode(timestamp);
+        base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+    } else {
+        header.sequence_number = (int32_t)(base.sequence_number + zigzag_decode(seq));
+        header.logical_clock = base.logical_clock + zigzag_decode(clock);
+        header.timestamp = (flags & UAP_COMPACT_TIMESTAMP) ? base.timestamp + zigzag_decode(timestamp) : 0;
+    }
+    header_len = p - buffer;
+    return true;
+}
+
+// Session id of a v1 or v2 datagram, needed to find the sender's base before
+// the rest of a v2 header can be decoded.
+inline bool peek_session_id(const char* buffer, size_t n, int32_t& session_id) {
+    uint32_t net;
+    if (n >= sizeof(UAP_header) && (uint8_t)buffer[2] == UAP_VERSION) {
+        memcpy(&net, buffer + offsetof(UAP_header, session_id), sizeof(net));
+    } else if (n >= UAP_COMPACT_FIXED_SIZE && (uint8_t)buffer[2] == UAP_VERSION_COMPACT) {
+        memcpy(&net, buffer + 4, sizeof(net));
+    } else {
+        return false;
+    }
+    session_id = ntohl(net);
+    return true;
+}
+
+// Decodes a v1 or v2 header into host-order fields; `base` is only used for v2.
+inline bool decode_header(const char* buffer, size_t n, UAP_header& header, size_t& header_len, CompactBase& base) {
+    if (n >= 3 && (uint8_t)buffer[2] == UAP_VERSION_COMPACT) {
+        return decode_compact_header(buffer, n, header, header_len, base);
+    }
+    if (n < sizeof(UAP_header)) {
+        return false;
+    }
+    const UAP_header* raw = reinterpret_cast<const UAP_header*>(buffer);
+    header.magic = ntohs(raw->magic);
+    header.version = raw->version;
+    header.command = raw->command;
+    header.sequence_number = ntohl(raw->sequence_number);
+    header.session_id = ntohl(raw->session_id);
+    header.logical_clock = ntohll(raw->logical_clock);
+    header.timestamp = ntohll(raw->timestamp);
+    header_len = sizeof(UAP_header);
+    return header.magic == UAP_MAGIC && header.version == UAP_VERSION;
+}
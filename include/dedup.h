@@ -0,0 +1,638 @@
+#pragma once
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "UAP_header.h"
+#include "admission.h"
+
+// Deduplicated transfers: only the parts of a file the server doesn't have yet.
+//
+// The client splits its input into content-defined chunks (a gear rolling hash
+// picks the boundaries, so an insertion only changes the chunks around it) and
+// names each chunk by its SHA-256. It sends the list of chunk hashes first, as
+// MANIFEST packets, and the server answers every MANIFEST with a NEED listing
+// the chunks that aren't in its chunk store. Only those are sent, as CHUNK
+// packets; the server verifies and stores them and, when the session ends,
+// rebuilds the file from the store. A file sent again with small changes costs
+// the manifest (36 bytes per ~8 KB chunk) plus the changed chunks.
+//
+// MANIFEST and CHUNK are sequenced like DATA and recovered by the usual NACK
+// and retransmit logic. NEED isn't: a client that hasn't had the NEED for a
+// MANIFEST after DEDUP_NEED_TIMEOUT_MS sends the MANIFEST again, and the server
+// answers duplicates with a fresh NEED. The transfer is negotiated with
+// HELLO_OPT_DEDUP, whose value is the name of the file to rebuild.
+//
+// MANIFEST payload: u32 index of the first entry, u32 total entries in the
+//                   file, then entries of a 32-byte SHA-256 and a u32 length.
+// NEED payload:     u32 index of the first entry of the MANIFEST it answers,
+//                   u16 entry count, then a bitmap (LSB first) of the entries
+//                   the server wants.
+// CHUNK payload:    u32 entry index, u32 offset in the chunk, then chunk bytes.
+
+const size_t DEDUP_MIN_CHUNK = 2048;
+const size_t DEDUP_AVG_CHUNK = 8192;
+const size_t DEDUP_MAX_CHUNK = 65536;
+const size_t DEDUP_HASH_SIZE = 32;
+const size_t DEDUP_ENTRY_SIZE = DEDUP_HASH_SIZE + sizeof(uint32_t);
+const size_t DEDUP_MAX_PAYLOAD = 1024 - sizeof(UAP_header);    // fits the servers' buffers
+const size_t DEDUP_MANIFEST_ENTRIES = (DEDUP_MAX_PAYLOAD - 2 * sizeof(uint32_t)) / DEDUP_ENTRY_SIZE;
+const size_t DEDUP_CHUNK_DATA = DEDUP_MAX_PAYLOAD - 2 * sizeof(uint32_t);
+const int DEDUP_NEED_TIMEOUT_MS = 500;
+const uint64_t DEDUP_MAX_FILE_BYTES = 1ULL << 30;  // default cap on a manifest: its file at the smallest chunks
+
+// ---------------------------------------------------------------- SHA-256
+
+class Sha256 {
+private:
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t block[64];
+    size_t block_len = 0;
+    uint64_t total = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* p) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+public:
+    void update(const char* data, size_t len) {
+        const uint8_t* p = (const uint8_t*)data;
+        total += len;
+        if (block_len > 0) {
+            size_t take = std::min(len, sizeof(block) - block_len);
+            memcpy(block + block_len, p, take);
+            block_len += take;
+            p += take;
+            len -= take;
+            if (block_len < sizeof(block)) {
+                return;
+            }
+            compress(block);
+            block_len = 0;
+        }
+        for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block)) {
+            compress(p);
+        }
+        memcpy(block, p, len);
+        block_len = len;
+    }
+
+    // The 32-byte digest, as a binary string.
+    std::string final() {
+        uint64_t bits = total * 8;
+        char pad = (char)0x80;
+        update(&pad, 1);
+        char zero = 0;
+        while (block_len != 56) {
+            update(&zero, 1);
+        }
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        update((const char*)length, sizeof(length));
+        std::string digest(DEDUP_HASH_SIZE, '\0');
+        for (int i = 0; i < 8; i++) {
+            uint32_t net = htonl(state[i]);
+            memcpy(&digest[4 * i], &net, sizeof(net));
+        }
+        return digest;
+    }
+};
+
+inline std::string sha256(const char* data, size_t len) {
+    Sha256 h;
+    h.update(data, len);
+    return h.final();
+}
+
+inline std::string to_hex(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char c : bytes) {
+        hex += digits[c >> 4];
+        hex += digits[c & 15];
+    }
+    return hex;
+}
+
+// ---------------------------------------------------------------- Chunking
+
+struct ChunkRef {
+    size_t offset;
+    uint32_t length;
+    std::string hash;
+};
+
+// Gear table: one pseudo-random 64-bit value per byte value (splitmix64).
+struct GearTable {
+    uint64_t values[256];
+    GearTable() {
+        uint64_t x = 0x5541502d43444321ULL;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+// Length of the chunk starting at `data` (FastCDC-style normalized chunking).
+// The gear hash shifts one bit per byte, so its top bits depend on the last 64
+// bytes; a boundary is where the masked top bits are all zero. Before the
+// average size a stricter mask (two more bits) applies and after it a looser
+// one, which keeps chunk sizes close to DEDUP_AVG_CHUNK.
+inline size_t next_chunk_length(const uint8_t* data, size_t len) {
+    static const GearTable gear;
+    const uint64_t mask_small = ~0ULL << (64 - 15);   // log2(DEDUP_AVG_CHUNK) + 2 bits
+    const uint64_t mask_large = ~0ULL << (64 - 11);   // log2(DEDUP_AVG_CHUNK) - 2 bits
+    if (len <= DEDUP_MIN_CHUNK) {
+        return len;
+    }
+    size_t end = std::min(len, DEDUP_MAX_CHUNK);
+    size_t normal = std::min(end, DEDUP_AVG_CHUNK);
+    uint64_t hash = 0;
+    size_t i = DEDUP_MIN_CHUNK;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear.values[data[i]];
+        if ((hash & mask_small) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear.values[data[i]];
+        if ((hash & mask_large) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+inline std::vector<ChunkRef> content_chunks(const char* data, size_t len) {
+    std::vector<ChunkRef> chunks;
+    for (size_t offset = 0; offset < len;) {
+        size_t length = next_chunk_length((const uint8_t*)data + offset, len - offset);
+        chunks.push_back({offset, (uint32_t)length, sha256(data + offset, length)});
+        offset += length;
+    }
+    return chunks;
+}
+
+// ---------------------------------------------------------------- Payloads
+
+struct ManifestEntry {
+    std::string hash;
+    uint32_t length = 0;
+};
+
+inline void put_u32(std::string& out, uint32_t value) {
+    uint32_t net = htonl(value);
+    out.append((const char*)&net, sizeof(net));
+}
+
+inline uint32_t get_u32(const char* p) {
+    uint32_t net;
+    memcpy(&net, p, sizeof(net));
+    return ntohl(net);
+}
+
+inline std::string encode_manifest(uint32_t first, const std::vector<ChunkRef>& chunks, size_t count) {
+    std::string payload;
+    put_u32(payload, first);
+    put_u32(payload, chunks.size());
+    for (size_t i = first; i < first + count; i++) {
+        payload += chunks[i].hash;
+        put_u32(payload, chunks[i].length);
+    }
+    return payload;
+}
+
+inline bool decode_manifest(const char* payload, size_t len, uint32_t& first, uint32_t& total, std::vector<ManifestEntry>& entries) {
+    if (len < 2 * sizeof(uint32_t) || (len - 2 * sizeof(uint32_t)) % DEDUP_ENTRY_SIZE != 0) {
+        return false;
+    }
+    first = get_u32(payload);
+    total = get_u32(payload + sizeof(uint32_t));
+    entries.clear();
+    for (size_t off = 2 * sizeof(uint32_t); off < len; off += DEDUP_ENTRY_SIZE) {
+        entries.push_back({std::string(payload + off, DEDUP_HASH_SIZE), get_u32(payload + off + DEDUP_HASH_SIZE)});
+    }
+    return (uint64_t)first + entries.size() <= total;
+}
+
+inline std::string encode_need(uint32_t first, const std::vector<bool>& wanted) {
+    std::string payload;
+    put_u32(payload, first);
+    uint16_t count = htons(wanted.size());
+    payload.append((const char*)&count, sizeof(count));
+    std::string bitmap((wanted.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < wanted.size(); i++) {
+        if (wanted[i]) {
+            bitmap[i / 8] |= (char)(1 << (i % 8));
+        }
+    }
+    return payload + bitmap;
+}
+
+inline bool decode_need(const char* payload, size_t len, uint32_t& first, std::vector<bool>& wanted) {
+    if (len < sizeof(uint32_t) + sizeof(uint16_t)) {
+        return false;
+    }
+    first = get_u32(payload);
+    uint16_t count;
+    memcpy(&count, payload + sizeof(uint32_t), sizeof(count));
+    count = ntohs(count);
+    const char* bitmap = payload + sizeof(uint32_t) + sizeof(uint16_t);
+    if (len - sizeof(uint32_t) - sizeof(uint16_t) != (size_t)(count + 7) / 8) {
+        return false;
+    }
+    wanted.assign(count, false);
+    for (size_t i = 0; i < count; i++) {
+        wanted[i] = (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+    return true;
+}
+
+inline std::string encode_chunk(uint32_t index, uint32_t offset, const char* data, size_t len) {
+    std::string payload;
+    put_u32(payload, index);
+    put_u32(payload, offset);
+    return payload.append(data, len);
+}
+
+// ---------------------------------------------------------------- Chunk store
+
+// Chunks on disk, one file per chunk named by its hash under <dir>/chunks,
+// and rebuilt files under <dir>/files. Files are written to a temporary name
+// and renamed into place, so concurrent sessions and crashes never leave a
+// partial chunk or file behind under its real name.
+class ChunkStore {
+private:
+    std::string dir;
+
+    std::string chunk_path(const std::string& hash) const {
+        std::string hex = to_hex(hash);
+        return dir + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+    }
+
+    static bool write_file(const std::string& path, const char* data, size_t len) {
+        std::string tmp = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string((uintptr_t)data);
+        FILE* file = fopen(tmp.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        bool ok = fwrite(data, 1, len, file) == len;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+public:
+    bool open(const std::string& path) {
+        dir = path;
+        for (const std::string& sub : {std::string(), std::string("/chunks"), std::string("/files")}) {
+            if (mkdir((dir + sub).c_str(), 0755) < 0 && errno != EEXIST) {
+                dir.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_open() const { return !dir.empty(); }
+
+    bool has(const std::string& hash) const {
+        return access(chunk_path(hash).c_str(), F_OK) == 0;
+    }
+
+    bool put(const std::string& hash, const std::string& data) {
+        std::string path = chunk_path(hash);
+        mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+        return write_file(path, data.data(), data.size());
+    }
+
+    bool get(const std::string& hash, std::string& data) const {
+        FILE* file = fopen(chunk_path(hash).c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        char buffer[65536];
+        size_t n;
+        data.clear();
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            data.append(buffer, n);
+        }
+        fclose(file);
+        return true;
+    }
+
+    // Where a file named `name` by a client is rebuilt: its last path component,
+    // with anything unusual replaced.
+    std::string file_path(const std::string& name) const {
+        std::string base = name.substr(name.rfind('/') + 1);
+        for (char& c : base) {
+            if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '_') {
+                c = '_';
+            }
+        }
+        if (base.empty() || base[0] == '.') {
+            base = "_" + base;
+        }
+        return dir + "/files/" + base;
+    }
+
+    // Concatenates the chunks of `entries` into the file `name`. Fails if a
+    // chunk is missing or doesn't match its hash.
+    bool rebuild(const std::string& name, const std::vector<ManifestEntry>& entries, std::string& path) const {
+        path = file_path(name);
+        std::string tmp = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string((uintptr_t)&entries);
+        FILE* file = fopen(tmp.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        std::string data;
+        bool ok = true;
+        for (const ManifestEntry& entry : entries) {
+            if (!get(entry.hash, data) || data.size() != entry.length || fwrite(data.data(), 1, data.size(), file) != data.size()) {
+                ok = false;
+                break;
+            }
+        }
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------- Endpoints
+
+// Client side: what to send next, and which MANIFESTs still wait for a NEED.
+class DedupSender {
+private:
+    struct Awaiting {
+        int32_t seq;
+        std::string payload;
+        int64_t sent_ms;
+    };
+
+    const char* data = nullptr;
+    std::vector<ChunkRef> chunks;
+    size_t next_entry = 0;                      // first entry not yet in a MANIFEST
+    std::map<uint32_t, Awaiting> awaiting;      // first entry -> MANIFEST without a NEED yet
+    std::deque<uint32_t> wanted;                // entries the server asked for, to send
+    uint32_t chunk_offset = 0;                  // how much of wanted.front() was sent
+    std::unordered_set<std::string> sent;       // hashes already sent (CHUNKs are reliable)
+    bool manifest_started = false;              // an empty file still sends one MANIFEST
+
+public:
+    uint64_t total_bytes = 0;
+    uint64_t sent_bytes = 0;                    // chunk bytes sent
+    uint64_t chunks_sent = 0;
+
+    void start(const char* input, size_t len) {
+        data = input;
+        chunks = content_chunks(input, len);
+        total_bytes = len;
+    }
+
+    size_t chunk_count() const { return chunks.size(); }
+
+    bool has_packet() const {
+        return !wanted.empty() || next_entry < chunks.size() || !manifest_started;
+    }
+
+    // Next packet to send: CHUNK data first, so the server's NEEDs are served
+    // in order, then the next MANIFEST. False if there is nothing to send now.
+    bool next(uint8_t& command, std::string& payload) {
+        while (!wanted.empty()) {
+            const ChunkRef& chunk = chunks[wanted.front()];
+            if (chunk_offset == 0 && !sent.insert(chunk.hash).second) {
+                wanted.pop_front(); // the same content again, already on its way
+                continue;
+            }
+            size_t len = std::min<size_t>(DEDUP_CHUNK_DATA, chunk.length - chunk_offset);
+            command = UAP_COMMAND_CHUNK;
+            payload = encode_chunk(wanted.front(), chunk_offset, data + chunk.offset + chunk_offset, len);
+            sent_bytes += len;
+            chunk_offset += len;
+            if (chunk_offset == chunk.length) {
+                wanted.pop_front();
+                chunk_offset = 0;
+                chunks_sent++;
+            }
+            return true;
+        }
+        if (next_entry < chunks.size() || !manifest_started) {
+            size_t count = std::min(DEDUP_MANIFEST_ENTRIES, chunks.size() - next_entry);
+            command = UAP_COMMAND_MANIFEST;
+            payload = encode_manifest(next_entry, chunks, count);
+            next_entry += count;
+            manifest_started = true;
+            return true;
+        }
+        return false;
+    }
+
+    // Records the sequence number a MANIFEST went out with, to resend it as is.
+    void manifest_sent_as(int32_t seq, const std::string& payload, int64_t now_ms) {
+        awaiting[get_u32(payload.data())] = {seq, payload, now_ms};
+    }
+
+    void on_need(const char* payload, size_t len) {
+        uint32_t first;
+        std::vector<bool> bits;
+        if (!decode_need(payload, len, first, bits) || awaiting.erase(first) == 0) {
+            return; // unknown or answered already
+        }
+        for (size_t i = 0; i < bits.size() && first + i < chunks.size(); i++) {
+            if (bits[i]) {
+                wanted.push_back(first + i);
+            }
+        }
+    }
+
+    // MANIFESTs whose NEED is overdue, to be sent again.
+    void overdue(int64_t now_ms, std::vector<std::pair<int32_t, std::string>>& resend) {
+        resend.clear();
+        for (auto& [first, entry] : awaiting) {
+            if (now_ms - entry.sent_ms >= DEDUP_NEED_TIMEOUT_MS) {
+                resend.push_back({entry.seq, entry.payload});
+                entry.sent_ms = now_ms;
+            }
+        }
+    }
+
+    // Everything the server asked for was sent.
+    bool done() const {
+        return manifest_started && next_entry >= chunks.size() && awaiting.empty() && wanted.empty();
+    }
+};
+
+// Server side: one session's manifest and the chunks it is receiving.
+//
+// The manifest's entry count comes from the client, so it is capped at what a
+// file of `max_file_bytes` cut into the smallest chunks would need. Chunks
+// being assembled are charged to `admission` (if given) like held datagrams,
+// against the session's limit together with `session_bytes`; a piece over the
+// limit drops its chunk, and the transfer ends incomplete rather than the
+// server running out of memory.
+class DedupReceiver {
+private:
+    std::vector<ManifestEntry> recipe;          // the file, chunk by chunk
+    size_t entries_known = 0;
+    bool have_manifest = false;
+    std::map<uint32_t, std::string> assembling; // entry -> bytes received so far
+    size_t assembling_bytes = 0;                // charged to `admission`
+    uint64_t max_chunks;
+    AdmissionControl* admission;
+
+    void discard(std::map<uint32_t, std::string>::iterator it) {
+        assembling_bytes -= it->second.size();
+        if (admission != nullptr) {
+            admission->release(it->second.size());
+        }
+        assembling.erase(it);
+    }
+
+public:
+    std::string name;                           // file to rebuild
+    uint64_t chunks_received = 0;
+    uint64_t bytes_received = 0;
+    uint64_t corrupt = 0;
+    uint64_t chunks_dropped = 0;                // over the admission limits
+    bool too_large = false;                     // the manifest was refused
+
+    explicit DedupReceiver(const std::string& file_name, uint64_t max_file_bytes = DEDUP_MAX_FILE_BYTES,
+                           AdmissionControl* admission = nullptr)
+        : max_chunks(max_file_bytes / DEDUP_MIN_CHUNK + 1), admission(admission), name(file_name) {}
+    DedupReceiver(const DedupReceiver&) = delete;
+    DedupReceiver& operator=(const DedupReceiver&) = delete;
+
+    ~DedupReceiver() {
+        if (admission != nullptr) {
+            admission->release(assembling_bytes);
+        }
+    }
+
+    // Takes in a MANIFEST (again, if it is a duplicate) and returns the NEED
+    // answering it; empty if the payload is malformed or the file too large
+    // (which sets too_large).
+    std::string on_manifest(const ChunkStore& store, const char* payload, size_t len) {
+        uint32_t first, total;
+        std::vector<ManifestEntry> entries;
+        if (!decode_manifest(payload, len, first, total, entries) || (have_manifest && total != recipe.size())) {
+            return "";
+        }
+        if (total > max_chunks) {
+            too_large = true;
+            return "";
+        }
+        have_manifest = true;
+        recipe.resize(total);
+        std::vector<bool> wanted(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (recipe[first + i].hash.empty()) {
+                entries_known++;
+            }
+            recipe[first + i] = entries[i];
+            wanted[i] = entries[i].length <= DEDUP_MAX_CHUNK && !store.has(entries[i].hash);
+        }
+        return encode_need(first, wanted);
+    }
+
+    void on_chunk(ChunkStore& store, size_t session_bytes, const char* payload, size_t len) {
+        if (len < 2 * sizeof(uint32_t)) {
+            return;
+        }
+        uint32_t index = get_u32(payload);
+        uint32_t offset = get_u32(payload + sizeof(uint32_t));
+        size_t data_len = len - 2 * sizeof(uint32_t);
+        if (index >= recipe.size() || recipe[index].hash.empty()) {
+            return;
+        }
+        auto it = assembling.emplace(index, std::string()).first;
+        std::string& bytes = it->second;
+        if (offset != bytes.size() || bytes.size() + data_len > recipe[index].length) {
+            discard(it);
+            return;
+        }
+        uint8_t reason;
+        if (admission != nullptr && !admission->reserve(session_bytes + assembling_bytes, data_len, reason)) {
+            chunks_dropped++;
+            discard(it);
+            return;
+        }
+        bytes.append(payload + 2 * sizeof(uint32_t), data_len);
+        assembling_bytes += data_len;
+        bytes_received += data_len;
+        if (bytes.size() == recipe[index].length) {
+            if (sha256(bytes.data(), bytes.size()) == recipe[index].hash) {
+                store.put(recipe[index].hash, bytes);
+                chunks_received++;
+            } else {
+                corrupt++;
+            }
+            discard(it);
+        }
+    }
+
+    bool complete() const { return have_manifest && entries_known == recipe.size(); }
+    size_t chunk_count() const { return recipe.size(); }
+
+    uint64_t file_size() const {
+        uint64_t size = 0;
+        for (const ManifestEntry& entry : recipe) {
+            size += entry.length;
+        }
+        return size;
+    }
+
+    bool rebuild(const ChunkStore& store, std::string& path) const {
+        return complete() && store.rebuild(name, recipe, path);
+    }
+};
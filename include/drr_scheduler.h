@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+
+// Weighted fair scheduling of packets across sessions (deficit round-robin).
+//
+// Each session (flow) has its own FIFO queue. Flows with something queued sit
+// in an active ring; the flow at the head may send packets as long as their
+// cost (bytes) fits its deficit, which grows by `weight * DRR_QUANTUM_BYTES`
+// each time the flow comes round. A bulk flow therefore gets at most its share
+// of a round before every other backlogged flow has had a turn, and a packet of
+// an interactive flow waits behind at most one quantum of each other flow
+// instead of behind the whole backlog.
+//
+// The weight comes from the session priority negotiated in the HELLO
+// (HELLO_OPT_PRIORITY). The scheduler itself is not thread-safe.
+
+const size_t DRR_QUANTUM_BYTES = 1500;      // deficit added per round at weight 1
+const uint16_t SESSION_PRIORITY_DEFAULT = 4;
+const uint16_t SESSION_PRIORITY_MAX = 16;
+const size_t DRR_MAX_FLOW_PACKETS = 4096;   // packets queued per flow before new ones are dropped
+
+inline uint16_t clamp_priority(uint16_t priority) {
+    return priority < 1 ? 1 : priority > SESSION_PRIORITY_MAX ? SESSION_PRIORITY_MAX : priority;
+}
+
+template <typename Key, typename Item>
+class DrrScheduler {
+private:
+    struct Flow {
+        std::deque<std::pair<Item, size_t>> queue; // item, cost
+        size_t deficit = 0;
+    };
+
+    std::unordered_map<Key, Flow> flows;        // sessions with a weight, and flows with queued items
+    std::unordered_map<Key, uint16_t> weights;  // sessions with a negotiated priority
+    std::deque<Key> active;     // round-robin order of the flows with queued items
+    bool head_credited = false; // the head flow already got its quantum this round
+    size_t queued = 0;
+
+public:
+    uint64_t dropped = 0;
+
+    // Queues `item` for `key`. Fails (the caller drops it) when the flow's
+    // queue is full.
+    bool push(const Key& key, Item item, size_t cost) {
+        Flow& flow = flows[key];
+        if (flow.queue.size() >= DRR_MAX_FLOW_PACKETS) {
+            dropped++;
+            return false;
+        }
+        if (flow.queue.empty()) {
+            active.push_back(key);
+        }
+        flow.queue.emplace_back(std::move(item), cost);
+        queued++;
+        return true;
+    }
+
+    // Next item in weighted round-robin order, or false when nothing is queued.
+    bool pop(Key& key, Item& item) {
+        while (!active.empty()) {
+            Flow& flow = flows[active.front()];
+            if (!head_credited) {
+                auto weight = weights.find(active.front());
+                flow.deficit += (weight == weights.end() ? SESSION_PRIORITY_DEFAULT : weight->second) * DRR_QUANTUM_BYTES;
+                head_credited = true;
+            }
+            if (flow.queue.front().second <= flow.deficit) {
+                key = active.front();
+                flow.deficit -= flow.queue.front().second;
+                item = std::move(flow.queue.front().first);
+                flow.queue.pop_front();
+                queued--;
+                if (flow.queue.empty()) {
+                    // An idle flow doesn't bank credit. Flows of unknown sessions
+                    // are dropped so stray session ids don't accumulate.
+                    flow.deficit = 0;
+                    if (weights.find(active.front()) == weights.end()) {
+                        flows.erase(active.front());
+                    }
+                    active.pop_front();
+                    head_credited = false;
+                }
+                return true;
+            }
+            // Out of deficit: to the back of the ring until the next round
+            active.push_back(active.front());
+            active.pop_front();
+            head_credited = false;
+        }
+        return false;
+    }
+
+    void set_weight(const Key& key, uint16_t weight) {
+        weights[key] = clamp_priority(weight);
+    }
+
+    // Forgets a finished session, dropping whatever it still had queued.
+    // Returns the total cost of the dropped items.
+    size_t remove(const Key& key) {
+        weights.erase(key);
+        auto it = flows.find(key);
+        if (it == flows.end()) {
+            return 0;
+        }
+        size_t cost = 0;
+        for (auto const& entry : it->second.queue) {
+            cost += entry.second;
+        }
+        queued -= it->second.queue.size();
+        for (auto a = active.begin(); a != active.end(); ++a) {
+            if (*a == key) {
+                if (a == active.begin()) {
+                    head_credited = false;
+                }
+                active.erase(a);
+                break;
+            }
+        }
+        flows.erase(it);
+        return cost;
+    }
+
+    bool empty() const { return queued == 0; }
+    size_t size() const { return queued; }
+};
@@ -0,0 +1,123 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <map>
+#include <arpa/inet.h>
+#include "UAP_header.h"
+
+// Options negotiated in the HELLO exchange.
+//
+// The client's HELLO payload is a list of TLV options: 1-byte type, 1-byte
+// length, then `length` bytes of value (integers big-endian). Unknown types are
+// skipped, so either side can be older than the other. The server answers with
+// the options it accepted, possibly with adjusted values, in its HELLO payload;
+// an option missing from the reply was not accepted. An empty HELLO payload, as
+// sent by clients that predate this, means "all defaults".
+
+const uint8_t HELLO_OPT_ACK_EVERY = 1;      // uint16: DATA packets per cumulative ALIVE
+const uint8_t HELLO_OPT_ACK_DELAY_MS = 2;   // uint16: longest an ALIVE may be held back
+const uint8_t HELLO_OPT_VERSION = 3;        // uint16: header version used after the HELLO exchange
+const uint8_t HELLO_OPT_STRIPES = 4;        // uint16: source ports the client spreads its DATA over
+const uint8_t HELLO_OPT_PRIORITY = 5;       // uint16: scheduling weight, 1 (lowest) to 16
+const uint8_t HELLO_OPT_DEDUP = 6;          // string: deduplicated transfer of the named file
+const uint8_t HELLO_OPT_TRANSFER_ID = 7;    // string: stable id of a resumable transfer
+const uint8_t HELLO_OPT_RESUME_OFFSET = 8;  // uint64 (reply only): input bytes the server already has
+const uint8_t HELLO_OPT_OBJECT = 9;         // string: what the session carries ("path@offset+length"), see object_receiver.h
+
+class HelloOptions {
+private:
+    std::map<uint8_t, std::string> values;
+
+public:
+    void set(uint8_t type, const std::string& value) {
+        values[type] = value.substr(0, 255);
+    }
+
+    void set_u16(uint8_t type, uint16_t value) {
+        uint16_t net = htons(value);
+        set(type, std::string((const char*)&net, sizeof(net)));
+    }
+
+    void set_u32(uint8_t type, uint32_t value) {
+        uint32_t net = htonl(value);
+        set(type, std::string((const char*)&net, sizeof(net)));
+    }
+
+    void set_u64(uint8_t type, uint64_t value) {
+        uint64_t net = htonll(value);
+        set(type, std::string((const char*)&net, sizeof(net)));
+    }
+
+    bool has(uint8_t type) const { return values.count(type) != 0; }
+
+    bool get(uint8_t type, std::string& value) const {
+        auto it = values.find(type);
+        if (it == values.end()) {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    bool get_u16(uint8_t type, uint16_t& value) const {
+        auto it = values.find(type);
+        if (it == values.end() || it->second.size() != sizeof(uint16_t)) {
+            return false;
+        }
+        uint16_t net;
+        memcpy(&net, it->second.data(), sizeof(net));
+        value = ntohs(net);
+        return true;
+    }
+
+    bool get_u32(uint8_t type, uint32_t& value) const {
+        auto it = values.find(type);
+        if (it == values.end() || it->second.size() != sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t net;
+        memcpy(&net, it->second.data(), sizeof(net));
+        value = ntohl(net);
+        return true;
+    }
+
+    bool get_u64(uint8_t type, uint64_t& value) const {
+        auto it = values.find(type);
+        if (it == values.end() || it->second.size() != sizeof(uint64_t)) {
+            return false;
+        }
+        uint64_t net;
+        memcpy(&net, it->second.data(), sizeof(net));
+        value = ntohll(net);
+        return true;
+    }
+
+    bool empty() const { return values.empty(); }
+
+    std::string encode() const {
+        std::string payload;
+        for (auto const& [type, value] : values) {
+            payload += (char)type;
+            payload += (char)value.size();
+            payload += value;
+        }
+        return payload;
+    }
+
+    // Returns false (keeping what was parsed so far) on a truncated option.
+    bool decode(const char* payload, size_t len) {
+        values.clear();
+        size_t off = 0;
+        while (off + 2 <= len) {
+            uint8_t type = (uint8_t)payload[off];
+            uint8_t size = (uint8_t)payload[off + 1];
+            if (off + 2 + size > len) {
+                return false;
+            }
+            values[type] = std::string(payload + off + 2, size);
+            off += 2 + size;
+        }
+        return off == len;
+    }
+};
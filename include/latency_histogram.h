@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <ostream>
+#include <algorithm>
+
+// Fixed-size log-linear latency histogram (HDR-style). Values below 64 get
+// their own bucket; above that every power of two is split into 32 buckets, so
+// any recorded value is reported to within ~3%. Recording is O(1) and never
+// allocates, which keeps it usable on the hot path.
+
+class LatencyHistogram {
+private:
+    static const int LINEAR = 64;               // exact buckets for 0..63
+    static const int SUB_BUCKETS = 32;          // per power of two above that
+    static const int BUCKETS = LINEAR + 58 * SUB_BUCKETS;
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t min_value = UINT64_MAX;
+    uint64_t max_value = 0;
+
+    static int bucket_of(uint64_t v) {
+        if (v < LINEAR) {
+            return (int)v;
+        }
+        int msb = 63 - __builtin_clzll(v);         // >= 6
+        int shift = msb - 5;                        // keep the top 6 bits: 32..63
+        return LINEAR + (msb - 6) * SUB_BUCKETS + (int)((v >> shift) - SUB_BUCKETS);
+    }
+
+    // Highest value that lands in bucket `b`.
+    static uint64_t bucket_top(int b) {
+        if (b < LINEAR) {
+            return b;
+        }
+        int msb = (b - LINEAR) / SUB_BUCKETS + 6;
+        uint64_t sub = (b - LINEAR) % SUB_BUCKETS + SUB_BUCKETS;
+        int shift = msb - 5;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    void record(int64_t value) {
+        uint64_t v = value < 0 ? 0 : (uint64_t)value;
+        counts[std::min(bucket_of(v), BUCKETS - 1)]++;
+        total++;
+        sum += v;
+        min_value = std::min(min_value, v);
+        max_value = std::max(max_value, v);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        min_value = std::min(min_value, other.min_value);
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    void reset() { *this = LatencyHistogram(); }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? min_value : 0; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? (double)sum / total : 0; }
+
+    // Smallest bucket bound with at least `p` percent of the samples at or below it.
+    uint64_t percentile(double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucket_top(i), max_value);
+            }
+        }
+        return max_value;
+    }
+
+    // One-line summary, e.g. "RTT (us): n=2000 min=41 p50=88 p90=120 p99=310 p99.9=802 max=1210"
+    void print(std::ostream& out, const std::string& label) const {
+        out << label << ": n=" << total << " min=" << min() << " p50=" << percentile(50)
+            << " p90=" << percentile(90) << " p99=" << percentile(99) << " p99.9=" << percentile(99.9)
+            << " max=" << max() << std::endl;
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <errno.h>
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+// Opt-in low-latency server mode. The servers normally sleep in select() and
+// pay a scheduler wakeup for every packet; this trades CPU for latency:
+//
+//   --cpu 2,3         pin the I/O thread(s) to these cores (first one for the
+//                     receive loop, the rest round-robin for helper threads)
+//   --busy-poll 50    SO_BUSY_POLL / SO_PREFER_BUSY_POLL: the kernel polls the
+//                     device queue for up to this many microseconds on a read
+//   --spin 200        spin in userspace for up to this many microseconds waiting
+//                     for the socket to become readable before blocking
+//   --lock-memory 1   mlockall() and pre-fault the stack and heap so the hot path
+//                     never takes a page fault
+//
+// Each setting degrades to a printed warning where the kernel or the process's
+// privileges don't allow it.
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+const int LOW_LATENCY_BUSY_POLL_BUDGET = 64;    // packets per busy-poll round
+const size_t LOW_LATENCY_PREFAULT_STACK = 256 << 10;
+
+struct LowLatencyOptions {
+    std::vector<int> cpus;
+    int busy_poll_us = 0;
+    int spin_us = 0;
+    bool lock_memory = false;
+
+    bool enabled() const { return !cpus.empty() || busy_poll_us > 0 || spin_us > 0 || lock_memory; }
+};
+
+// Parses "--cpu", "--busy-poll", "--spin" and "--lock-memory".
+// Returns false if `flag` is not a low-latency option.
+inline bool parse_low_latency_option(const std::string& flag, const char* value, LowLatencyOptions& opts) {
+    if (flag == "--cpu") {
+        std::stringstream list(value);
+        std::string cpu;
+        while (std::getline(list, cpu, ',')) {
+            if (!cpu.empty()) {
+                opts.cpus.push_back(atoi(cpu.c_str()));
+            }
+        }
+    } else if (flag == "--busy-poll") {
+        opts.busy_poll_us = atoi(value);
+    } else if (flag == "--spin") {
+        opts.spin_us = atoi(value);
+    } else if (flag == "--lock-memory") {
+        opts.lock_memory = atoi(value) != 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Pins `thread` to `cpu`. Returns false (with a warning) on failure.
+inline bool pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err != 0) {
+        std::cerr << "Warning: cannot pin thread to CPU " << cpu << ": " << strerror(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// CPU for the `index`-th helper thread: the configured cores after the first,
+// round-robin (or the only one if just one was given). -1 if none configured.
+inline int helper_cpu(const LowLatencyOptions& opts, size_t index) {
+    if (opts.cpus.empty()) {
+        return -1;
+    }
+    if (opts.cpus.size() == 1) {
+        return opts.cpus[0];
+    }
+    return opts.cpus[1 + index % (opts.cpus.size() - 1)];
+}
+
+inline void enable_busy_poll(int sockfd, int busy_poll_us) {
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+        std::cerr << "Warning: SO_BUSY_POLL: " << strerror(errno) << std::endl;
+        return;
+    }
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0) {
+        std::cerr << "Warning: SO_PREFER_BUSY_POLL: " << strerror(errno) << std::endl; // before Linux 5.11
+    }
+    int budget = LOW_LATENCY_BUSY_POLL_BUDGET;
+    setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget));
+}
+
+// Touches `bytes` of stack so the pages are resident before the hot path runs.
+__attribute__((noinline)) inline void prefault_stack(size_t bytes) {
+    volatile char* area = (volatile char*)alloca(bytes);
+    for (size_t i = 0; i < bytes; i += 4096) {
+        area[i] = 0;
+    }
+}
+
+inline void lock_memory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        std::cerr << "Warning: mlockall: " << strerror(errno) << std::endl;
+    }
+    prefault_stack(LOW_LATENCY_PREFAULT_STACK);
+}
+
+// Applies the process / socket wide settings and pins the calling (receive)
+// thread to the first configured core.
+inline void apply_low_latency(int sockfd, const LowLatencyOptions& opts) {
+    if (!opts.cpus.empty()) {
+        pin_thread(pthread_self(), opts.cpus[0]);
+    }
+    if (opts.busy_poll_us > 0) {
+        enable_busy_poll(sockfd, opts.busy_poll_us);
+    }
+    if (opts.lock_memory) {
+        lock_memory();
+    }
+}
+
+// Spins for up to `spin_us` microseconds until `sockfd` is readable, without
+// sleeping. Returns true if it became readable; the caller then polls instead
+// of blocking.
+inline bool spin_until_readable(int sockfd, int spin_us) {
+    if (spin_us <= 0) {
+        return false;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    while (true) {
+        if (poll(&pfd, 1, 0) > 0) {
+            return true;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed_us = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+        if (elapsed_us >= spin_us) {
+            return false;
+        }
+    }
+}
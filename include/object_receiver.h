@@ -0,0 +1,125 @@
+#pragma once
+#include <stdint.h>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Receiving side of directory transfers (B/dir_client).
+//
+// Each item of a directory transfer is one session whose HELLO names the file
+// range it carries (HELLO_OPT_OBJECT, "path@offset+length", the path relative
+// to the sent directory). A server with a receive directory writes the in-order
+// DATA of such a session into that file under the directory, starting at the
+// offset. The items of one file arrive on different sessions, in any order and
+// possibly on different workers, and each writes only its own range (pwrite),
+// so the tree is rebuilt without coordination between sessions. A retried item
+// rewrites the same range. Files are created as needed but never truncated: an
+// existing, longer file keeps its tail.
+
+const char OBJECT_OFFSET_MARK = '@';
+const char OBJECT_LENGTH_MARK = '+';
+
+inline std::string format_object(const std::string& path, uint64_t offset, uint64_t length) {
+    return path + OBJECT_OFFSET_MARK + std::to_string(offset) + OBJECT_LENGTH_MARK + std::to_string(length);
+}
+
+// Splits "path@offset+length". The path is split off at the last '@', so it may
+// contain '@' itself.
+inline bool parse_object(const std::string& object, std::string& path, uint64_t& offset, uint64_t& length) {
+    size_t at = object.rfind(OBJECT_OFFSET_MARK);
+    if (at == std::string::npos || at == 0) {
+        return false;
+    }
+    size_t plus = object.find(OBJECT_LENGTH_MARK, at);
+    if (plus == std::string::npos || plus == at + 1 || plus + 1 == object.size()) {
+        return false;
+    }
+    char* end;
+    offset = strtoull(object.c_str() + at + 1, &end, 10);
+    if (end != object.c_str() + plus) {
+        return false;
+    }
+    length = strtoull(object.c_str() + plus + 1, &end, 10);
+    if (*end != '\0') {
+        return false;
+    }
+    path = object.substr(0, at);
+    return true;
+}
+
+// Whether a path sent by a client stays inside the receive directory: relative,
+// and without empty, "." or ".." components.
+inline bool valid_object_path(const std::string& path) {
+    if (path.empty() || path[0] == '/') {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t slash = path.find('/', start);
+        std::string part = path.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+        if (slash == std::string::npos) {
+            break;
+        }
+        start = slash + 1;
+    }
+    return true;
+}
+
+// One session's file range, written as its payloads are delivered in order.
+class ObjectWriter {
+private:
+    int fd = -1;
+    uint64_t offset = 0;    // where the next payload goes
+    uint64_t end = 0;
+
+public:
+    std::string path;       // as the client named it
+    bool failed = false;    // a write failed or went past the range
+
+    ~ObjectWriter() { close(); }
+
+    // Opens (creating it and its directories if needed) the file `object`
+    // names under `dir`. False if the object is malformed or can't be opened.
+    bool open(const std::string& dir, const std::string& object) {
+        uint64_t length;
+        if (!parse_object(object, path, offset, length) || !valid_object_path(path)) {
+            return false;
+        }
+        end = offset + length;
+        std::filesystem::path full = std::filesystem::path(dir) / path;
+        std::error_code ec;
+        std::filesystem::create_directories(full.parent_path(), ec);
+        fd = ::open(full.c_str(), O_WRONLY | O_CREAT, 0644);
+        return fd >= 0;
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    void write(const char* data, size_t len) {
+        if (fd < 0 || failed) {
+            return;
+        }
+        if (offset + len > end || pwrite(fd, data, len, offset) != (ssize_t)len) {
+            failed = true;
+            return;
+        }
+        offset += len;
+    }
+
+    // Whether the whole range was written.
+    bool complete() const { return !failed && offset == end; }
+
+    uint64_t remaining() const { return end - offset; }
+
+    void close() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
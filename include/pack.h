@@ -1,5 +1,8 @@
 #pragma once
 #include <string>
 #include "UAP_header.h"
+#include "compact_header.h"
 
 void pack(char* , const std::string& , uint8_t , int32_t , int32_t , int64_t , int64_t );
+// v2 header (compact_header.h) followed by the payload; returns the packet length. A timestamp of 0 is left out.
+size_t pack_compact(char* , const std::string& , uint8_t , int32_t , int32_t , int64_t , int64_t , CompactBase& );
@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+
+// Client-side send-rate control: a token bucket paces DATA at the current rate,
+// and an optional delay-based congestion controller moves that rate using the
+// ALIVE round-trip time (queueing delay) and NACK loss signals.
+
+const double PACER_DEFAULT_RATE = 1e6;          // bytes/s the controller starts from
+const double PACER_MIN_RATE = 16e3;             // bytes/s
+const double PACER_MAX_RATE = 1e9;              // bytes/s
+const int64_t PACER_BURST_US = 2000;            // bucket depth, in microseconds of sending at the current rate
+const size_t PACER_MIN_BURST = 4096;            // bytes, so single large packets can always go out
+const int64_t CC_TARGET_DELAY_US = 5000;        // tolerated queueing delay above the base RTT
+const int64_t CC_SPIN_NS = 50000;               // waits shorter than this spin instead of sleeping
+
+inline int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleeps until an absolute CLOCK_MONOTONIC deadline. clock_nanosleep has
+// microsecond-scale slack, so the last CC_SPIN_NS are spent spinning.
+inline void sleep_until_ns(int64_t deadline) {
+    int64_t now = monotonic_ns();
+    if (deadline - now > CC_SPIN_NS) {
+        int64_t wake = deadline - CC_SPIN_NS;
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    }
+    while (monotonic_ns() < deadline) {
+    }
+}
+
+class TokenBucket {
+private:
+    double rate;        // bytes per second
+    double tokens;      // bytes
+    int64_t last_refill_ns;
+
+    double burst() const {
+        return std::max((double)PACER_MIN_BURST, rate * PACER_BURST_US / 1e6);
+    }
+
+    void refill(int64_t now) {
+        tokens = std::min(burst(), tokens + rate * (now - last_refill_ns) / 1e9);
+        last_refill_ns = now;
+    }
+
+public:
+    explicit TokenBucket(double bytes_per_sec) : rate(bytes_per_sec), tokens(0), last_refill_ns(monotonic_ns()) {
+        tokens = burst();
+    }
+
+    void set_rate(double bytes_per_sec) {
+        refill(monotonic_ns());
+        rate = bytes_per_sec;
+    }
+
+    double get_rate() const { return rate; }
+
+    // Nanoseconds until `bytes` may be sent; 0 means now.
+    int64_t delay_ns(size_t bytes) {
+        int64_t now = monotonic_ns();
+        refill(now);
+        if (tokens >= bytes || tokens >= burst()) {
+            return 0;
+        }
+        return (int64_t)((bytes - tokens) * 1e9 / rate) + 1;
+    }
+
+    // Unpaced sends (retransmissions) may borrow at most one burst, so a NACK
+    // storm can't stall new data for seconds.
+    void consume(size_t bytes) {
+        tokens = std::max(-burst(), tokens - bytes);
+    }
+};
+
+// Rate-based delay controller in the spirit of LEDBAT: grow the rate while the
+// queueing delay (smoothed RTT minus base RTT) stays under the target, back off
+// in proportion to the excess, and cut multiplicatively on loss. Each
+// adjustment is applied at most once per smoothed RTT.
+class DelayBasedController {
+private:
+    double rate = PACER_DEFAULT_RATE;
+    int64_t base_rtt_us = 0;
+    int64_t srtt_us = 0;
+    int64_t last_update_ns = 0;
+    int64_t last_loss_ns = 0;
+
+    bool once_per_rtt(int64_t now, int64_t& last) {
+        if (now - last < std::max<int64_t>(srtt_us, 100) * 1000) {
+            return false;
+        }
+        last = now;
+        return true;
+    }
+
+public:
+    explicit DelayBasedController(double initial_rate = PACER_DEFAULT_RATE) : rate(initial_rate) {}
+
+    void on_rtt_sample(int64_t rtt_us) {
+        if (rtt_us <= 0) {
+            rtt_us = 1;
+        }
+        base_rtt_us = base_rtt_us == 0 ? rtt_us : std::min(base_rtt_us, rtt_us);
+        srtt_us = srtt_us == 0 ? rtt_us : (7 * srtt_us + rtt_us) / 8;
+
+        int64_t now = monotonic_ns();
+        if (!once_per_rtt(now, last_update_ns)) {
+            return;
+        }
+        int64_t queue_delay = srtt_us - base_rtt_us;
+        if (queue_delay <= CC_TARGET_DELAY_US) {
+            rate *= 1.0 + 0.25 * (1.0 - (double)queue_delay / CC_TARGET_DELAY_US);
+        } else {
+            rate *= std::max(0.5, 1.0 - 0.5 * (double)(queue_delay - CC_TARGET_DELAY_US) / queue_delay);
+        }
+        rate = std::clamp(rate, PACER_MIN_RATE, PACER_MAX_RATE);
+    }
+
+    void on_loss() {
+        if (once_per_rtt(monotonic_ns(), last_loss_ns)) {
+            rate = std::max(PACER_MIN_RATE, rate * 0.7);
+        }
+    }
+
+    double get_rate() const { return rate; }
+    int64_t get_srtt_us() const { return srtt_us; }
+    int64_t get_base_rtt_us() const { return base_rtt_us; }
+};
+
+// Token-bucket pacer optionally driven by the congestion controller.
+// A rate of 0 disables pacing entirely.
+class Pacer {
+private:
+    bool enabled;
+    bool adaptive;
+    TokenBucket bucket;
+    DelayBasedController controller;
+
+public:
+    // `fixed_rate` > 0 pins the rate; 0 with `adaptive` lets the controller choose it.
+    Pacer(double fixed_rate, bool adaptive_rate)
+        : enabled(fixed_rate > 0 || adaptive_rate), adaptive(adaptive_rate && fixed_rate <= 0),
+          bucket(fixed_rate > 0 ? fixed_rate : PACER_DEFAULT_RATE), controller(PACER_DEFAULT_RATE) {}
+
+    bool is_enabled() const { return enabled; }
+    bool is_adaptive() const { return adaptive; }
+
+    int64_t delay_ns(size_t bytes) {
+        return enabled ? bucket.delay_ns(bytes) : 0;
+    }
+
+    void on_sent(size_t bytes) {
+        if (enabled) {
+            bucket.consume(bytes);
+        }
+    }
+
+    void on_rtt_sample(int64_t rtt_us) {
+        if (adaptive) {
+            controller.on_rtt_sample(rtt_us);
+            bucket.set_rate(controller.get_rate());
+        }
+    }
+
+    void on_loss() {
+        if (adaptive) {
+            controller.on_loss();
+            bucket.set_rate(controller.get_rate());
+        }
+    }
+
+    double get_rate() const { return bucket.get_rate(); }
+    int64_t get_srtt_us() const { return controller.get_srtt_us(); }
+};
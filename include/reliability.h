@@ -0,0 +1,311 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+#include <chrono>
+#include <arpa/inet.h>
+#include "UAP_header.h"
+
+// Selective retransmission support shared by the clients and the servers.
+//
+// ALIVE payload: 4-byte big-endian cumulative ack, the highest sequence number
+//                the server has delivered in order. In delayed-ack mode it is
+//                followed by a 4-byte ack delay: microseconds the server held the
+//                ALIVE back, which the client subtracts from its RTT sample.
+// NACK payload:  list of missing [first, last] sequence ranges, each encoded as
+//                two big-endian int32 values.
+
+const size_t NACK_MAX_RANGES = 64;
+const size_t RETRANSMIT_WINDOW = 1024;          // max unacknowledged DATA packets in flight
+const int RETRANSMIT_MIN_INTERVAL_MS = 20;      // floor for the per-packet resend interval (otherwise ~RTT)
+const int RETRANSMIT_PROBE_MS = 250;            // resend newest unacked packet if no progress for this long
+const int ACK_MAX_EVERY = 64;                   // delayed acks: most DATA packets one ALIVE may cover
+const int ACK_DEFAULT_DELAY_MS = 10;            // delayed acks: longest an ALIVE is held back by default
+const int ACK_MAX_DELAY_MS = 100;               // well under RETRANSMIT_PROBE_MS
+
+typedef std::pair<int32_t, int32_t> SeqRange;
+
+inline std::string encode_ack(int32_t ack) {
+    int32_t net = htonl(ack);
+    return std::string((const char*)&net, sizeof(net));
+}
+
+inline std::string encode_ack(int32_t ack, uint32_t delay_us) {
+    uint32_t net = htonl(delay_us);
+    return encode_ack(ack) + std::string((const char*)&net, sizeof(net));
+}
+
+inline bool decode_ack(const char* payload, size_t len, int32_t& ack) {
+    if (len < sizeof(int32_t)) {
+        return false;
+    }
+    int32_t net;
+    memcpy(&net, payload, sizeof(net));
+    ack = ntohl(net);
+    return true;
+}
+
+// Ack delay of an ALIVE payload; 0 if the server sent the ALIVE immediately.
+inline uint32_t decode_ack_delay(const char* payload, size_t len) {
+    if (len < 2 * sizeof(int32_t)) {
+        return 0;
+    }
+    uint32_t net;
+    memcpy(&net, payload + sizeof(int32_t), sizeof(net));
+    return ntohl(net);
+}
+
+inline std::string encode_nack(const std::vector<SeqRange>& ranges) {
+    std::string payload;
+    for (size_t i = 0; i < ranges.size() && i < NACK_MAX_RANGES; i++) {
+        int32_t first = htonl(ranges[i].first);
+        int32_t last = htonl(ranges[i].second);
+        payload.append((const char*)&first, sizeof(first));
+        payload.append((const char*)&last, sizeof(last));
+    }
+    return payload;
+}
+
+inline bool decode_nack(const char* payload, size_t len, std::vector<SeqRange>& ranges) {
+    ranges.clear();
+    if (len % (2 * sizeof(int32_t)) != 0) {
+        return false;
+    }
+    for (size_t off = 0; off < len; off += 2 * sizeof(int32_t)) {
+        int32_t first, last;
+        memcpy(&first, payload + off, sizeof(first));
+        memcpy(&last, payload + off + sizeof(first), sizeof(last));
+        first = ntohl(first);
+        last = ntohl(last);
+        if (last < first) {
+            return false;
+        }
+        ranges.push_back({first, last});
+    }
+    return true;
+}
+
+// Server side: holds packets that arrived ahead of a gap until the gap is filled.
+template<typename T>
+class ReorderBuffer {
+private:
+    std::map<int32_t, T> held;
+public:
+    // Returns false if the sequence number is already held (duplicate).
+    bool hold(int32_t seq, const T& item) {
+        return held.emplace(seq, item).second;
+    }
+
+    bool contains(int32_t seq) const {
+        return held.count(seq) != 0;
+    }
+
+    // Removes and returns the packet with sequence number `seq` if it is held.
+    bool pop(int32_t seq, T& item) {
+        auto it = held.find(seq);
+        if (it == held.end()) {
+            return false;
+        }
+        item = it->second;
+        held.erase(it);
+        return true;
+    }
+
+    // Lowest held sequence number.
+    bool first(int32_t& seq) const {
+        if (held.empty()) {
+            return false;
+        }
+        seq = held.begin()->first;
+        return true;
+    }
+
+    // Missing ranges between `expected` and the highest held sequence number.
+    std::vector<SeqRange> missing(int32_t expected) const {
+        std::vector<SeqRange> ranges;
+        int32_t next = expected;
+        for (auto const& [seq, item] : held) {
+            if (seq > next) {
+                ranges.push_back({next, seq - 1});
+                if (ranges.size() >= NACK_MAX_RANGES) {
+                    break;
+                }
+            }
+            if (seq >= next) {
+                next = seq + 1;
+            }
+        }
+        return ranges;
+    }
+
+    size_t size() const { return held.size(); }
+    bool empty() const { return held.empty(); }
+    void clear() { held.clear(); }
+};
+
+// Server side: decides when to send the cumulative ALIVE. By default every DATA
+// is acknowledged at once; with delayed acks negotiated, one ALIVE covers up to
+// `every` in-order packets or whatever arrived within `delay_ms`, whichever comes
+// first. Gaps, duplicates and GOODBYE are still answered immediately.
+class AckScheduler {
+public:
+    typedef std::chrono::steady_clock clock;
+
+private:
+    int every = 1;
+    int delay_ms = 0;
+    int pending = 0;
+    clock::time_point first_pending;
+    clock::time_point last_pending;
+
+public:
+    // Clamps the client's request to what the server allows.
+    void configure(int ack_every, int ack_delay_ms) {
+        every = std::min(std::max(ack_every, 1), ACK_MAX_EVERY);
+        delay_ms = std::min(std::max(ack_delay_ms, 1), ACK_MAX_DELAY_MS);
+    }
+
+    bool delayed() const { return every > 1; }
+    int get_every() const { return every; }
+    int get_delay_ms() const { return delay_ms; }
+
+    // Records an in-order DATA packet; true if the ALIVE should go out now.
+    bool on_data() {
+        last_pending = clock::now();
+        if (pending++ == 0) {
+            first_pending = last_pending;
+        }
+        return pending >= every;
+    }
+
+    // True if acknowledged data is waiting and its deadline has passed.
+    bool due() const {
+        return pending > 0 && clock::now() - first_pending >= std::chrono::milliseconds(delay_ms);
+    }
+
+    // Milliseconds until due() (0 if already due), or -1 if nothing is pending.
+    int64_t ms_until_due() const {
+        if (pending == 0) {
+            return -1;
+        }
+        auto left = first_pending + std::chrono::milliseconds(delay_ms) - clock::now();
+        int64_t left_us = std::chrono::duration_cast<std::chrono::microseconds>(left).count();
+        return std::max<int64_t>(0, (left_us + 999) / 1000); // round up so the caller wakes after the deadline
+    }
+
+    // How long the newest acknowledged packet (the one the client takes its RTT
+    // sample from) has waited, for the ALIVE payload.
+    uint32_t held_us() const {
+        if (pending == 0) {
+            return 0;
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - last_pending).count();
+    }
+
+    void sent() { pending = 0; }
+};
+
+// Client side: keeps every DATA packet until the server acknowledges it, so that
+// only the sequence numbers reported in a NACK have to be sent again.
+class RetransmitBuffer {
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry {
+        std::vector<char> packet;
+        clock::time_point first_sent;
+        clock::time_point last_sent;
+        int transmissions;
+    };
+
+private:
+    std::map<int32_t, Entry> unacked;
+    clock::time_point last_progress = clock::now();
+    int64_t srtt_us = 0;
+
+public:
+    void store(int32_t seq, const char* packet, size_t len) {
+        auto now = clock::now();
+        unacked[seq] = {std::vector<char>(packet, packet + len), now, now, 1};
+        if (unacked.size() == 1) {
+            last_progress = now;
+        }
+    }
+
+    // Drops every packet up to and including `seq`. Returns how many were released.
+    size_t ack_through(int32_t seq) {
+        size_t released = 0;
+        auto it = unacked.begin();
+        while (it != unacked.end() && it->first <= seq) {
+            it = unacked.erase(it);
+            released++;
+        }
+        if (released > 0) {
+            last_progress = clock::now();
+        }
+        return released;
+    }
+
+    // Round-trip time of `seq` if it was transmitted only once (Karn's rule:
+    // an ack for a resent packet can't be matched to a transmission).
+    bool rtt_sample(int32_t seq, int64_t& rtt_us) const {
+        auto it = unacked.find(seq);
+        if (it == unacked.end() || it->second.transmissions != 1) {
+            return false;
+        }
+        rtt_us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - it->second.first_sent).count();
+        return true;
+    }
+
+    // Feeds the smoothed RTT used to space out resends of the same packet.
+    void on_rtt_sample(int64_t rtt_us) {
+        srtt_us = srtt_us == 0 ? rtt_us : (7 * srtt_us + rtt_us) / 8;
+    }
+
+    // Returns the packet to resend, or nullptr if it is no longer buffered or was
+    // resent within the last RTT (a NACK for it may still be in flight; resending
+    // again would only feed more duplicates and more NACKs). Marks the packet as
+    // resent and refreshes its timestamp.
+    Entry* take_for_resend(int32_t seq, int64_t timestamp) {
+        auto it = unacked.find(seq);
+        if (it == unacked.end()) {
+            return nullptr;
+        }
+        auto now = clock::now();
+        auto min_interval = std::max<std::chrono::microseconds>(std::chrono::milliseconds(RETRANSMIT_MIN_INTERVAL_MS),
+                                                                std::chrono::microseconds(srtt_us * 5 / 4));
+        if (it->second.transmissions > 1 && now - it->second.last_sent < min_interval) {
+            return nullptr;
+        }
+        it->second.last_sent = now;
+        it->second.transmissions++;
+        UAP_header* header = (UAP_header*)it->second.packet.data();
+        if (header->version == UAP_VERSION) {
+            header->timestamp = htonll(timestamp); // v2 deltas keep the original timestamp
+        }
+        return &it->second;
+    }
+
+    // True when unacked data exists but nothing has been acknowledged for a while;
+    // the caller should then resend the newest packet in case the tail was lost
+    // (the server answers it with a cumulative ALIVE or a NACK for the gaps).
+    bool probe_due() const {
+        return !unacked.empty() &&
+               clock::now() - last_progress >= std::chrono::milliseconds(RETRANSMIT_PROBE_MS);
+    }
+
+    void probe_sent() { last_progress = clock::now(); }
+
+    int32_t newest() const { return unacked.rbegin()->first; }
+    const Entry* find(int32_t seq) const {
+        auto it = unacked.find(seq);
+        return it == unacked.end() ? nullptr : &it->second;
+    }
+    size_t size() const { return unacked.size(); }
+    bool empty() const { return unacked.empty(); }
+    bool full() const { return unacked.size() >= RETRANSMIT_WINDOW; }
+};
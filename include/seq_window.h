@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+
+// Anti-replay style sliding window over received sequence numbers (after
+// RFC 6479). The bitmap is a ring of 64-bit words covering `width` sequence
+// numbers below the highest one seen, plus one spare word so that sliding only
+// ever clears whole words. Every operation is O(1) apart from clearing the words
+// skipped by a large jump, which is amortised over the packets that moved it.
+//
+// A sequence number is classified as
+//   SEQ_NEW        above everything seen so far; the window slides up to it
+//   SEQ_LATE       inside the window and not seen yet (reordered or retransmitted)
+//   SEQ_DUPLICATE  inside the window and already seen
+//   SEQ_TOO_OLD    below the window; it can no longer be told apart from a replay
+// Sequence numbers that slide out of the window without ever being seen are
+// counted as lost.
+//
+// Positions are kept relative to the initial sequence number (the HELLO's), so
+// the ring index is computed from a non-negative offset. Sequence numbers below
+// the initial one come straight off the wire and are SEQ_TOO_OLD without the
+// bitmap being looked at.
+
+const int SEQ_WINDOW_MIN = 64;
+const int SEQ_WINDOW_MAX = 1024;
+const int SEQ_WINDOW_DEFAULT = 1024;
+
+enum SeqStatus { SEQ_NEW, SEQ_LATE, SEQ_DUPLICATE, SEQ_TOO_OLD };
+
+class SequenceWindow {
+private:
+    static const int MAX_WORDS = SEQ_WINDOW_MAX / 64 + 1;
+
+    uint64_t bitmap[MAX_WORDS];
+    int64_t base;       // initial sequence number; positions are relative to it
+    uint64_t top;       // position of the highest sequence number seen
+    int width;          // sequence numbers tracked below and including `top`
+    int words;          // ring size in use: width / 64 + 1
+    uint64_t lost_count = 0;
+
+    int word_index(uint64_t pos) const { return (int)((pos >> 6) % (uint64_t)words); }
+
+public:
+    SequenceWindow() {
+        reset(0, SEQ_WINDOW_DEFAULT);
+    }
+
+    // `initial` is treated as seen (e.g. the HELLO), as is everything before it.
+    SequenceWindow(int32_t initial, int window_width) {
+        reset(initial, window_width);
+    }
+
+    void reset(int32_t initial, int window_width) {
+        if (window_width < SEQ_WINDOW_MIN) window_width = SEQ_WINDOW_MIN;
+        if (window_width > SEQ_WINDOW_MAX) window_width = SEQ_WINDOW_MAX;
+        width = window_width & ~63;
+        words = width / 64 + 1;
+        base = initial;
+        top = 0;
+        lost_count = 0;
+        // Position 0 and everything the ring holds before it count as seen
+        memset(bitmap, 0xff, sizeof(bitmap));
+        bitmap[0] = 1;
+    }
+
+    SeqStatus check(int32_t seq) const {
+        if (seq < base) {
+            return SEQ_TOO_OLD;
+        }
+        uint64_t pos = (uint64_t)(seq - base);
+        if (pos > top) {
+            return SEQ_NEW;
+        }
+        if (top - pos >= (uint64_t)width) {
+            return SEQ_TOO_OLD;
+        }
+        return (bitmap[word_index(pos)] >> (pos & 63)) & 1 ? SEQ_DUPLICATE : SEQ_LATE;
+    }
+
+    // Classifies `seq` and, if it is new or late, records it as seen.
+    SeqStatus update(int32_t seq) {
+        SeqStatus status = check(seq);
+        if (status != SEQ_NEW && status != SEQ_LATE) {
+            return status;
+        }
+        uint64_t pos = (uint64_t)(seq - base);
+        if (status == SEQ_NEW) {
+            uint64_t top_word = top >> 6;
+            uint64_t new_word = pos >> 6;
+            uint64_t steps = new_word - top_word;
+            if (steps >= (uint64_t)words) {
+                // Jumped past the whole window: everything tracked leaves it
+                for (int i = 0; i < words; i++) {
+                    lost_count += 64 - __builtin_popcountll(bitmap[i]);
+                    bitmap[i] = 0;
+                }
+                lost_count += (steps - words) * 64;
+            } else {
+                for (uint64_t w = top_word + 1; w <= new_word; w++) {
+                    uint64_t& word = bitmap[w % (uint64_t)words];
+                    lost_count += 64 - __builtin_popcountll(word);
+                    word = 0;
+                }
+            }
+            top = pos;
+        }
+        bitmap[word_index(pos)] |= 1ULL << (pos & 63);
+        return status;
+    }
+
+    int32_t highest() const { return (int32_t)(base + (int64_t)top); }
+    // Lowest sequence number still inside the window.
+    int32_t lowest() const { return (int32_t)(base + (int64_t)top - width + 1); }
+    int get_width() const { return width; }
+    uint64_t lost() const { return lost_count; }
+};
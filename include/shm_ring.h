@@ -0,0 +1,289 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Shared-memory delivery of received payloads to local consumer processes.
+//
+// The server (`--shm name`) creates a POSIX shared memory object "/uap-<name>"
+// holding a header page and a byte ring. Each payload delivered in order is
+// appended as one record; consumers map the same object and read the records
+// in place, without copies and without a system call per record.
+//
+// Layout: the header page (ShmRingHeader), then `capacity` bytes of ring. A
+// record is a ShmRecordHeader followed by the payload, padded to 8 bytes, and
+// never wraps: if it doesn't fit before the end of the ring, a PAD record fills
+// the rest and the record starts again at offset 0.
+//
+// Protocol: there is one writer (serialised by a mutex inside the server) and
+// any number of readers, which don't register and never hold the writer up.
+// `head` is the total number of bytes ever written; the writer fills a record
+// and then publishes it by storing the new head (release). A reader keeps its
+// own position, reads head (acquire) and walks the records up to it. The writer
+// overwrites old data freely, so a reader more than `capacity` bytes behind has
+// been lapped: it skips ahead to the current head and counts what it lost, and a
+// record it is reading in place must be checked with still_valid() before the
+// reader relies on what it read. As the writer overwrites before it publishes,
+// that check can't use head: like a seqlock, the writer first announces in
+// `write_end` where the record it is about to write (with its PAD) ends, and
+// the check compares against that.
+//
+// Wakeups: after publishing the writer bumps `notify` and calls FUTEX_WAKE, but
+// only if a reader announced itself in `waiters`; readers that have caught up
+// sleep in FUTEX_WAIT on `notify`.
+
+const char SHM_RING_MAGIC[8] = {'U', 'A', 'P', 'R', 'I', 'N', 'G', '1'};
+const uint32_t SHM_RING_VERSION = 2;
+const size_t SHM_RING_HEADER_SIZE = 4096;
+const size_t SHM_RING_DEFAULT_CAPACITY = 16 << 20;
+
+const uint16_t SHM_RECORD_PAD = 0;          // filler up to the end of the ring
+const uint16_t SHM_RECORD_DATA = 1;         // one payload, in sequence order within its session
+const uint16_t SHM_RECORD_SESSION_END = 2;  // the session closed; no payload
+
+struct ShmRingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;                      // ring bytes, a power of two
+    alignas(64) uint64_t head;              // bytes written so far
+    uint64_t write_end;                     // where the record being written ends; >= head
+    alignas(64) uint32_t notify;            // futex word, bumped on every publish
+    uint32_t waiters;                       // readers sleeping on `notify`
+};
+
+struct ShmRecordHeader {
+    uint32_t length;                        // payload bytes
+    uint16_t type;
+    uint16_t flags;
+    uint32_t session_id;
+    int32_t sequence_number;
+};
+
+inline size_t shm_record_size(size_t payload_len) {
+    return (sizeof(ShmRecordHeader) + payload_len + 7) & ~(size_t)7;
+}
+
+inline std::string shm_ring_path(const std::string& name) {
+    return "/uap-" + name;
+}
+
+inline long shm_futex(uint32_t* word, int op, uint32_t value, const struct timespec* timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, nullptr, 0);
+}
+
+class ShmRingWriter {
+private:
+    ShmRingHeader* header = nullptr;
+    char* ring = nullptr;
+    size_t map_size = 0;
+    std::string path;
+    std::mutex mtx;
+
+public:
+    uint64_t records = 0;
+
+    ~ShmRingWriter() { close(); }
+
+    // Creates (or replaces) the ring. `capacity` is rounded up to a power of two.
+    bool open(const std::string& name, size_t capacity = SHM_RING_DEFAULT_CAPACITY) {
+        size_t ring_size = 4096;
+        while (ring_size < capacity) {
+            ring_size <<= 1;
+        }
+        path = shm_ring_path(name);
+        shm_unlink(path.c_str());
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        map_size = SHM_RING_HEADER_SIZE + ring_size;
+        if (ftruncate(fd, map_size) < 0) {
+            ::close(fd);
+            shm_unlink(path.c_str());
+            return false;
+        }
+        void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            shm_unlink(path.c_str());
+            return false;
+        }
+        header = (ShmRingHeader*)map;
+        ring = (char*)map + SHM_RING_HEADER_SIZE;
+        header->version = SHM_RING_VERSION;
+        header->capacity = ring_size;
+        // Readers check the magic last
+        __atomic_store(&header->magic, &SHM_RING_MAGIC, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool is_open() const { return header != nullptr; }
+
+    // Appends one record and wakes sleeping readers. Thread-safe.
+    void publish(uint16_t type, uint32_t session_id, int32_t seq, const char* payload, size_t len) {
+        if (header == nullptr || shm_record_size(len) > header->capacity / 2) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        uint64_t head = header->head;
+        uint64_t mask = header->capacity - 1;
+        size_t size = shm_record_size(len);
+        size_t offset = head & mask;
+        bool wrap = offset + size > header->capacity;
+        // Announce the bytes about to be overwritten before touching them
+        __atomic_store_n(&header->write_end, head + (wrap ? header->capacity - offset : 0) + size, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (wrap) {
+            ShmRecordHeader pad = {(uint32_t)(header->capacity - offset - sizeof(ShmRecordHeader)), SHM_RECORD_PAD, 0, 0, 0};
+            memcpy(ring + offset, &pad, sizeof(pad));
+            head += header->capacity - offset;
+            offset = 0;
+        }
+        ShmRecordHeader rec = {(uint32_t)len, type, 0, session_id, seq};
+        memcpy(ring + offset, &rec, sizeof(rec));
+        memcpy(ring + offset + sizeof(rec), payload, len);
+        __atomic_store_n(&header->head, head + size, __ATOMIC_RELEASE);
+        records++;
+
+        __atomic_add_fetch(&header->notify, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0) {
+            shm_futex(&header->notify, FUTEX_WAKE, INT_MAX, nullptr);
+        }
+    }
+
+    void close() {
+        if (header != nullptr) {
+            munmap(header, map_size);
+            shm_unlink(path.c_str());
+            header = nullptr;
+        }
+    }
+};
+
+// A record as seen in place in the ring. `payload` points into shared memory.
+struct ShmRecord {
+    uint16_t type;
+    uint32_t session_id;
+    int32_t sequence_number;
+    const char* payload;
+    uint32_t length;
+    uint64_t position;                      // ring position the record started at
+};
+
+class ShmRingReader {
+private:
+    ShmRingHeader* header = nullptr;
+    const char* ring = nullptr;
+    size_t map_size = 0;
+    uint64_t position = 0;
+
+public:
+    uint64_t lost_bytes = 0;                // skipped after being lapped by the writer
+    uint64_t laps = 0;
+
+    ~ShmRingReader() { close(); }
+
+    // Maps the ring `name`. Reading starts at the current head, unless
+    // `from_start` asks for everything written so far (only possible while the
+    // ring hasn't wrapped yet).
+    bool open(const std::string& name, bool from_start = false) {
+        int fd = shm_open(shm_ring_path(name).c_str(), O_RDWR, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size <= SHM_RING_HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        map_size = st.st_size;
+        void* map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        header = (ShmRingHeader*)map;
+        ring = (const char*)map + SHM_RING_HEADER_SIZE;
+        char magic[8];
+        __atomic_load(&header->magic, &magic, __ATOMIC_ACQUIRE);
+        if (memcmp(magic, SHM_RING_MAGIC, sizeof(magic)) != 0 || header->version != SHM_RING_VERSION
+            || SHM_RING_HEADER_SIZE + header->capacity != map_size) {
+            close();
+            return false;
+        }
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        // Once the ring has wrapped the oldest record boundary is unknown
+        position = from_start && head <= header->capacity ? 0 : head;
+        return true;
+    }
+
+    // The next record, or false if the reader has caught up with the writer.
+    bool next(ShmRecord& rec) {
+        while (true) {
+            uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+            if (position == head) {
+                return false;
+            }
+            if (head - position > header->capacity) {
+                lost_bytes += head - position;
+                laps++;
+                position = head;
+                return false;
+            }
+            size_t offset = position & (header->capacity - 1);
+            ShmRecordHeader h;
+            memcpy(&h, ring + offset, sizeof(h));
+            uint64_t size = shm_record_size(h.length);
+            if (!still_valid(position) || offset + size > header->capacity) {
+                continue; // overwritten while reading the header: resynchronise above
+            }
+            rec.position = position;
+            position += size;
+            if (h.type == SHM_RECORD_PAD) {
+                continue;
+            }
+            rec.type = h.type;
+            rec.session_id = h.session_id;
+            rec.sequence_number = h.sequence_number;
+            rec.payload = ring + offset + sizeof(ShmRecordHeader);
+            rec.length = h.length;
+            return true;
+        }
+    }
+
+    // Whether a record read in place was still intact: call after using it.
+    // The fence keeps the reads of the record before the load of write_end.
+    bool still_valid(uint64_t record_position) const {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&header->write_end, __ATOMIC_RELAXED) - record_position <= header->capacity;
+    }
+    bool still_valid(const ShmRecord& rec) const { return still_valid(rec.position); }
+
+    // Sleeps until the writer publishes something new or `timeout_ms` passes.
+    void wait(int timeout_ms) {
+        uint32_t seen = __atomic_load_n(&header->notify, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == position) {
+            struct timespec ts = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000};
+            shm_futex(&header->notify, FUTEX_WAIT, seen, &ts);
+        }
+        __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    void close() {
+        if (header != nullptr) {
+            munmap(header, map_size);
+            header = nullptr;
+        }
+    }
+};
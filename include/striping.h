@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Striping one transfer over several UDP flows.
+//
+// A session is identified by its session id, not by its address, so a client
+// may send DATA for one session from several source ports (sub-flows). RSS and
+// SO_REUSEPORT hash each sub-flow separately, so with `--sockets N` on the
+// server they are received on different sockets and threads, and the session's
+// reorder buffer merges them back into one ordered stream. Replies still go to
+// the address the HELLO came from.
+//
+// Sub-flows overtake each other, so a gap in a striped session is only NACKed
+// once it has stayed open for STRIPE_REORDER_MS; the client announces striping
+// with HELLO_OPT_STRIPES for that reason.
+
+const int UAP_MAX_STRIPES = 16;                 // client source ports per session
+const int UAP_MAX_SERVER_SOCKETS = 16;          // server SO_REUSEPORT sockets
+const int STRIPE_REORDER_MS = 5;                // reordering tolerated before a NACK
+
+inline bool enable_reuseport(int sockfd) {
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        std::cerr << "Warning: SO_REUSEPORT: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Opens `count` UDP sockets bound to `addr` with SO_REUSEPORT (a plain socket
+// when count is 1). Returns an empty vector if the first bind fails; later
+// failures just leave fewer sockets.
+inline std::vector<int> open_reuseport_sockets(const struct sockaddr_in& addr, int count) {
+    std::vector<int> sockets;
+    for (int i = 0; i < count; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            break;
+        }
+        if ((count > 1 && !enable_reuseport(fd)) || bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            break;
+        }
+        sockets.push_back(fd);
+    }
+    return sockets;
+}
+
+// Client side: the primary socket plus `count - 1` extra sockets, each on its
+// own ephemeral source port.
+inline std::vector<int> open_stripe_sockets(int primary, int count) {
+    std::vector<int> sockets{primary};
+    for (int i = 1; i < count; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            break;
+        }
+        sockets.push_back(fd);
+    }
+    return sockets;
+}
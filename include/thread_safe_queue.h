@@ -0,0 +1,29 @@
+#pragma once
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+
+// Mutex-protected FIFO used to hand lines and packets between the A client's
+// threads.
+template<typename T>
+class ThreadSafeQueue {
+private:
+    std::queue<T> queue;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+public:
+    void push(T item) {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.push(item);
+        cv.notify_one();
+    }
+    bool try_pop(T& item) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (queue.empty()) {
+            return false;
+        }
+        item = queue.front();
+        queue.pop();
+        return true;
+    }
+};
@@ -0,0 +1,228 @@
+#pragma once
+#include <stdint.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <time.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+// Binary capture of incoming UAP datagrams, for replaying real traffic shapes.
+//
+// File layout (all integers little-endian, records packed back to back):
+//   header  8s "UAPTRACE", u32 version, u32 reserved, u64 capture start (unix ns)
+//   record  u64 arrival time (ns since capture start), u32 source IPv4 and
+//           u16 source port (both in network byte order, as in sockaddr_in),
+//           u16 datagram length, then the datagram bytes
+//
+// TraceWriter is called from the receive path: record() only appends to an
+// in-memory block; full blocks are handed to a background thread that writes
+// them out. If the disk can't keep up, whole blocks are dropped and counted
+// rather than stalling the server.
+
+const char TRACE_MAGIC[8] = {'U', 'A', 'P', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t TRACE_VERSION = 1;
+const size_t TRACE_HEADER_SIZE = 24;
+const size_t TRACE_RECORD_HEADER_SIZE = 16;
+const size_t TRACE_BLOCK_SIZE = 1 << 20;        // bytes buffered before a block goes to the writer thread
+const size_t TRACE_MAX_PENDING_BLOCKS = 64;     // blocks queued for the writer before dropping
+
+inline int64_t trace_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+class TraceWriter {
+private:
+    FILE* file = nullptr;
+    int64_t start_ns = 0;
+    std::vector<char> block;
+    std::deque<std::vector<char>> pending;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread writer;
+    bool stopping = false;
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return; // stopping and drained
+            }
+            std::vector<char> out = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            fwrite(out.data(), 1, out.size(), file);
+            lock.lock();
+        }
+    }
+
+    // Caller holds mtx.
+    void hand_off() {
+        if (block.empty()) {
+            return;
+        }
+        if (pending.size() >= TRACE_MAX_PENDING_BLOCKS) {
+            dropped_bytes += block.size();
+            block.clear();
+            return;
+        }
+        pending.push_back(std::move(block));
+        block = std::vector<char>();
+        block.reserve(TRACE_BLOCK_SIZE);
+        cv.notify_one();
+    }
+
+public:
+    std::atomic<uint64_t> records{0};
+    std::atomic<uint64_t> dropped_bytes{0};
+
+    ~TraceWriter() { close(); }
+
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        start_ns = trace_clock_ns(CLOCK_MONOTONIC);
+        char header[TRACE_HEADER_SIZE] = {};
+        memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        uint32_t version = htole32(TRACE_VERSION);
+        uint64_t wall_ns = htole64(trace_clock_ns(CLOCK_REALTIME));
+        memcpy(header + 8, &version, sizeof(version));
+        memcpy(header + 16, &wall_ns, sizeof(wall_ns));
+        fwrite(header, 1, sizeof(header), file);
+        block.reserve(TRACE_BLOCK_SIZE);
+        writer = std::thread(&TraceWriter::write_loop, this);
+        return true;
+    }
+
+    bool is_open() const { return file != nullptr; }
+
+    void record(const char* datagram, size_t len, const struct sockaddr_in& from) {
+        if (file == nullptr || len > UINT16_MAX) {
+            return;
+        }
+        char rec[TRACE_RECORD_HEADER_SIZE];
+        uint64_t offset = htole64(trace_clock_ns(CLOCK_MONOTONIC) - start_ns);
+        uint16_t length = htole16((uint16_t)len);
+        memcpy(rec, &offset, sizeof(offset));
+        memcpy(rec + 8, &from.sin_addr.s_addr, sizeof(uint32_t));
+        memcpy(rec + 12, &from.sin_port, sizeof(uint16_t));
+        memcpy(rec + 14, &length, sizeof(length));
+
+        std::lock_guard<std::mutex> lock(mtx);
+        block.insert(block.end(), rec, rec + sizeof(rec));
+        block.insert(block.end(), datagram, datagram + len);
+        records++;
+        if (block.size() >= TRACE_BLOCK_SIZE) {
+            hand_off();
+        }
+    }
+
+    // Flushes everything buffered and closes the file.
+    void close() {
+        if (file == nullptr) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            hand_off();
+            stopping = true;
+            cv.notify_one();
+        }
+        writer.join();
+        fclose(file);
+        file = nullptr;
+    }
+};
+
+struct TraceRecord {
+    uint64_t offset_ns;                 // arrival time since capture start
+    struct sockaddr_in from;
+    const char* data;
+    uint16_t len;
+};
+
+// Read-only, memory-mapped view of a trace file.
+class TraceReader {
+private:
+    const char* base = nullptr;
+    size_t size = 0;
+    size_t pos = TRACE_HEADER_SIZE;
+    int64_t wall_start_ns = 0;
+
+public:
+    ~TraceReader() {
+        if (base != nullptr) {
+            munmap((void*)base, size);
+        }
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < TRACE_HEADER_SIZE) {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        base = (const char*)map;
+        madvise(map, size, MADV_SEQUENTIAL);
+        uint32_t version;
+        uint64_t wall_ns;
+        memcpy(&version, base + 8, sizeof(version));
+        memcpy(&wall_ns, base + 16, sizeof(wall_ns));
+        wall_start_ns = le64toh(wall_ns);
+        return memcmp(base, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0 && le32toh(version) == TRACE_VERSION;
+    }
+
+    // Next record, or false at the end (a truncated final record is ignored).
+    bool next(TraceRecord& rec) {
+        if (pos + TRACE_RECORD_HEADER_SIZE > size) {
+            return false;
+        }
+        const char* p = base + pos;
+        uint32_t addr;
+        uint16_t port;
+        memcpy(&rec.offset_ns, p, sizeof(rec.offset_ns));
+        memcpy(&addr, p + 8, sizeof(addr));
+        memcpy(&port, p + 12, sizeof(port));
+        memcpy(&rec.len, p + 14, sizeof(rec.len));
+        rec.offset_ns = le64toh(rec.offset_ns);
+        rec.len = le16toh(rec.len);
+        if (pos + TRACE_RECORD_HEADER_SIZE + rec.len > size) {
+            return false;
+        }
+        memset(&rec.from, 0, sizeof(rec.from));
+        rec.from.sin_family = AF_INET;
+        rec.from.sin_addr.s_addr = addr;
+        rec.from.sin_port = port;
+        rec.data = p + TRACE_RECORD_HEADER_SIZE;
+        pos += TRACE_RECORD_HEADER_SIZE + rec.len;
+        return true;
+    }
+
+    void rewind() { pos = TRACE_HEADER_SIZE; }
+    int64_t get_wall_start_ns() const { return wall_start_ns; }
+};
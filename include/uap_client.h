@@ -0,0 +1,267 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <unordered_map>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <netinet/in.h>
+#include "UAP_header.h"
+#include "admission.h"
+#include "rate_control.h"
+
+// Embeddable asynchronous UAP client (C++20 coroutines).
+//
+// One UapLoop owns one UDP socket and multiplexes any number of sessions over
+// it by session id, on a single thread driven by epoll. Session operations are
+// awaitable and resume with true on success, false if the session failed:
+//
+//     UapTask<void> transfer(UapSession& s) {
+//         if (!co_await s.connect()) co_return;
+//         co_await s.send("hello");
+//         co_await s.close();
+//     }
+//
+//     UapLoop loop;
+//     loop.open("127.0.0.1", 8080);
+//     loop.spawn(transfer(loop.create_session()));
+//     loop.run();
+//
+// send() resumes as soon as the DATA is on the wire and only suspends while the
+// session's retransmit window is full; flush() waits for every DATA to be
+// acknowledged, close() flushes and then completes the GOODBYE exchange.
+// Lost DATA is recovered with the same NACK / tail-probe scheme as the clients.
+//
+// By default DATA goes out as fast as the windows allow. set_pacing() puts the
+// loop's sessions behind one shared Pacer, as the B client's: send() then also
+// waits for the pacer, and sessions with DATA waiting take turns, one packet
+// each, as its tokens come in.
+
+const int UAP_CLIENT_TICK_MS = 10;              // retransmission / timeout scan period
+const int UAP_CLIENT_HELLO_RETRY_MS = 1000;
+const int UAP_CLIENT_TIMEOUT_MS = 5000;         // same as the clients' RESPONSE_TIMEOUT_SECONDS
+
+class UapLoop;
+class UapSession;
+
+// Lazily started coroutine returning T; co_await runs it to completion.
+template<typename T>
+class UapTask {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        T value{};
+        std::coroutine_handle<> continuation;
+        UapTask get_return_object() { return UapTask(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    UapTask(UapTask&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    UapTask(const UapTask&) = delete;
+    ~UapTask() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() { return std::move(handle.promise().value); }
+
+private:
+    explicit UapTask(handle_type h) : handle(h) {}
+    handle_type handle;
+};
+
+template<>
+class UapTask<void> {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_type h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        UapTask get_return_object() { return UapTask(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        final_awaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    UapTask(UapTask&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    UapTask(const UapTask&) = delete;
+    ~UapTask() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    void await_resume() {}
+
+private:
+    explicit UapTask(handle_type h) : handle(h) {}
+    handle_type handle;
+};
+
+// Awaitable returned by the session operations; resumes with the result.
+class UapOperation {
+public:
+    enum Kind { CONNECT, SEND, FLUSH, CLOSE, SLEEP };
+
+    UapOperation(UapSession* session, Kind kind, std::string payload = "")
+        : session(session), loop(nullptr), kind(kind), payload(std::move(payload)) {}
+    UapOperation(UapLoop* loop, int64_t wake_ms) : session(nullptr), loop(loop), kind(SLEEP), wake_ms(wake_ms) {}
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() const { return result; }
+
+private:
+    friend class UapSession;
+    friend class UapLoop;
+    UapSession* session;
+    UapLoop* loop;
+    Kind kind;
+    std::string payload;
+    int64_t wake_ms = 0;
+    bool result = false;
+    std::coroutine_handle<> waiter;
+};
+
+class UapSession {
+public:
+    enum State { IDLE, HELLO_WAIT, READY, CLOSING, CLOSED };
+
+    UapOperation connect() { return UapOperation(this, UapOperation::CONNECT); }
+    UapOperation send(std::string payload) { return UapOperation(this, UapOperation::SEND, std::move(payload)); }
+    UapOperation flush() { return UapOperation(this, UapOperation::FLUSH); }
+    UapOperation close() { return UapOperation(this, UapOperation::CLOSE); }
+
+    // HELLO payload (encoded HelloOptions) for connect(); empty by default.
+    void set_hello_options(std::string options) { hello_options = std::move(options); }
+
+    int32_t id() const { return session_id; }
+    State state() const { return current_state; }
+    uint64_t bytes_sent() const { return payload_bytes; }
+
+private:
+    friend class UapLoop;
+    friend class UapOperation;
+
+    UapSession(UapLoop* loop, int32_t id) : loop(loop), session_id(id) {}
+
+    bool start(UapOperation* op);               // returns true if `op` completed synchronously
+    void transmit(uint8_t command, int32_t seq, const std::string& payload);
+    void resend(int32_t seq);
+    void on_packet(const UAP_header& header, const std::string& payload);
+    void on_tick(int64_t now_ms);
+    void wake(UapOperation* op, bool result);
+    void wake_senders();
+    bool may_send(const UapOperation* op);
+    void queue_for_pacing();
+    void fail(bool notify_server = true);
+
+    UapLoop* loop;
+    int32_t session_id;
+    int32_t sequence = 0;
+    int64_t logical_clock = 0;
+    State current_state = IDLE;
+    RetransmitBuffer retransmit_buffer;
+    uint64_t payload_bytes = 0;
+    std::string hello_options;
+
+    int64_t state_since_ms = 0;             // when the current handshake started
+    int64_t last_hello_ms = 0;
+    int64_t last_progress_ms = 0;           // last time the server answered
+    bool closing_after_flush = false;
+    bool pacing_queued = false;             // in the loop's `paced` queue
+
+    UapOperation* connect_op = nullptr;
+    UapOperation* flush_op = nullptr;
+    UapOperation* close_op = nullptr;
+    std::deque<UapOperation*> send_ops;     // waiting for retransmit window space
+};
+
+class UapLoop {
+public:
+    UapLoop();
+    ~UapLoop();
+
+    // Creates the shared socket for talking to host:port. Returns false on error.
+    bool open(const char* host, int port);
+
+    // New session with a random id, multiplexed over the loop's socket.
+    UapSession& create_session();
+
+    // Frees a session that is no longer used; late replies to it are ignored.
+    // Loops that go through many short sessions should release them as they end.
+    void release(UapSession& session);
+
+    // Runs `task` on the loop; the loop keeps going until every spawned task ends.
+    void spawn(UapTask<void> task);
+
+    // Drives I/O, timers and coroutines until all spawned tasks have finished.
+    void run();
+
+    UapOperation sleep(int ms);
+
+    size_t session_count() const { return sessions.size(); }
+
+    // `fixed_rate` > 0 paces at that many bytes/s; 0 with `adaptive` lets the
+    // delay-based controller find the rate. Both 0 / false turns pacing off.
+    void set_pacing(double fixed_rate, bool adaptive) { pacer = Pacer(fixed_rate, adaptive); }
+    double pacing_rate() const { return pacer.get_rate(); }
+
+private:
+    friend class UapSession;
+    friend class UapOperation;
+
+    struct Detached;
+    Detached run_detached(UapTask<void> task);
+
+    void schedule(std::coroutine_handle<> h) { ready.push_back(h); }
+    void add_timer(UapOperation* op) { timers.push({op->wake_ms, op}); }
+    void send_packet(const char* data, size_t len);
+    void receive();
+    void tick();
+    int64_t pace();
+
+    int sockfd = -1;
+    int epfd = -1;
+    sockaddr_in server_addr{};
+    std::unordered_map<int32_t, std::unique_ptr<UapSession>> sessions;
+    std::deque<std::coroutine_handle<>> ready;
+    typedef std::pair<int64_t, UapOperation*> TimerEntry;
+    std::priority_queue<TimerEntry, std::vector<TimerEntry>, std::greater<TimerEntry>> timers;
+    int64_t next_tick_ms = 0;
+    size_t active_tasks = 0;
+    Pacer pacer{0, false};
+    std::deque<UapSession*> paced;          // sessions whose DATA waits for the pacer, in turn
+};
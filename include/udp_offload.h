@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+// UDP segmentation offloads for bulk transfers.
+//
+// GSO (UDP_SEGMENT): the sender hands the kernel one buffer of back-to-back
+// equal-sized datagrams and a segment size; the buffer crosses the stack once and
+// is split at the bottom. Only the last segment may be shorter.
+//
+// GRO (UDP_GRO): the receiver may get several datagrams from the same flow
+// coalesced into one read, with the original segment size in a control message.
+// The caller splits the buffer back into datagrams before unPack.
+//
+// Both are probed at runtime; without kernel support (pre-4.18 / pre-5.0) sends
+// fall back to one sendto per datagram and reads are never coalesced.
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+const int UDP_OFFLOAD_MAX_SEGMENTS = 64;        // kernel UDP_MAX_SEGMENTS on older kernels
+const size_t UDP_OFFLOAD_MAX_BYTES = 65000;     // one GSO send must fit an IP datagram
+const size_t GRO_BUFFER_SIZE = 65536;           // room for a full coalesced read
+
+// True if the kernel accepts UDP_SEGMENT on this socket.
+inline bool gso_supported(int sockfd) {
+    int size = 0;
+    socklen_t len = sizeof(size);
+    return getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+// Asks the kernel to coalesce received datagrams. Returns false if unsupported.
+inline bool enable_gro(int sockfd) {
+    int on = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+// Sends `len` bytes of back-to-back datagrams of `segment_size` bytes (the last
+// may be shorter). Uses a single GSO sendmsg when `use_gso` is set and falls back
+// to one sendto per datagram, clearing `use_gso`, if the kernel refuses it.
+// Returns the number of bytes sent, or -1.
+inline ssize_t send_segments(int sockfd, const struct sockaddr_in& addr, const char* data, size_t len,
+                             uint16_t segment_size, bool& use_gso) {
+    if (use_gso && len > segment_size) {
+        struct iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = len;
+
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void*)&addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+
+        ssize_t sent = sendmsg(sockfd, &msg, 0);
+        if (sent >= 0 || (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT)) {
+            return sent;
+        }
+        use_gso = false; // e.g. the route's device can't segment; don't try again
+    }
+    size_t offset = 0;
+    while (offset < len) {
+        size_t n = len - offset < segment_size ? len - offset : segment_size;
+        if (sendto(sockfd, data + offset, n, 0, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            return offset > 0 ? (ssize_t)offset : -1;
+        }
+        offset += n;
+    }
+    return len;
+}
+
+// recvfrom() that also reports the GRO segment size. `segment_size` is the size
+// of each coalesced datagram, or the whole read if nothing was coalesced.
+inline ssize_t recv_coalesced(int sockfd, char* buffer, size_t len, struct sockaddr_in* from,
+                              size_t& segment_size, int flags = 0) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = from != nullptr ? sizeof(*from) : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(sockfd, &msg, flags);
+    segment_size = n > 0 ? n : 0;
+    if (n <= 0) {
+        return n;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            if (gso_size > 0 && gso_size < n) {
+                segment_size = gso_size;
+            }
+        }
+    }
+    return n;
+}
+
+// Calls f(datagram, length) for each datagram in a (possibly coalesced) read.
+template<typename F>
+inline void for_each_segment(const char* buffer, size_t len, size_t segment_size, F f) {
+    for (size_t offset = 0; offset < len; offset += segment_size) {
+        f(buffer + offset, len - offset < segment_size ? len - offset : segment_size);
+    }
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include <string>
 #include "UAP_header.h"
+#include "compact_header.h"
 
 bool unPack(const char* , int , UAP_header& , std::string&);
+// Accepts v1 and v2 packets; `base` is the sender's v2 base.
+bool unPack(const char* , int , UAP_header& , std::string& , CompactBase& );
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+// Work-stealing pool of work items, one deque per worker thread.
+//
+// A worker takes its own items from the back of its deque, so the items it
+// pushed last (and whose data is likely still cached) go first, and only when
+// its deque is empty does it steal from the front of the others', starting with
+// its right-hand neighbour. Thieves take the oldest items, which keeps them away
+// from the owner's end and, when one file's items were all queued on one
+// worker, spreads that file over everyone. Each deque has its own mutex: the
+// owner's pops and rare steals are the only contention.
+//
+// Items may be pushed again while the pool is running (a retried item); a
+// worker is finished once pop() fails and no items are in flight, which
+// remaining() tells.
+
+template<typename T>
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::mutex mtx;
+        std::deque<T> items;
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> pending{0};     // pushed and not yet finished
+
+public:
+    std::atomic<uint64_t> steals{0};
+
+    explicit WorkStealingPool(size_t workers) {
+        for (size_t i = 0; i < workers; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+    }
+
+    size_t workers() const { return queues.size(); }
+
+    void push(size_t worker, T item) {
+        Queue& q = *queues[worker % queues.size()];
+        pending++;
+        std::lock_guard<std::mutex> lock(q.mtx);
+        q.items.push_back(std::move(item));
+    }
+
+    // Next item for `worker`: its own newest, else the oldest it can steal.
+    bool pop(size_t worker, T& item) {
+        Queue& own = *queues[worker];
+        {
+            std::lock_guard<std::mutex> lock(own.mtx);
+            if (!own.items.empty()) {
+                item = std::move(own.items.back());
+                own.items.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& victim = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mtx);
+            if (!victim.items.empty()) {
+                item = std::move(victim.items.front());
+                victim.items.pop_front();
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Called once per popped item when it is done with (or has been pushed again).
+    void finish() { pending--; }
+
+    // Items queued or in flight; zero once the whole job is done.
+    size_t remaining() const { return pending.load(); }
+};
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include <cstdlib>
+#include <csignal>
+#include <chrono>
+#include "../include/shm_ring.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Reads the payloads a server publishes with `--shm name` from shared memory.
+//
+// Records are read in place, without copying them out of the ring and without a
+// system call while there is data; the consumer only sleeps on the ring's futex
+// once it has caught up. Each record is printed like the servers print it, or,
+// with --quiet 1, only counted. Ends on Ctrl-C, or after --sessions sessions
+// have finished, and reports what it read and what it lost to being lapped.
+
+const int CONSUME_WAIT_MS = 100;
+
+volatile sig_atomic_t quit_flag = 0;
+
+void on_signal(int) {
+    quit_flag = 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        cerr << "Usage: " << argv[0] << " <name> [--quiet 0|1] [--sessions N, stop after N sessions ended] [--from-start 0|1]" << endl;
+        return 1;
+    }
+    bool quiet = false;
+    bool from_start = false;
+    int stop_after = 0;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--quiet") {
+            quiet = atoi(argv[i + 1]) != 0;
+        } else if (string(argv[i]) == "--sessions") {
+            stop_after = atoi(argv[i + 1]);
+        } else if (string(argv[i]) == "--from-start") {
+            from_start = atoi(argv[i + 1]) != 0;
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    ShmRingReader ring;
+    if (!ring.open(argv[1], from_start)) {
+        cerr << "Cannot open shared memory ring " << argv[1] << " (is the server running with --shm?)" << endl;
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    uint64_t records = 0, bytes = 0, torn = 0;
+    map<uint32_t, int32_t> next_seq;    // per session, to count gaps in what we saw
+    uint64_t gaps = 0;
+    int sessions_ended = 0;
+    auto start = steady_clock::now();
+    ShmRecord rec;
+    while (!quit_flag && (stop_after == 0 || sessions_ended < stop_after)) {
+        if (!ring.next(rec)) {
+            ring.wait(CONSUME_WAIT_MS);
+            continue;
+        }
+        if (rec.type == SHM_RECORD_SESSION_END) {
+            next_seq.erase(rec.session_id);
+            sessions_ended++;
+            if (!quiet) {
+                cout << rec.session_id << " Session ended" << endl;
+            }
+            continue;
+        }
+        if (rec.type != SHM_RECORD_DATA) {
+            continue;
+        }
+        if (!quiet) {
+            cout << rec.session_id << " [" << rec.sequence_number << "] ";
+            cout.write(rec.payload, rec.length);
+            cout << '\n';
+        }
+        // The writer may have lapped us while we used the payload
+        if (!ring.still_valid(rec)) {
+            torn++;
+            continue;
+        }
+        auto seen = next_seq.find(rec.session_id);
+        if (seen != next_seq.end() && seen->second != rec.sequence_number) {
+            gaps++;
+        }
+        next_seq[rec.session_id] = rec.sequence_number + 1;
+        records++;
+        bytes += rec.length;
+    }
+
+    double seconds = duration<double>(steady_clock::now() - start).count();
+    cout << flush;
+    cerr << "Read " << records << " records, " << bytes << " bytes in " << seconds << " s ("
+         << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s), " << sessions_ended << " sessions ended" << endl;
+    cerr << "Lapped " << ring.laps << " times (" << ring.lost_bytes << " bytes lost), "
+         << torn << " records overwritten while read, " << gaps << " sequence gaps" << endl;
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <memory>
+#include <queue>
+#include <vector>
+#include <random>
+#include <utility>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/UAP_header.h"
+#include "../include/rate_control.h"
+#include "../include/compact_header.h"
+
+using namespace std;
+
+// UDP proxy that impairs the traffic between UAP clients and a server.
+//
+// Clients send to the proxy's port instead of the server's. Every client
+// address gets its own socket towards the server, so the server still sees
+// each client (and each stripe) as a separate source, and replies go back the
+// way they came. Each datagram, in either direction, goes through:
+//
+//   burst loss   a two-state (Gilbert-Elliott) chain: --burst-loss % of the
+//                packets in the good state start a burst, in which every packet
+//                is lost; bursts last --burst-len packets on average
+//   loss         --loss % of the remaining packets are dropped at random
+//   bandwidth    --rate bytes/s serialises packets onto the link; a packet that
+//                would find more than --queue bytes waiting ahead of it is
+//                dropped from the tail, like a router buffer
+//   delay        --delay ms plus up to --jitter ms either way; jitter alone
+//                never reorders packets
+//   reordering   --reorder % of the packets are held back --reorder-delay ms
+//                more, so the ones behind them overtake
+//   duplication  --dup % of the packets are delivered twice
+//
+// --direction limits this to client->server ("up") or server->client ("down").
+// Each direction draws from its own generator seeded from --seed, and every
+// packet uses the same number of draws whatever the settings, so a run with the
+// same seed and the same traffic makes the same decisions, and turning one
+// impairment on doesn't change where another strikes. --log writes one CSV line
+// per datagram with what was done to it. Runs until Ctrl-C, then prints what it
+// did in each direction.
+
+const int IMPAIR_MAX_WAIT_MS = 100;
+const int IMPAIR_RECV_BATCH = 64;               // datagrams read from one socket per wakeup
+const size_t IMPAIR_DEFAULT_QUEUE = 256 << 10;  // bytes
+
+struct Settings {
+    double delay_ms = 0;
+    double jitter_ms = 0;
+    double loss = 0;                // fractions, from the percentages given
+    double burst_loss = 0;
+    double burst_len = 4;
+    double reorder = 0;
+    double reorder_delay_ms = 10;
+    double dup = 0;
+    double rate = 0;                // bytes/s, 0 = unlimited
+    size_t queue = IMPAIR_DEFAULT_QUEUE;
+};
+
+// One direction of the link.
+struct Link {
+    const char* name;
+    bool impaired = true;
+    mt19937_64 rng{};               // seeded in main
+    bool in_burst = false;
+    int64_t link_free_ns = 0;       // when the bandwidth limiter is done with what it has
+    int64_t last_release_ns = 0;    // latest release so far, to keep jitter from reordering
+
+    uint64_t packets = 0, bytes = 0, forwarded = 0, lost = 0, burst_lost = 0, queue_dropped = 0;
+    uint64_t reordered = 0, duplicated = 0;
+    int64_t delay_sum_ns = 0;
+};
+
+struct Flow {
+    sockaddr_in client;
+    int upstream_fd;
+    CompactBase client_base{};      // to decode the client's v2 headers for the log
+    CompactBase server_base{};
+};
+
+struct Pending {
+    int64_t release_ns;
+    uint64_t order;                 // arrival order among packets released at the same time
+    int fd;
+    sockaddr_in to;
+    string data;
+
+    bool operator>(const Pending& other) const {
+        return release_ns != other.release_ns ? release_ns > other.release_ns : order > other.order;
+    }
+};
+
+Settings settings;
+Link up_link{"client->server"}, down_link{"server->client"};
+int listen_fd, epfd;
+sockaddr_in server_addr;
+map<pair<uint32_t, uint16_t>, unique_ptr<Flow>> flows;
+priority_queue<Pending, vector<Pending>, greater<Pending>> pending;
+uint64_t arrivals = 0;
+FILE* log_file = nullptr;
+int64_t start_ns;
+
+volatile sig_atomic_t quit_flag = 0;
+
+void on_signal(int) {
+    quit_flag = 1;
+}
+
+const char* command_name(uint8_t command) {
+    static const char* names[] = {"HELLO", "DATA", "ALIVE", "GOODBYE", "NACK", "BUSY", "MANIFEST", "NEED", "CHUNK"};
+    return command <= UAP_COMMAND_CHUNK ? names[command] : "?";
+}
+
+// Decides the fate of one datagram. Returns false if it is dropped; otherwise
+// `release` is when it goes out and `duplicate` asks for a second copy.
+bool impair(Link& link, size_t len, int64_t now, int64_t& release, bool& duplicate, const char*& action) {
+    uniform_real_distribution<double> chance(0.0, 1.0);
+    double burst_draw = chance(link.rng), loss_draw = chance(link.rng), jitter_draw = chance(link.rng);
+    double reorder_draw = chance(link.rng), dup_draw = chance(link.rng);
+
+    release = now;
+    duplicate = false;
+    action = "pass";
+    if (!link.impaired) {
+        return true;
+    }
+
+    if (settings.burst_loss > 0) {
+        if (link.in_burst) {
+            link.in_burst = burst_draw >= 1.0 / max(1.0, settings.burst_len);
+        } else {
+            link.in_burst = burst_draw < settings.burst_loss;
+        }
+        if (link.in_burst) {
+            link.burst_lost++;
+            action = "burst-loss";
+            return false;
+        }
+    }
+    if (loss_draw < settings.loss) {
+        link.lost++;
+        action = "loss";
+        return false;
+    }
+
+    int64_t depart = now;
+    if (settings.rate > 0) {
+        int64_t begin = max(now, link.link_free_ns);
+        if ((begin - now) * settings.rate / 1e9 > settings.queue) {
+            link.queue_dropped++;
+            action = "queue-drop";
+            return false;
+        }
+        link.link_free_ns = begin + (int64_t)(len * 1e9 / settings.rate);
+        depart = link.link_free_ns;
+    }
+
+    double delay_ms = settings.delay_ms + settings.jitter_ms * (2 * jitter_draw - 1);
+    release = max(depart + (int64_t)(max(0.0, delay_ms) * 1e6), link.last_release_ns);
+    link.last_release_ns = release;
+    if (reorder_draw < settings.reorder) {
+        release += (int64_t)(settings.reorder_delay_ms * 1e6);
+        link.reordered++;
+        action = "reorder";
+    }
+    if (dup_draw < settings.dup) {
+        duplicate = true;
+        link.duplicated++;
+        action = reorder_draw < settings.reorder ? "reorder+duplicate" : "duplicate";
+    }
+    return true;
+}
+
+// `header` is only valid if `decoded`: the datagram may not be UAP at all.
+void log_packet(const Link& link, const Flow& flow, size_t len, bool decoded, const UAP_header& header,
+                int64_t now, const char* action, int64_t delay_ns) {
+    if (log_file == nullptr) {
+        return;
+    }
+    fprintf(log_file, "%lld,%s,%u,%zu,%s,%u,%d,%s,%lld\n", (long long)(now - start_ns) / 1000,
+            &link == &up_link ? "up" : "down", ntohs(flow.client.sin_port), len,
+            decoded ? command_name(header.command) : "?", decoded ? (uint32_t)header.session_id : 0,
+            decoded ? header.sequence_number : 0, action, delay_ns < 0 ? -1LL : (long long)delay_ns / 1000);
+}
+
+// Runs one datagram arriving on `link` through the impairments and queues what survives.
+void forward(Link& link, Flow& flow, const char* data, size_t len, int fd, const sockaddr_in& to) {
+    int64_t now = monotonic_ns();
+    // v2 headers are deltas against the HELLO bases; follow them before they change
+    UAP_header header;
+    size_t header_len;
+    CompactBase& base = &link == &up_link ? flow.client_base : flow.server_base;
+    bool decoded = decode_header(data, len, header, header_len, base);
+    if (decoded && header.command == UAP_COMMAND_HELLO) {
+        base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+    }
+
+    link.packets++;
+    link.bytes += len;
+    int64_t release;
+    bool duplicate;
+    const char* action;
+    if (!impair(link, len, now, release, duplicate, action)) {
+        log_packet(link, flow, len, decoded, header, now, action, -1);
+        return;
+    }
+    log_packet(link, flow, len, decoded, header, now, action, release - now);
+    link.forwarded++;
+    link.delay_sum_ns += release - now;
+    pending.push({release, arrivals++, fd, to, string(data, len)});
+    if (duplicate) {
+        pending.push({release, arrivals++, fd, to, string(data, len)});
+    }
+}
+
+Flow& flow_for(const sockaddr_in& client) {
+    auto key = make_pair((uint32_t)client.sin_addr.s_addr, (uint16_t)client.sin_port);
+    auto it = flows.find(key);
+    if (it != flows.end()) {
+        return *it->second;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    Flow* flow = new Flow{client, fd};
+    flows[key].reset(flow);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = flow;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return *flow;
+}
+
+void release_due() {
+    int64_t now = monotonic_ns();
+    while (!pending.empty() && pending.top().release_ns <= now) {
+        const Pending& p = pending.top();
+        sendto(p.fd, p.data.data(), p.data.size(), 0, (const struct sockaddr*)&p.to, sizeof(p.to));
+        pending.pop();
+    }
+}
+
+void print_link(const Link& link) {
+    cout << link.name << ": " << link.packets << " datagrams (" << link.bytes << " bytes), " << link.forwarded << " forwarded, "
+         << link.lost << " lost, " << link.burst_lost << " lost in bursts, " << link.queue_dropped << " dropped by the queue, "
+         << link.reordered << " reordered, " << link.duplicated << " duplicated; added delay "
+         << fixed << setprecision(2) << (link.forwarded ? link.delay_sum_ns / 1e6 / link.forwarded : 0.0) << " ms on average"
+         << defaultfloat << setprecision(6) << endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc % 2 != 0) {
+        cerr << "Usage: " << argv[0] << " <listen port> <server host> <server port> [--delay ms] [--jitter ms] [--loss %]"
+             << " [--burst-loss %] [--burst-len packets] [--reorder %] [--reorder-delay ms] [--dup %] [--rate bytes/s]"
+             << " [--queue bytes] [--direction both|up|down] [--seed N] [--log file.csv]" << endl;
+        return 1;
+    }
+    uint64_t seed = 1;
+    string direction = "both";
+    for (int i = 4; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        double value = atof(argv[i + 1]);
+        if (option == "--delay") {
+            settings.delay_ms = value;
+        } else if (option == "--jitter") {
+            settings.jitter_ms = value;
+        } else if (option == "--loss") {
+            settings.loss = value / 100;
+        } else if (option == "--burst-loss") {
+            settings.burst_loss = value / 100;
+        } else if (option == "--burst-len") {
+            settings.burst_len = value;
+        } else if (option == "--reorder") {
+            settings.reorder = value / 100;
+        } else if (option == "--reorder-delay") {
+            settings.reorder_delay_ms = value;
+        } else if (option == "--dup") {
+            settings.dup = value / 100;
+        } else if (option == "--rate") {
+            settings.rate = value;
+        } else if (option == "--queue") {
+            settings.queue = (size_t)value;
+        } else if (option == "--direction") {
+            direction = argv[i + 1];
+        } else if (option == "--seed") {
+            seed = strtoull(argv[i + 1], nullptr, 10);
+        } else if (option == "--log") {
+            log_file = fopen(argv[i + 1], "w");
+            if (log_file == nullptr) {
+                cerr << "Cannot write log " << argv[i + 1] << endl;
+                return 1;
+            }
+            setvbuf(log_file, nullptr, _IOFBF, 1 << 20);
+            fprintf(log_file, "time_us,direction,client_port,bytes,command,session,seq,action,delay_us\n");
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+    if (direction != "both" && direction != "up" && direction != "down") {
+        cerr << "--direction must be both, up or down" << endl;
+        return 1;
+    }
+    up_link.impaired = direction != "down";
+    down_link.impaired = direction != "up";
+    up_link.rng.seed(seed);
+    down_link.rng.seed(seed ^ 0x9e3779b97f4a7c15ULL);
+
+    struct hostent* server = gethostbyname(argv[2]);
+    if (server == NULL) {
+        cerr << "ERROR, no such host" << endl;
+        return 1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    server_addr.sin_port = htons(atoi(argv[3]));
+
+    listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(atoi(argv[1]));
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) {
+        cout << "Bind failed" << endl;
+        return 1;
+    }
+    int buffer_size = 4 << 20;
+    setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    epfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    cout << "Forwarding port " << argv[1] << " to " << argv[2] << ":" << argv[3] << " (impairing " << direction
+         << ", seed " << seed << ")" << endl;
+
+    start_ns = monotonic_ns();
+    struct epoll_event events[16];
+    char buffer[65536];
+    while (!quit_flag) {
+        int timeout = IMPAIR_MAX_WAIT_MS;
+        if (!pending.empty()) {
+            int64_t wait_ns = pending.top().release_ns - monotonic_ns();
+            timeout = (int)min<int64_t>(IMPAIR_MAX_WAIT_MS, max<int64_t>(0, (wait_ns + 999999) / 1000000));
+        }
+        int n = epoll_wait(epfd, events, 16, timeout);
+        for (int i = 0; i < n; i++) {
+            Flow* flow = (Flow*)events[i].data.ptr;
+            for (int count = 0; count < IMPAIR_RECV_BATCH; count++) {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                int fd = flow == nullptr ? listen_fd : flow->upstream_fd;
+                ssize_t len = recvfrom(fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &from_len);
+                if (len < 0) {
+                    break;
+                }
+                if (flow == nullptr) {
+                    Flow& client_flow = flow_for(from);
+                    forward(up_link, client_flow, buffer, len, client_flow.upstream_fd, server_addr);
+                } else {
+                    forward(down_link, *flow, buffer, len, listen_fd, flow->client);
+                }
+            }
+        }
+        release_due();
+    }
+
+    cout << "Proxied " << flows.size() << " client addresses for " << fixed << setprecision(1)
+         << (monotonic_ns() - start_ns) / 1e9 << " s" << defaultfloat << setprecision(6) << endl;
+    print_link(up_link);
+    print_link(down_link);
+    if (log_file != nullptr) {
+        fclose(log_file);
+    }
+    for (auto& [key, flow] : flows) {
+        close(flow->upstream_fd);
+    }
+    close(listen_fd);
+    close(epfd);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/UAP_header.h"
+#include "../include/reliability.h"
+#include "../include/rate_control.h"
+#include "../include/latency_histogram.h"
+#include "../include/trace_file.h"
+#include "../include/compact_header.h"
+
+using namespace std;
+
+// Replays a trace captured with `server --capture` against a server.
+//
+// Every source address in the trace gets its own socket, so the server sees as
+// many distinct clients as were captured. Datagrams are sent byte for byte,
+// either at the recorded timing (scaled by --speed) or, with --speed 0, as fast
+// as possible. Replies are read on the fly: DATA -> ALIVE times are matched on
+// (session, cumulative ack) and reported as a latency histogram. v2 headers are
+// decoded against the HELLO bases seen in each direction.
+
+const int REPLAY_DRAIN_QUIET_MS = 500;          // stop waiting for replies after this much silence
+const int REPLAY_DRAIN_MAX_MS = 5000;
+
+struct ReplaySource {
+    int fd;
+    CompactBase client_base;    // the recorded client's HELLO
+    CompactBase server_base;    // the server's HELLO reply
+};
+
+int epfd;
+map<pair<uint32_t, uint16_t>, ReplaySource> source_sockets;
+unordered_map<uint64_t, int64_t> data_sent_ns;  // (session << 32 | seq) -> send time
+LatencyHistogram round_trips;
+uint64_t replies[UAP_COMMAND_CHUNK + 1] = {};
+uint64_t other_replies = 0;
+
+uint64_t data_key(uint32_t session_id, uint32_t seq) {
+    return ((uint64_t)session_id << 32) | seq;
+}
+
+ReplaySource& source_for(const struct sockaddr_in& from) {
+    auto key = make_pair((uint32_t)from.sin_addr.s_addr, (uint16_t)from.sin_port);
+    auto it = source_sockets.find(key);
+    if (it != source_sockets.end()) {
+        return it->second;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    ReplaySource& source = source_sockets[key];
+    source.fd = fd;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &source;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return source;
+}
+
+// Reads every reply available within `timeout_ms`. Returns how many were read.
+int drain_replies(int timeout_ms) {
+    struct epoll_event events[64];
+    int n = epoll_wait(epfd, events, 64, timeout_ms);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        ReplaySource& source = *(ReplaySource*)events[i].data.ptr;
+        char buffer[2048];
+        ssize_t len;
+        while ((len = recv(source.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0) {
+            int64_t now = monotonic_ns();
+            count++;
+            UAP_header header;
+            size_t header_len;
+            if (!decode_header(buffer, len, header, header_len, source.server_base)) {
+                other_replies++;
+                continue;
+            }
+            if (header.command == UAP_COMMAND_HELLO) {
+                source.server_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+            }
+            if (header.command <= UAP_COMMAND_CHUNK) {
+                replies[header.command]++;
+            } else {
+                other_replies++;
+            }
+            int32_t ack;
+            if (header.command == UAP_COMMAND_ALIVE && decode_ack(buffer + header_len, len - header_len, ack)) {
+                auto it = data_sent_ns.find(data_key(header.session_id, ack));
+                if (it != data_sent_ns.end()) {
+                    round_trips.record((now - it->second) / 1000);
+                    data_sent_ns.erase(it);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc % 2 != 0) {
+        cerr << "Usage: " << argv[0] << " <trace> <hostname> <port> [--speed factor, 1 = recorded timing, 0 = as fast as possible]" << endl;
+        return 1;
+    }
+    double speed = 1.0;
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (string(argv[i]) == "--speed") {
+            speed = atof(argv[i + 1]);
+        } else {
+            cerr << "Unknown option " << argv[i] << endl;
+            return 1;
+        }
+    }
+
+    TraceReader trace;
+    if (!trace.open(argv[1])) {
+        cerr << "Cannot read trace " << argv[1] << endl;
+        return 1;
+    }
+
+    struct hostent* server = gethostbyname(argv[2]);
+    if (server == NULL) {
+        cerr << "ERROR, no such host" << endl;
+        return 1;
+    }
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    serv_addr.sin_port = htons(atoi(argv[3]));
+
+    epfd = epoll_create1(0);
+
+    uint64_t sent = 0, sent_bytes = 0;
+    TraceRecord rec;
+    bool first = true;
+    uint64_t first_offset = 0;
+    int64_t start = monotonic_ns();
+    while (trace.next(rec)) {
+        if (first) {
+            first_offset = rec.offset_ns;
+            first = false;
+        }
+        if (speed > 0) {
+            int64_t due = start + (int64_t)((rec.offset_ns - first_offset) / speed);
+            // Serve replies while waiting; only the last stretch is slept precisely
+            while (due - monotonic_ns() > 2000000) {
+                drain_replies((due - monotonic_ns()) / 1000000 - 1);
+            }
+            sleep_until_ns(due);
+        } else if (sent % 32 == 0) {
+            drain_replies(0);
+        }
+
+        ReplaySource& source = source_for(rec.from);
+        int64_t now = monotonic_ns();
+        if (sendto(source.fd, rec.data, rec.len, 0, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+            perror("sendto");
+            continue;
+        }
+        sent++;
+        sent_bytes += rec.len;
+
+        UAP_header header;
+        size_t header_len;
+        if (decode_header(rec.data, rec.len, header, header_len, source.client_base)) {
+            if (header.command == UAP_COMMAND_HELLO) {
+                source.client_base.reset(header.sequence_number, header.logical_clock, header.timestamp);
+            } else if (header.command == UAP_COMMAND_DATA) {
+                data_sent_ns[data_key(header.session_id, header.sequence_number)] = now;
+            }
+        }
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    // Collect the tail of the replies
+    int64_t drain_start = monotonic_ns();
+    while ((monotonic_ns() - drain_start) / 1000000 < REPLAY_DRAIN_MAX_MS && drain_replies(REPLAY_DRAIN_QUIET_MS) > 0) {
+    }
+
+    cout << "Replayed " << sent << " datagrams (" << sent_bytes << " bytes) from " << source_sockets.size()
+         << " sources in " << fixed << setprecision(3) << elapsed << " s: "
+         << setprecision(0) << sent / elapsed << " datagrams/s, " << setprecision(2) << sent_bytes / elapsed / 1e6 << " MB/s" << endl;
+    cout << "Replies: HELLO " << replies[UAP_COMMAND_HELLO] << ", ALIVE " << replies[UAP_COMMAND_ALIVE]
+         << ", NACK " << replies[UAP_COMMAND_NACK] << ", BUSY " << replies[UAP_COMMAND_BUSY] << ", NEED " << replies[UAP_COMMAND_NEED]
+         << ", GOODBYE " << replies[UAP_COMMAND_GOODBYE] << ", other " << other_replies + replies[UAP_COMMAND_DATA] << endl;
+    if (round_trips.count() > 0) {
+        round_trips.print(cout, "DATA -> ALIVE (us)");
+    }
+
+    for (auto& [address, source] : source_sockets) {
+        close(source.fd);
+    }
+    close(epfd);
+    return 0;
+}